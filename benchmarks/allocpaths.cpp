@@ -0,0 +1,199 @@
+/*
+ * @file   allocpaths.cpp
+ * @brief  Latency of the allocation paths the library interposes.
+ *
+ * Every case runs with 1, 2, 4... up to the given number of threads, all
+ * allocating at once. ns/op is the median of three timed runs of each
+ * thread's loop; p99 comes from one more run in which every call is timed
+ * with the TSC, so it includes the cost of reading it. Output is one line
+ * per case and thread count, in the same order from run to run, prefixed
+ * with the label so the results of several builds can be kept together.
+ *
+ * usage: allocpaths [label] [max threads] [ops per thread]
+ */
+
+#include <algorithm>
+#include <new>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#define RUNS 3
+#define MAX_REALLOC_SIZE (64 * 1024)
+
+enum pathType { PATH_MALLOC, PATH_CALLOC, PATH_REALLOC, PATH_MEMALIGN, PATH_NEW };
+
+struct benchCase {
+  const char* name;
+  pathType path;
+  size_t size;
+};
+
+static const benchCase cases[] = {
+  { "malloc", PATH_MALLOC, 16 },
+  { "malloc", PATH_MALLOC, 64 },
+  { "malloc", PATH_MALLOC, 256 },
+  { "malloc", PATH_MALLOC, 1024 },
+  { "malloc", PATH_MALLOC, 4096 },
+  { "malloc", PATH_MALLOC, 65536 },
+  { "calloc", PATH_CALLOC, 256 },
+  { "realloc", PATH_REALLOC, 16 },  // grows by doubling up to MAX_REALLOC_SIZE
+  { "memalign", PATH_MEMALIGN, 256 },
+  { "new", PATH_NEW, 64 },
+};
+
+struct threadArgs {
+  const benchCase* c;
+  long ops;
+  bool timed;
+  pthread_barrier_t* barrier;
+  double elapsed;
+  std::vector<uint32_t>* cycles; // of every call, when timed
+};
+
+static volatile uintptr_t sink;
+
+static inline uint64_t rdtsc() {
+  unsigned int lo, hi;
+  asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)lo) | (((uint64_t)hi) << 32);
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// TSC ticks per ns, measured against the clock
+static double measureTsc() {
+  double start = now();
+  uint64_t tsc = rdtsc();
+  while(now() - start < 0.1) {
+  }
+  return (rdtsc() - tsc) / ((now() - start) * 1e9);
+}
+
+// One call of the path, a realloc chain counts one op for each realloc.
+static inline void runOp(const benchCase* c, size_t* size, void** chain) {
+  void* p = NULL;
+  switch(c->path) {
+    case PATH_MALLOC:
+      p = malloc(c->size);
+      ((char*)p)[0] = 1;
+      break;
+    case PATH_CALLOC:
+      p = calloc(1, c->size);
+      break;
+    case PATH_REALLOC:
+      *chain = realloc(*chain, *size);
+      ((char*)*chain)[*size - 1] = 1;
+      *size *= 2;
+      if(*size > MAX_REALLOC_SIZE) {
+        free(*chain);
+        *chain = NULL;
+        *size = c->size;
+      }
+      return;
+    case PATH_MEMALIGN:
+      if(posix_memalign(&p, 64, c->size) != 0) {
+        abort();
+      }
+      break;
+    case PATH_NEW: {
+      char* q = new char[c->size];
+      q[0] = 1;
+      sink += (uintptr_t)q;
+      delete[] q;
+      return;
+    }
+  }
+  sink += (uintptr_t)p;
+  free(p);
+}
+
+static void* runThread(void* arg) {
+  threadArgs* a = (threadArgs*)arg;
+  const benchCase* c = a->c;
+  size_t size = c->size;
+  void* chain = NULL;
+
+  pthread_barrier_wait(a->barrier);
+  double start = now();
+  if(a->timed) {
+    uint32_t* cycles = a->cycles->data();
+    for(long i = 0; i < a->ops; i++) {
+      uint64_t t = rdtsc();
+      runOp(c, &size, &chain);
+      cycles[i] = (uint32_t)std::min<uint64_t>(rdtsc() - t, UINT32_MAX);
+    }
+  } else {
+    for(long i = 0; i < a->ops; i++) {
+      runOp(c, &size, &chain);
+    }
+  }
+  a->elapsed = now() - start;
+  free(chain);
+  return NULL;
+}
+
+// Run all threads once, return the mean of their ns/op.
+static double runThreads(const benchCase* c, int nthreads, long ops, bool timed, std::vector<std::vector<uint32_t> >& cycles) {
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, nthreads);
+  std::vector<pthread_t> threads(nthreads);
+  std::vector<threadArgs> args(nthreads);
+
+  for(int t = 0; t < nthreads; t++) {
+    args[t] = { c, ops, timed, &barrier, 0, &cycles[t] };
+    pthread_create(&threads[t], NULL, runThread, &args[t]);
+  }
+  double total = 0;
+  for(int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+    total += args[t].elapsed * 1e9 / ops;
+  }
+  pthread_barrier_destroy(&barrier);
+  return total / nthreads;
+}
+
+int main(int argc, char** argv) {
+  const char* label = argc > 1 ? argv[1] : "default";
+  int maxthreads = argc > 2 ? atoi(argv[2]) : 4;
+  long ops = argc > 3 ? atol(argv[3]) : 200000;
+  double tscPerNs = measureTsc();
+
+  printf("%-12s %-9s %6s %7s %10s %10s\n", "label", "path", "size", "threads", "ns/op", "p99(ns)");
+  for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    const benchCase* c = &cases[i];
+    for(int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+      // the buffers for the timed run are allocated before anything is timed
+      std::vector<std::vector<uint32_t> > cycles(nthreads, std::vector<uint32_t>(ops));
+
+      double runs[RUNS];
+      runThreads(c, nthreads, ops / 4, false, cycles); // warm up
+      for(int r = 0; r < RUNS; r++) {
+        runs[r] = runThreads(c, nthreads, ops, false, cycles);
+      }
+      std::sort(runs, runs + RUNS);
+
+      runThreads(c, nthreads, ops, true, cycles);
+      std::vector<uint32_t> all;
+      all.reserve(ops * nthreads);
+      for(int t = 0; t < nthreads; t++) {
+        all.insert(all.end(), cycles[t].begin(), cycles[t].end());
+      }
+      size_t p99 = all.size() * 99 / 100;
+      std::nth_element(all.begin(), all.begin() + p99, all.end());
+
+      printf("%-12s %-9s %6zu %7d %10.1f %10.1f\n", label, c->name, c->size, nthreads,
+          runs[RUNS / 2], all[p99] / tscPerNs);
+      fflush(stdout);
+    }
+  }
+  return 0;
+}
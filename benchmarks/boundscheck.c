@@ -0,0 +1,67 @@
+/*
+ * @file   boundscheck.c
+ * @brief  Cost of the software bounds checks on memcpy and memset.
+ *
+ * Writes go either to the start of an object or into its middle. Both
+ * find the object in the page table, from the starts in the page of the
+ * destination or, past the first page, as the object reaching into it.
+ * Each write stays inside its object.
+ * Build with -fno-builtin, or the compiler inlines the small copies.
+ *
+ * usage: boundscheck [calls per case]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OBJECTS 64
+#define MAX_SIZE 4096
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile size_t sink;
+
+static void report(const char* name, const char* where, size_t size, long calls, double elapsed) {
+  printf("%-7s %-8s %5zu bytes %8.1f ns/call\n", name, where, size, elapsed * 1e9 / calls);
+}
+
+int main(int argc, char** argv) {
+  long calls = argc > 1 ? atol(argv[1]) : 10000000;
+  static const size_t sizes[] = { 16, 256, MAX_SIZE };
+  char* src = (char*)malloc(MAX_SIZE);
+  char* objects[OBJECTS];
+
+  memset(src, 'x', MAX_SIZE);
+  // small objects in between, as in a fragmented heap
+  for(int i = 0; i < OBJECTS; i++) {
+    objects[i] = (char*)malloc(2 * MAX_SIZE);
+    free(malloc(32));
+  }
+
+  for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t size = sizes[s];
+    for(int interior = 0; interior < 2; interior++) {
+      size_t offset = interior ? MAX_SIZE / 2 + 8 : 0;
+      const char* where = interior ? "interior" : "start";
+
+      double start = now();
+      for(long i = 0; i < calls; i++) {
+        sink += (size_t)memcpy(objects[i % OBJECTS] + offset, src, size);
+      }
+      report("memcpy", where, size, calls, now() - start);
+
+      start = now();
+      for(long i = 0; i < calls; i++) {
+        sink += (size_t)memset(objects[i % OBJECTS] + offset, (int)i, size);
+      }
+      report("memset", where, size, calls, now() - start);
+    }
+  }
+  return 0;
+}
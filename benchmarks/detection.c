@@ -0,0 +1,133 @@
+/*
+ * @file   detection.c
+ * @brief  Synthetic program with skewed allocation callsites and planted overflows.
+ *
+ * SITES functions allocate, each from its own callsite. Which site allocates
+ * next is drawn from a Zipf distribution over a permutation of the sites, so
+ * a few of them are hot and most are cold. PLANTED sites, one hot, one warm
+ * and one cold, write one byte past some of their objects. Everything is
+ * drawn from the seed, so a seed is the same program on every run, and the
+ * history file carries over between runs as it would in production.
+ * The planted sites are printed first; a trap in one of them names it.
+ * Link with -rdynamic so that the trap report can name the site functions.
+ *
+ * usage: detection <seed> [allocations]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define SITES 64
+#define PLANTED 3
+#define LIVE_OBJECTS 256
+#define ZIPF_EXPONENT 1.1
+
+static uint64_t rngState;
+
+static uint64_t rng() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 7;
+  rngState ^= rngState << 17;
+  return rngState;
+}
+
+static char* live[LIVE_OBJECTS];
+static unsigned long liveIndex;
+
+// Keep the object alive for a while, so that its watchpoint can trap.
+static void keep(char* p) {
+  unsigned long i = liveIndex++ % LIVE_OBJECTS;
+  free(live[i]);
+  live[i] = p;
+}
+
+#define SITE(n) \
+  __attribute__((noinline)) void site_##n(size_t size, int overflow) { \
+    char* p = (char*)malloc(size); \
+    p[0] = (char)n; \
+    if(overflow) { \
+      ((volatile char*)p)[size] = (char)n; \
+    } \
+    keep(p); \
+  }
+
+#define SITES8(n) SITE(n##0) SITE(n##1) SITE(n##2) SITE(n##3) SITE(n##4) SITE(n##5) SITE(n##6) SITE(n##7)
+SITES8(1) SITES8(2) SITES8(3) SITES8(4) SITES8(5) SITES8(6) SITES8(7) SITES8(8)
+
+typedef void (*siteFunction)(size_t, int);
+
+#define NAMES8(n) site_##n##0, site_##n##1, site_##n##2, site_##n##3, site_##n##4, site_##n##5, site_##n##6, site_##n##7
+static const siteFunction sites[SITES] = {
+  NAMES8(1), NAMES8(2), NAMES8(3), NAMES8(4), NAMES8(5), NAMES8(6), NAMES8(7), NAMES8(8)
+};
+
+static int siteNumber(int index) {
+  return (index / 8 + 1) * 10 + index % 8;
+}
+
+int main(int argc, char** argv) {
+  if(argc < 2) {
+    fprintf(stderr, "usage: %s <seed> [allocations]\n", argv[0]);
+    return 1;
+  }
+  rngState = strtoull(argv[1], NULL, 0) * 0x9E3779B97F4A7C15ULL + 1;
+  long allocations = argc > 2 ? atol(argv[2]) : 1000000;
+
+  // site of each rank, and the cumulative Zipf weights of the ranks
+  int byRank[SITES];
+  double cdf[SITES];
+  double total = 0;
+  for(int i = 0; i < SITES; i++) {
+    byRank[i] = i;
+  }
+  for(int i = SITES - 1; i > 0; i--) {
+    int j = rng() % (i + 1);
+    int t = byRank[i];
+    byRank[i] = byRank[j];
+    byRank[j] = t;
+  }
+  for(int i = 0; i < SITES; i++) {
+    total += 1.0 / pow(i + 1, ZIPF_EXPONENT);
+    cdf[i] = total;
+  }
+
+  // a hot, a warm and a cold site overflow, the colder ones more often
+  static const int rankLow[PLANTED] = { 0, 8, 32 };
+  static const int rankHigh[PLANTED] = { 4, 24, SITES };
+  static const int rateLow[PLANTED] = { 1000, 50, 2 };
+  static const int rateHigh[PLANTED] = { 20000, 500, 20 };
+  size_t sizes[SITES];
+  int rates[SITES] = { 0 };
+  // glibc chunks of these sizes have slack, runs without the library survive the overflows
+  for(int i = 0; i < SITES; i++) {
+    sizes[i] = 16 * (1 + rng() % 16) - 4;
+  }
+  printf("planted");
+  for(int p = 0; p < PLANTED; p++) {
+    int site = byRank[rankLow[p] + rng() % (rankHigh[p] - rankLow[p])];
+    rates[site] = rateLow[p] + rng() % (rateHigh[p] - rateLow[p]);
+    printf(" site_%d", siteNumber(site));
+  }
+  printf("\n");
+  fflush(stdout);
+
+  // the drawing of sites is seeded too, but apart from the layout
+  rngState ^= (uint64_t)allocations;
+  for(long n = 0; n < allocations; n++) {
+    double u = (rng() >> 11) * (1.0 / 9007199254740992.0) * total;
+    int rank = 0;
+    while(rank < SITES - 1 && cdf[rank] < u) {
+      rank++;
+    }
+    int site = byRank[rank];
+    int overflow = rates[site] != 0 && rng() % rates[site] == 0;
+    sites[site](sizes[site], overflow);
+  }
+
+  for(int i = 0; i < LIVE_OBJECTS; i++) {
+    free(live[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+#!/bin/sh
+# Detection rate and overhead of one build and tuning of the library.
+#
+# For every seed, the synthetic program is run RUNS times in a row with the
+# library, starting without a history file, and once without the library.
+# For every run, it prints the share of planted overflows that trapped in
+# that run, the share that trapped in any run so far, and the time over the
+# runs without the library. Tunings are passed as CAUSER_* variables.
+#
+# usage: detection.sh <label> <library> [runs] [seeds] [allocations]
+
+if [ $# -lt 2 ]; then
+  echo "usage: $0 <label> <library> [runs] [seeds] [allocations]" >&2
+  exit 1
+fi
+
+LABEL=$1
+LIBRARY=$(realpath "$2")
+RUNS=${3:-5}
+SEEDS=${4:-10}
+ALLOCATIONS=${5:-1000000}
+PROGRAM=$(realpath "$(dirname "$0")")/detection
+HISTORY=${PROGRAM}_callstack.info
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+
+now() {
+  date +%s%N
+}
+
+BASELINE=0
+for seed in $(seq 1 "$SEEDS"); do
+  rm -f "$HISTORY" "$HISTORY.lock"
+  start=$(now)
+  "$PROGRAM" "$seed" "$ALLOCATIONS" > /dev/null
+  BASELINE=$((BASELINE + $(now) - start))
+  : > "$SCRATCH/caught.$seed"
+
+  for run in $(seq 1 "$RUNS"); do
+    start=$(now)
+    LD_PRELOAD=$LIBRARY "$PROGRAM" "$seed" "$ALLOCATIONS" > "$SCRATCH/out" 2> "$SCRATCH/err"
+    echo $(($(now) - start)) >> "$SCRATCH/time.$run"
+
+    # the site of a trap is the first frame named after the overwrite is detected
+    planted=$(grep '^planted' "$SCRATCH/out" | cut -d' ' -f2-)
+    caught=$(awk '/problem is detected at/ { found = 1; next }
+        found && /dli_sname site_/ { sub(/.*dli_sname /, ""); print; found = 0 }' "$SCRATCH/err" | sort -u)
+    n=0
+    for site in $planted; do
+      if echo "$caught" | grep -qx "$site"; then
+        n=$((n + 1))
+        echo "$site" >> "$SCRATCH/caught.$seed"
+      fi
+    done
+    echo "$n $(echo $planted | wc -w) $(sort -u "$SCRATCH/caught.$seed" | wc -l)" >> "$SCRATCH/rate.$run"
+  done
+done
+rm -f "$HISTORY" "$HISTORY.lock"
+
+printf "%-16s %4s %8s %11s %9s\n" "label" "run" "caught" "cumulative" "overhead"
+for run in $(seq 1 "$RUNS"); do
+  awk -v label="$LABEL" -v run="$run" -v baseline="$BASELINE" -v timefile="$SCRATCH/time.$run" '
+    { caught += $1; planted += $2; cumulative += $3 }
+    END {
+      while((getline t < timefile) > 0) {
+        total += t
+      }
+      printf "%-16s %4d %7.1f%% %10.1f%% %8.1f%%\n", label, run,
+          100 * caught / planted, 100 * cumulative / planted, 100 * (total - baseline) / baseline
+    }' "$SCRATCH/rate.$run"
+done
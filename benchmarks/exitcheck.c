@@ -0,0 +1,32 @@
+/*
+ * @file   exitcheck.c
+ * @brief  Cost of the integrity check at exit: memory scan vs. object registry.
+ *
+ * Keeps many small objects alive next to a large, partly touched buffer and
+ * exits, so that the library prints how long its final check took.
+ *
+ * usage: exitcheck [objects] [buffer MB]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char** argv) {
+  long objects = argc > 1 ? atol(argv[1]) : 1000000;
+  long buffermb = argc > 2 ? atol(argv[2]) : 512;
+
+  void** live = (void**)malloc(objects * sizeof(void*));
+  for(long i = 0; i < objects; i++) {
+    live[i] = malloc(16 + (i & 127));
+    memset(live[i], 0, 16);
+  }
+
+  // touch one quarter of the buffer, the rest stays unpopulated
+  size_t size = (size_t)buffermb << 20;
+  char* buffer = (char*)malloc(size);
+  memset(buffer, 1, size / 4);
+
+  printf("%ld live objects, %ld MB buffer\n", objects, buffermb);
+  return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * @file   strings.c
+ * @brief  Throughput of the string routines, run with and without the library.
+ *
+ * Each routine is called on strings of several lengths at a few alignments.
+ * The strings end well before the end of their buffers, so that a watched
+ * tail sentinel is never touched and only the routines themselves are timed.
+ * Build with -fno-builtin, or the compiler folds the calls away.
+ *
+ * usage: strings [megabytes per case]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_LENGTH 65536
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile size_t sink;
+
+static void report(const char* name, size_t len, long calls, double elapsed) {
+  printf("%-8s %6zu bytes %8.1f ns/call %7.2f GB/s\n", name, len,
+      elapsed * 1e9 / calls, (double)len * calls / elapsed / 1e9);
+}
+
+int main(int argc, char** argv) {
+  long megabytes = argc > 1 ? atol(argv[1]) : 256;
+  static const size_t lengths[] = { 8, 64, 1024, MAX_LENGTH };
+
+  char* src = (char*)malloc(MAX_LENGTH + 128);
+  char* other = (char*)malloc(MAX_LENGTH + 128);
+  char* dst = (char*)malloc(MAX_LENGTH + 128);
+
+  for(size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    size_t len = lengths[l];
+    long calls = (megabytes << 20) / len;
+    if(calls > 20000000) {
+      calls = 20000000;
+    }
+
+    // start at 3 different offsets, the other string of strcmp at yet another
+    char* s[3];
+    char* t[3];
+    for(int a = 0; a < 3; a++) {
+      s[a] = src + a * 5;
+      t[a] = other + a * 7 + 1;
+      memset(s[a], 'x', len);
+      s[a][len] = '\0';
+      memcpy(t[a], s[a], len + 1);
+    }
+
+    double start = now();
+    for(long i = 0; i < calls; i++) {
+      sink += strlen(s[i % 3]);
+    }
+    report("strlen", len, calls, now() - start);
+
+    start = now();
+    for(long i = 0; i < calls; i++) {
+      sink += strcmp(s[i % 3], t[i % 3]);
+    }
+    report("strcmp", len, calls, now() - start);
+
+    start = now();
+    for(long i = 0; i < calls; i++) {
+      sink += (size_t)strcpy(dst, s[i % 3]);
+    }
+    report("strcpy", len, calls, now() - start);
+
+    start = now();
+    for(long i = 0; i < calls; i++) {
+      sink += (size_t)strncpy(dst, s[i % 3], len + 16);
+    }
+    report("strncpy", len, calls, now() - start);
+
+    start = now();
+    for(long i = 0; i < calls; i++) {
+      sink += strspn(s[i % 3], "xyz");
+    }
+    report("strspn", len, calls, now() - start);
+  }
+  return 0;
+}
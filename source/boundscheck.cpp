@@ -0,0 +1,101 @@
+/*
+ * @file   boundscheck.cpp
+ * @brief  Switch of the software bounds checks, their page tables and report.
+ */
+
+#ifdef SOFTWARE_BOUNDS_CHECK
+#include "boundscheck.hh"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "causer.hh"
+#include "watchpoint.hh"
+
+#ifndef ENABLE_EVIDENCE
+#error "SOFTWARE_BOUNDS_CHECK needs the object guards, ENABLE_EVIDENCE is required"
+#endif
+
+void boundscheck::initialize() {
+  char* mode = getenv("CAUSER_BOUNDS_CHECK");
+  if(mode != NULL) {
+    _enabled = atoi(mode) != 0;
+  } else if(!watchpoint::getInstance().isHardwareAvailable()) {
+    fprintf(stderr, "Hardware breakpoints are unavailable, checking mem*/str* writes in software\n");
+    _enabled = true;
+  }
+  if(_enabled) {
+    void* ptr = mmap(NULL, xdefines::BOUNDS_REGIONS * sizeof(boundsPage*), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(ptr == MAP_FAILED) {
+      fprintf(stderr, "Failed to allocate the bounds check tables: %s\n", strerror(errno));
+      _enabled = false;
+      return;
+    }
+    _regions = (boundsPage**)ptr;
+  }
+}
+
+boundsPage* boundscheck::mapRegion(uintptr_t region) {
+  size_t size = xdefines::BOUNDS_REGION_PAGES * sizeof(boundsPage);
+  void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(ptr == MAP_FAILED) {
+    return NULL;
+  }
+  boundsPage* expected = NULL;
+  if(!__atomic_compare_exchange_n(&_regions[region], &expected, (boundsPage*)ptr, false,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    // another thread mapped it first
+    munmap(ptr, size);
+    return expected;
+  }
+  return (boundsPage*)ptr;
+}
+
+// Set or clear the start of obj, and the pages it reaches into. Objects do
+// not overlap, so a page is reached into by one of them at a time.
+void boundscheck::updateObject(objectGuard* obj, bool add) {
+  uintptr_t start = (uintptr_t)obj->getStartPtr();
+  if(start % xdefines::BOUNDS_GRANULE != 0) {
+    return;
+  }
+  boundsPage* page = getPage(start, add);
+  if(page == NULL) {
+    return;
+  }
+  size_t granule = (start & xdefines::PAGE_SIZE_MASK) / xdefines::BOUNDS_GRANULE;
+  uint64_t bit = 1UL << (granule % 64);
+  if(add) {
+    __atomic_fetch_or(&page->starts[granule / 64], bit, __ATOMIC_RELEASE);
+  } else {
+    __atomic_fetch_and(&page->starts[granule / 64], ~bit, __ATOMIC_RELEASE);
+  }
+
+  // the size of an object with a corrupted head is garbage, the pages it
+  // reached into keep it, and the lookup skips it for its head
+  if(!obj->isGoodHead()) {
+    return;
+  }
+  // the tail sentinel is part of the object
+  uintptr_t last = (start + obj->getObjectSize() + xdefines::SENTINEL_SIZE - 1) / xdefines::PAGE_SIZE;
+  for(uintptr_t p = start / xdefines::PAGE_SIZE + 1; p <= last; p++) {
+    page = getPage(p * xdefines::PAGE_SIZE, add);
+    if(page == NULL) {
+      continue;
+    }
+    if(add) {
+      __atomic_store_n(&page->cover, obj, __ATOMIC_RELEASE);
+    } else {
+      objectGuard* expected = obj;
+      __atomic_compare_exchange_n(&page->cover, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void boundscheck::report(const char* op, objectGuard* obj, void* dst, size_t size, void* ip) {
+  causer::getInstance().reportBoundsOverflow(op, obj, dst, size, ip);
+}
+#endif
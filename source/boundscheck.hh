@@ -0,0 +1,144 @@
+#if !defined(_BOUNDSCHECK_H)
+#define _BOUNDSCHECK_H
+
+/*
+ * @file   boundscheck.hh
+ * @brief  Check the destination of mem* and str* writes in software.
+ *
+ * Without hardware breakpoints, an overflow is only seen when its object is
+ * freed. In this mode the interposed routines look up the guarded object
+ * holding the destination and report a write that goes past it at the call
+ * itself. Each page has a bitmap of the 16-byte granules where a guarded
+ * object starts, and the object that reaches into it from an earlier page,
+ * so the object holding an address is found in O(1) from its page alone.
+ * The tables of a region of the address space are mapped when the first
+ * object in it is added. Objects allocated before the checks were turned
+ * on are not in them, writes to those are only seen by the tail check at
+ * free.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+
+#include "xdefines.hh"
+#include "objectguard.hh"
+
+// Guarded objects of one page.
+struct boundsPage {
+  objectGuard* cover;   // starts in an earlier page and reaches into this one
+  uint64_t starts[xdefines::PAGE_SIZE / xdefines::BOUNDS_GRANULE / 64];
+};
+
+class boundscheck {
+
+  public:
+    static boundscheck& getInstance() {
+      static char buf[sizeof(boundscheck)];
+      static boundscheck* theOneTrueObject = new (buf) boundscheck();
+      return *theOneTrueObject;
+    }
+
+    // Turn the checks on if hardware breakpoints can not be used, or as
+    // CAUSER_BOUNDS_CHECK says.
+    void initialize();
+
+    bool isEnabled() { return _enabled; }
+
+    // Track obj once its guard is set, and stop before it is freed or resized.
+    void addObject(objectGuard* obj) {
+      if(_enabled) {
+        updateObject(obj, true);
+      }
+    }
+
+    void removeObject(objectGuard* obj) {
+      if(_enabled) {
+        updateObject(obj, false);
+      }
+    }
+
+    // Check a write of size bytes to dst by op, called from ip.
+    void checkWrite(void* dst, size_t size, const char* op, void* ip) {
+      // our own writes are done with the checks disabled
+      if(!_enabled || size == 0 || !isCauser()) {
+        return;
+      }
+      objectGuard* obj = findObject(dst);
+      if(obj == NULL) {
+        return;
+      }
+      uintptr_t start = (uintptr_t)obj->getStartPtr();
+      if((uintptr_t)dst < start || (uintptr_t)dst + size > start + obj->getObjectSize()) {
+        report(op, obj, dst, size, ip);
+      }
+    }
+
+  private:
+    boundscheck() : _enabled(false), _regions(NULL) {}
+    ~boundscheck() {}
+
+    // The entry of the page of addr, NULL if its region has no tables and
+    // create is false, or if they can not be mapped.
+    boundsPage* getPage(uintptr_t addr, bool create) {
+      uintptr_t region = addr >> xdefines::BOUNDS_REGION_SHIFT;
+      if(region >= xdefines::BOUNDS_REGIONS) {
+        return NULL;
+      }
+      boundsPage* pages = __atomic_load_n(&_regions[region], __ATOMIC_ACQUIRE);
+      if(pages == NULL) {
+        if(!create) {
+          return NULL;
+        }
+        pages = mapRegion(region);
+        if(pages == NULL) {
+          return NULL;
+        }
+      }
+      return &pages[(addr / xdefines::PAGE_SIZE) & (xdefines::BOUNDS_REGION_PAGES - 1)];
+    }
+
+    // The object holding addr: the last one starting in its page up to
+    // addr, or the one reaching into the page.
+    objectGuard* findObject(void* dst) {
+      uintptr_t addr = (uintptr_t)dst;
+      boundsPage* page = getPage(addr, false);
+      if(page == NULL) {
+        return NULL;
+      }
+      size_t granule = (addr & xdefines::PAGE_SIZE_MASK) / xdefines::BOUNDS_GRANULE;
+      size_t word = granule / 64;
+      uint64_t bits = __atomic_load_n(&page->starts[word], __ATOMIC_ACQUIRE) & (~0UL >> (63 - granule % 64));
+      while(bits == 0 && word > 0) {
+        bits = __atomic_load_n(&page->starts[--word], __ATOMIC_ACQUIRE);
+      }
+      objectGuard* obj;
+      if(bits != 0) {
+        size_t start = word * 64 + 63 - __builtin_clzl(bits);
+        obj = getObjectGuard((void*)((addr & ~xdefines::PAGE_SIZE_MASK) + start * xdefines::BOUNDS_GRANULE));
+      } else {
+        obj = __atomic_load_n(&page->cover, __ATOMIC_ACQUIRE);
+        if(obj == NULL) {
+          return NULL;
+        }
+      }
+      // a corrupted head is reported at free, behind the tail sentinel is
+      // memory of an object that is not tracked
+      if(!obj->isGoodHead()
+          || addr >= (uintptr_t)obj->getStartPtr() + obj->getObjectSize() + xdefines::SENTINEL_SIZE) {
+        return NULL;
+      }
+      return obj;
+    }
+
+    void updateObject(objectGuard* obj, bool add);
+    boundsPage* mapRegion(uintptr_t region);
+    void report(const char* op, objectGuard* obj, void* dst, size_t size, void* ip);
+
+    bool _enabled;
+    boundsPage** _regions;
+};
+
+#endif
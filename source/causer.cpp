@@ -1,9 +1,39 @@
 
 #include "causer.hh"
 #include <dlfcn.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <time.h>
+#include <vector>
 
 #include "selfmap.hh"
 #include "objectguard.hh"
+#include "phases.hh"
+#include "tracer.hh"
+#include "policy.hh"
+#ifdef ENABLE_EVIDENCE_SCAN_MEMORY
+#include "memscan.hh"
+#endif
+#ifdef ENABLE_OBJECT_REGISTRY
+#include "registry.hh"
+#endif
+#ifdef SHARED_CALLSITE_TABLE
+#include "sharedtable.hh"
+#endif
+#ifdef OBJECT_MAP
+#include "objectmap.hh"
+#endif
+#ifdef SOFTWARE_BOUNDS_CHECK
+#include "trapreport.hh"
+#endif
+#ifdef LIVE_STATS
+#include "livestats.hh"
+#endif
+
+#if defined(BACKGROUND_VERIFIER) && !defined(ENABLE_OBJECT_REGISTRY)
+#error "BACKGROUND_VERIFIER walks the object registry, ENABLE_OBJECT_REGISTRY is required"
+#endif
 
 extern "C" {
   extern uint32_t arc4random_uniform(uint32_t upper_bound);
@@ -111,48 +141,128 @@ unsigned long getCallSiteKey(void **callsites) {
   return getStackOffset();
 }
 
-void causer::updateWatchedInfo(callstack* foundcs, mallocOpType type) {
-  pthread_spin_lock(&foundcs->lock);
-  // update called number
-  foundcs->calledCounter++;
-  foundcs->periodcalled++;
-  if (type == MALLOC_OP_CALLED){
-    if(foundcs->watchedRatio != xdefines::MAX_WATCH_RATIO_UPPERBOUND)
-      foundcs->watchedRatio -= xdefines::CALLED_REDUCTION;
-  }else if (type == MALLOC_OP_WATCHED){
-    // update watched number as well
-    foundcs->watchedCounter++;
-    if(foundcs->watchedRatio != xdefines::MAX_WATCH_RATIO_UPPERBOUND)
-      foundcs->watchedRatio *= xdefines::WATCHED_REDUCTION * 0.1;
+#ifdef SHARED_CALLSITE_TABLE
+// Publish our watch, then apply the watches of other processes and adopt
+// an overflow confirmed by any of them. Called with the callsite lock held.
+static void syncSharedCallsite(callstack* cs, mallocOpType type) {
+  if(cs->shared == NULL) {
+    cs->shared = sharedtable::getInstance().lookup(cs->stack[0], cs->offset);
+    if(sharedtable::isShared(cs->shared)) {
+      cs->sharedWatched = __atomic_load_n(&cs->shared->watched, __ATOMIC_RELAXED);
+    }
+  }
+  sharedCallsite* s = cs->shared;
+  if(!sharedtable::isShared(s)) {
+    return;
   }
 
-  if(foundcs->watchedRatio < xdefines::REDUCTION_TO_MIN){
-    foundcs->watchedRatio = xdefines::REDUCTION_TO_MIN;
+  unsigned int watched;
+  unsigned int others;
+  if(type == MALLOC_OP_WATCHED) {
+    watched = __atomic_add_fetch(&s->watched, 1, __ATOMIC_RELAXED);
+    others = watched - cs->sharedWatched - 1;
+  } else {
+    watched = __atomic_load_n(&s->watched, __ATOMIC_RELAXED);
+    others = watched - cs->sharedWatched;
   }
+  cs->sharedWatched = watched;
+
+  if(cs->watchedRatio == xdefines::MAX_WATCH_RATIO_UPPERBOUND) {
+    __atomic_store_n(&s->confirmed, 1, __ATOMIC_RELAXED);
+  } else if(__atomic_load_n(&s->confirmed, __ATOMIC_RELAXED)) {
+    cs->watchedRatio = xdefines::MAX_WATCH_RATIO_UPPERBOUND;
+  } else {
+    for(unsigned int i = 0; i < others && i < xdefines::MAX_SHARED_REDUCTIONS; i++) {
+      cs->watchedRatio *= tuning.watchedReduction * 0.1;
+    }
+  }
+}
+
+// Let other processes know about an overflow right away.
+static void confirmSharedCallsite(callstack* cs) {
+  if(sharedtable::isShared(cs->shared)) {
+    __atomic_store_n(&cs->shared->confirmed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Seed the shared table with a loaded callsite, without counting it twice
+// when several processes load the same history.
+static void seedSharedCallsite(callstack* cs) {
+  cs->shared = sharedtable::getInstance().lookup(cs->stack[0], cs->offset);
+  cs->sharedWatched = 0;
+  sharedCallsite* s = cs->shared;
+  if(!sharedtable::isShared(s)) {
+    return;
+  }
+
+  if(cs->watchedRatio == xdefines::MAX_WATCH_RATIO_UPPERBOUND) {
+    __atomic_store_n(&s->confirmed, 1, __ATOMIC_RELAXED);
+  }
+  unsigned int watched = __atomic_load_n(&s->watched, __ATOMIC_RELAXED);
+  while(watched < (unsigned int)cs->watchedCounter
+      && !__atomic_compare_exchange_n(&s->watched, &watched, cs->watchedCounter, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  cs->sharedWatched = __atomic_load_n(&s->watched, __ATOMIC_RELAXED);
+}
+#endif
+
+// An overflow is confirmed, always watch this callsite from now on.
+static void confirmOverflowCallsite(callstack* cs) {
+  pthread_spin_lock(&cs->lock);
+  cs->watchedRatio = xdefines::MAX_WATCH_RATIO_UPPERBOUND;
+  cs->version++;
+#ifdef SHARED_CALLSITE_TABLE
+  confirmSharedCallsite(cs);
+#endif
+#ifdef LIVE_STATS
+  livestats::getInstance().noteCallsite(cs);
+#endif
+  pthread_spin_unlock(&cs->lock);
+}
+
+void causer::updateWatchedInfo(callstack* foundcs, mallocOpType type) {
+  PHASE_START(updateStart);
+  pthread_spin_lock(&foundcs->lock);
+  // update called and watched numbers, and the ratio
+  policy::countAllocation(foundcs, type == MALLOC_OP_WATCHED);
+  foundcs->version++;
+
+#ifdef SHARED_CALLSITE_TABLE
+  syncSharedCallsite(foundcs, type);
+#endif
+
+  policy::clampRatio(foundcs);
 
   // update complete callsite information
   if(foundcs->depth == 0){
+    PHASE_START(callsitesStart);
     foundcs->depth = getCallsites(foundcs->stack);
+    PHASE_STOP(callsitesStart, PHASE_CALLSITES);
   }
 
-  unsigned long now = getCurrentTime();
-  if((now-foundcs->period)>xdefines::MAX_WATCH_PERIOD) {
-    // || unlikely(now < foundcs->period)) { // FIXME whether time has overflow
-    //fprintf(stderr, "reset period %lu, old %lu\n", now, foundcs->period);
-    foundcs->periodcalled = 0;
-    foundcs->period = now;
-  }
+  policy::updatePeriod(foundcs, getCurrentTime());
 
+#ifdef LIVE_STATS
+  if(type == MALLOC_OP_WATCHED) {
+    livestats::getInstance().noteCallsite(foundcs);
+  }
+#endif
   pthread_spin_unlock(&foundcs->lock);
+  PHASE_STOP(updateStart, PHASE_UPDATE);
 }
 
 // set watchpoint on specific address
 bool causer::startWatch(void* ptr, size_t sz){
+  PHASE_START(keyStart);
   callstack curstack;
   curstack.offset = getCallSiteKey(curstack.stack);
   curstack.hashcode = hash_value(curstack.stack[0], (unsigned int)curstack.offset); 
+  PHASE_STOP(keyStart, PHASE_CALLSITE_KEY);
 
+  PHASE_START(lookupStart);
   callstack* foundcs = _csMap.findOrAdd(curstack, sizeof(callstack), curstack);
+  PHASE_STOP(lookupStart, PHASE_LOOKUP);
+  TRACE_CALLSITE(foundcs);
 
 #ifdef ENABLE_EVIDENCE
   objectGuard* obj = getObjectGuard(ptr);
@@ -169,27 +279,32 @@ bool causer::startWatch(void* ptr, size_t sz){
   void* watchptr = (void*)((intptr_t)ptr+sz);
 
 #ifdef PREEMPT_REPLACEMENT
-  int rnd = 0;
-  if(foundcs->periodcalled < xdefines::MAX_WATCH_THRESHOLD){
+  bool firstAllocations = policy::inFirstAllocations(foundcs);
+  if(firstAllocations){
 #endif
 
     /** set watchpoint */
-    if(unlikely(watchpoint::getInstance().getWatchpointsNumber() < xdefines::MAX_WATCHPOINTS)){
-      if(unlikely(watchpoint::getInstance().setWatchpoint(watchptr, ptr, sz, foundcs, false))){
+    if(unlikely(watchpoint::getInstance().getWatchpointsNumber() < tuning.watchpoints)){
+      PHASE_START(setStart);
+      bool installed = watchpoint::getInstance().setWatchpoint(watchptr, ptr, sz, foundcs, false);
+      PHASE_STOP(setStart, PHASE_SET_WATCHPOINT);
+      if(unlikely(installed)){
         updateWatchedInfo(foundcs, MALLOC_OP_WATCHED);
         return true;
       }
     }
 
 #ifdef PREEMPT_REPLACEMENT
-    // use arc4random to decide whether we set watchpoint or not
-    rnd = arc4random_uniform(xdefines::MAX_WATCH_RATIO_UPPERBOUND);
-  } else {
-    rnd = arc4random_uniform(xdefines::MAX_WATCH_RATIO_SECOND_UPPERBOUND);
   }
 
-  if(rnd <= foundcs->watchedRatio){
-    if(watchpoint::getInstance().setWatchpoint(watchptr, ptr, sz, foundcs, true)){
+  // use arc4random to decide whether we set watchpoint or not
+  int rnd = arc4random_uniform(policy::drawBound(firstAllocations));
+
+  if(policy::drawWins(foundcs, rnd)){
+    PHASE_START(setStart);
+    bool installed = watchpoint::getInstance().setWatchpoint(watchptr, ptr, sz, foundcs, true);
+    PHASE_STOP(setStart, PHASE_SET_WATCHPOINT);
+    if(installed){
       updateWatchedInfo(foundcs, MALLOC_OP_WATCHED);
       return true;
     }
@@ -213,35 +328,73 @@ void causer::stopWatch(void* ptr){
 }
 
 #ifdef ENABLE_EVIDENCE
+// Look for a head sentinel in front of obj, without leaving its page.
+static objectGuard* findPredecessorInPage(objectGuard* obj) {
+  size_t* first = (size_t*)(((uintptr_t)obj & ~xdefines::PAGE_SIZE_MASK) + sizeof(objectGuard) - sizeof(size_t));
+  for(size_t* it = (size_t*)obj - 1; it >= first; it--) {
+    if(*it == xdefines::SENTINEL_HEAD_WORD) {
+      return getObjectGuard(it + 1);
+    }
+  }
+  return NULL;
+}
+
+// Find the object whose overflow has corrupted the head of obj.
+static objectGuard* findPredecessor(objectGuard* obj) {
+  objectGuard* pred = NULL;
+#ifdef OBJECT_MAP
+  pred = objectmap::getInstance().findPredecessor(obj);
+#endif
+  if(pred == NULL) {
+    pred = findPredecessorInPage(obj);
+  }
+  // the guard must describe an object that ends in front of obj
+  if(pred == NULL || pred >= obj || !pred->isGoodHead()
+      || (uintptr_t)pred->getTailSentinel() < (uintptr_t)pred->getStartPtr()
+      || (uintptr_t)pred->getTailSentinel() + xdefines::SENTINEL_SIZE > (uintptr_t)obj) {
+    return NULL;
+  }
+  return pred;
+}
+
 void* causer::checkPointer(void* addr){
   objectGuard* obj = getObjectGuard(addr);
   if(obj->isGoodHead()){
     if(!obj->isGoodTail()){
       //fprintf(stderr, "[check at free] Object is overflowed. Tail canary is %zu\n", *obj->getTailSentinel());
       callstack* cs = (callstack *)obj->getCallstack();
+      // objects that were not sampled, e.g. turned away by the governor, have no callsite
       if(cs != NULL){
-        pthread_spin_lock(&cs->lock);
-        cs->watchedRatio = xdefines::MAX_WATCH_RATIO_UPPERBOUND;
-        pthread_spin_unlock(&cs->lock);
+        confirmOverflowCallsite(cs);
 #ifdef STATISTICS
         fprintf(stderr, "[check at free] Object %p at callstack %lu is overflowed. Tail canary is %zu\n", addr, cs->index, *obj->getTailSentinel());
 #else
         fprintf(stderr, "[check at free] Object %p is overflowed. Tail canary is %zu\n", addr, *obj->getTailSentinel());
 #endif
+      }else{
+        fprintf(stderr, "[check at free] Object %p is overflowed, its allocation site is unknown. Tail canary is %zu\n", addr, *obj->getTailSentinel());
       }
     }
   }else{
-    // find previous object
-    size_t* prev = (size_t *)obj;
-    while(*(prev--) != xdefines::SENTINEL_HEAD_WORD){}
-
-    callstack* cs = *(callstack **)prev; 
-    if(cs != NULL){
-      pthread_spin_lock(&cs->lock);
-      cs->watchedRatio = xdefines::MAX_WATCH_RATIO_UPPERBOUND;
-      pthread_spin_unlock(&cs->lock);
+    // only blame the previous object if its tail has been overwritten too
+    objectGuard* prev = findPredecessor(obj);
+    if(prev != NULL && !prev->isGoodTail()){
+      callstack* cs = (callstack *)prev->getCallstack();
+      if(cs != NULL){
+        confirmOverflowCallsite(cs);
+      }
+      fprintf(stderr, "[check at free] Object %p is overflowed into object %p. Tail canary is %zu\n", prev->getStartPtr(), addr, *prev->getTailSentinel());
+    }else{
+      fprintf(stderr, "[check at free] Object %p has a corrupted head, the object in front of it is unknown\n", addr);
     }
 
+#ifdef OBJECT_MAP
+    // walks must not start from its overwritten chunk header
+    objectmap::getInstance().removeCorruptedObject(obj);
+#endif
+    // neither its real pointer nor its size can be trusted, and handing libc
+    // something that is not a chunk would corrupt the heap: the object is
+    // leaked on purpose, free(NULL) does nothing
     return NULL;
   }
 
@@ -254,44 +407,334 @@ void* causer::checkPointer(void* addr){
 }
 #endif
 
+#ifdef SOFTWARE_BOUNDS_CHECK
+// A write out of obj is reported at the call, once for every (caller, callsite).
+void causer::reportBoundsOverflow(const char* op, objectGuard* obj, void* dst, size_t size, void* ip) {
+  COND_DISABLE;
+
+  callstack* cs = (callstack *)obj->getCallstack();
+  if(trapreport::getInstance().recordHit(ip, cs) == 1) {
+    if(cs != NULL) {
+      confirmOverflowCallsite(cs);
+    }
+    fprintf(stderr, "[check at %s] Writing %zu bytes to %p overflows object %p of %zu bytes\n",
+        op, size, dst, obj->getStartPtr(), obj->getObjectSize());
+
+    void* array[256];
+    int frames = backtrace(array, 256);
+    reportOverflow(false, cs, array, 0, frames);
+  }
+
+  COND_ENABLE;
+}
+#endif
+
+#ifdef BACKGROUND_VERIFIER
+// Check a pinned object, which can not be freed meanwhile.
+static bool verifyObject(objectGuard* obj, void*) {
+  if(!obj->isGoodHead()) {
+    // overwritten by its predecessor, which is reported when its tail is checked
+    fprintf(stderr, "[check in background] Object %p has a corrupted head\n", obj->getStartPtr());
+    return true;
+  }
+  if(obj->isGoodTail()) {
+    return false;
+  }
+  callstack* cs = (callstack *)obj->getCallstack();
+  if(cs != NULL){
+    confirmOverflowCallsite(cs);
+  }
+#ifdef STATISTICS
+  fprintf(stderr, "[check in background] Object %p at callstack %lu is overflowed. Tail canary is %zu\n", obj->getStartPtr(), cs != NULL ? cs->index : 0, *obj->getTailSentinel());
+#else
+  fprintf(stderr, "[check in background] Object %p is overflowed. Tail canary is %zu\n", obj->getStartPtr(), *obj->getTailSentinel());
+#endif
+  return true;
+}
+
+static long getElapsedUs(struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Walk the registry incrementally, using at most _verifyBudget us of every
+// VERIFY_PERIOD us. Once a pass is done, wait VERIFY_PASS_PAUSE before the next.
+void* causer::verifier(void*) {
+  causer& c = causer::getInstance();
+
+  // only run when a cpu would be idle otherwise
+  struct sched_param param;
+  param.sched_priority = 0;
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+  size_t cursor = 0;
+  while(!c._verifierStopped) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    bool passDone = false;
+    c._verifierLock.lock();
+    while(!c._verifierStopped && getElapsedUs(&start) < (long)c._verifyBudget) {
+      size_t visited = registry::getInstance().verifyObjects(&cursor, xdefines::VERIFY_BATCH, verifyObject, NULL);
+      if(cursor == 0) {
+        passDone = true;
+        break;
+      }
+      if(visited == 0) {
+        break;
+      }
+    }
+    c._verifierLock.unlock();
+
+    long used = getElapsedUs(&start);
+    long pause = passDone ? xdefines::VERIFY_PASS_PAUSE : xdefines::VERIFY_PERIOD - used;
+    if(pause > 0) {
+      struct timespec ts;
+      ts.tv_sec = pause / 1000000;
+      ts.tv_nsec = (pause % 1000000) * 1000;
+      nanosleep(&ts, NULL);
+    }
+  }
+  return NULL;
+}
+
+void causer::startVerifier() {
+  _verifyBudget = tuning.verifyBudget;
+  if(_verifyBudget == 0) {
+    return;
+  }
+
+  pthread_t tid;
+  // the verifier is not registered in xthread, so it is never watched itself
+  if(Real::pthread_create(&tid, NULL, causer::verifier, NULL) != 0) {
+    fprintf(stderr, "Failed to create the background verifier\n");
+  }
+}
+
+// Wait for the slice in progress, the final check should not race with it.
+void causer::stopVerifier() {
+  _verifierLock.lock();
+  _verifierStopped = true;
+  _verifierLock.unlock();
+}
+#endif
+
 #ifdef ENABLE_EVIDENCE_SCAN_MEMORY
+// A part of a data mapping, scanned by one worker.
+struct scanChunk {
+  size_t* start;
+  size_t* end;
+  size_t* limit;    // end of the mapping
+};
+
+struct scanJob {
+  scanChunk* chunks;
+  size_t nchunks;
+  size_t next;      // next chunk to scan
+  size_t skipped;   // bytes of pages never touched
+  findHeadWordFunc findHeadWord;
+};
+
+static void reportOverflowInTheEnd(objectGuard* obj, void* ptr) {
+  callstack* cs = (callstack *)obj->getCallstack();
+  if(cs != NULL){
+    confirmOverflowCallsite(cs);
+  }
+#ifdef STATISTICS
+  fprintf(stderr, "[check in the end] Object %p at callstack %lu is overflowed. Tail canary is %zu\n", ptr, cs != NULL ? cs->index : 0, *obj->getTailSentinel());
+#else
+  fprintf(stderr, "[check in the end] Object %p is overflowed. Tail canary is %zu\n", ptr, *obj->getTailSentinel());
+#endif
+}
+
+// Check all objects whose head is in [it, end). Return where the scan stopped,
+// which is after end if the last object crosses it.
+static size_t* checkObjectsInRange(scanJob* job, size_t* it, size_t* end, size_t* limit) {
+  while(it < end) {
+    it = job->findHeadWord(it, end);
+    if(it == end) {
+      break;
+    }
+    objectGuard* obj = getObjectGuard(it+1);
+    size_t* tail = obj->getTailSentinel();
+    if(tail <= it || tail >= limit) {
+      // not an object, just the same bits
+      it++;
+      continue;
+    }
+    if(!obj->isGoodTail()){
+      reportOverflowInTheEnd(obj, it+1);
+    }else{
+      // jump to end
+      it = (size_t *)((intptr_t)tail & xdefines::ALLOCATION_MASK); 
+    }
+    it++;
+  }
+  return it;
+}
+
+// Scan the pages of a chunk that have ever been touched.
+static void scanOneChunk(scanJob* job, scanChunk* chunk, int pagemap, size_t* skipped) {
+  if(pagemap == -1) {
+    checkObjectsInRange(job, chunk->start, chunk->end, chunk->limit);
+    return;
+  }
+
+  uint64_t entries[xdefines::PAGEMAP_BATCH];
+  size_t* it = chunk->start;
+  uintptr_t page = (uintptr_t)chunk->start;
+  uintptr_t end = (uintptr_t)chunk->end;
+  while(page < end) {
+    size_t npages = (end - page) / xdefines::PAGE_SIZE;
+    if(npages > xdefines::PAGEMAP_BATCH) {
+      npages = xdefines::PAGEMAP_BATCH;
+    }
+    if(!readPagemap(pagemap, page, entries, npages)) {
+      if(it < (size_t*)page) {
+        it = (size_t*)page;
+      }
+      checkObjectsInRange(job, it, chunk->end, chunk->limit);
+      return;
+    }
+
+    size_t i = 0;
+    while(i < npages) {
+      size_t first = i;
+      while(i < npages && isPageTouched(entries[i])) {
+        i++;
+      }
+      if(i > first) {
+        size_t* runstart = (size_t*)(page + first * xdefines::PAGE_SIZE);
+        size_t* runend = (size_t*)(page + i * xdefines::PAGE_SIZE);
+        if(it < runstart) {
+          it = runstart;
+        }
+        it = checkObjectsInRange(job, it, runend, chunk->limit);
+      }
+      while(i < npages && !isPageTouched(entries[i])) {
+        *skipped += xdefines::PAGE_SIZE;
+        i++;
+      }
+    }
+    page += npages * xdefines::PAGE_SIZE;
+  }
+}
+
+static void* checkMemoryWorker(void* arg) {
+  scanJob* job = (scanJob*)arg;
+  int pagemap = open("/proc/self/pagemap", O_RDONLY);
+  size_t skipped = 0;
+
+  size_t i;
+  while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunks) {
+    scanOneChunk(job, &job->chunks[i], pagemap, &skipped);
+  }
+
+  if(pagemap != -1) {
+    close(pagemap);
+  }
+  __atomic_add_fetch(&job->skipped, skipped, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static double getElapsedMs(struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+#ifdef ENABLE_OBJECT_REGISTRY
+static void checkRegisteredObject(objectGuard* obj, void*) {
+  if(obj->isGoodHead() && !obj->isGoodTail()) {
+    reportOverflowInTheEnd(obj, obj->getStartPtr());
+  }
+}
+
+// Check only the registered live objects, return how many have been checked.
+size_t causer::checkLiveObjects() {
+  return registry::getInstance().forEachObject(checkRegisteredObject, NULL);
+}
+#endif
+
+// Data mappings are split into chunks, which are scanned by a pool of
+// threads. Pages that have never been touched are skipped.
+// With the object registry, only live objects are visited instead.
 void causer::checkAllMemory(){
 
   fprintf(stderr, "***integrity check in the end***\n");
-  ifstream maps_file("/proc/self/maps");
+  struct timespec start;
+#ifdef ENABLE_OBJECT_REGISTRY
+  if(registry::getInstance().isComplete()) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t objects = checkLiveObjects();
+    fprintf(stderr, "***integrity check: %zu live objects in the registry, %.1f ms***\n",
+        objects, getElapsedMs(&start));
+    return;
+  }
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  std::vector<scanChunk> chunks;
+  size_t total = 0;
+  mapsreader maps;
   mapping m;
-  size_t *it;
-  while(maps_file >> m) {
+  while(maps.next(m)) {
     //fprintf(stderr, "mapping at %p-%p\n", (void*)m.getBase(), (void*)m.getLimit());
     if(m.isData() && !m.isStack()) {
-      it = (size_t*)m.getBase();
-      while(it<(size_t*)m.getLimit()){
-        if(it && *it==xdefines::SENTINEL_HEAD_WORD){
-          objectGuard* obj = getObjectGuard(it+1);
-          if(obj->getTailSentinel()>(size_t*)m.getLimit()) break;
-          if(!obj->isGoodTail()){
-            callstack* cs = (callstack *)obj->getCallstack();
-            cs->watchedRatio = xdefines::MAX_WATCH_RATIO_UPPERBOUND;
-#ifdef STATISTICS
-            fprintf(stderr, "[check in the end] Object %p at callstack %lu is overflowed. Tail canary is %zu\n", (it+1), cs->index, *obj->getTailSentinel());
-#else
-            fprintf(stderr, "[check in the end] Object %p is overflowed. Tail canary is %zu\n", (it+1), *obj->getTailSentinel());
-#endif
-          }else{
-            // jump to end
-            it = obj->getTailSentinel();
-            it = (size_t *)((intptr_t)it & xdefines::ALLOCATION_MASK); 
-          }
-        } 
-        it++;
+      total += m.getLimit() - m.getBase();
+      for(uintptr_t base = m.getBase(); base < m.getLimit(); base += xdefines::SCAN_CHUNK_SIZE) {
+        uintptr_t end = base + xdefines::SCAN_CHUNK_SIZE;
+        if(end > m.getLimit()) {
+          end = m.getLimit();
+        }
+        scanChunk chunk = { (size_t*)base, (size_t*)end, (size_t*)m.getLimit() };
+        chunks.push_back(chunk);
       }
     }
   }
+  double mapsTime = getElapsedMs(&start);
+
+  scanJob job;
+  job.chunks = chunks.data();
+  job.nchunks = chunks.size();
+  job.next = 0;
+  job.skipped = 0;
+  job.findHeadWord = selectFindHeadWord();
+
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads > xdefines::MAX_SCAN_THREADS) {
+    nthreads = xdefines::MAX_SCAN_THREADS;
+  }
+  if(nthreads > (long)job.nchunks) {
+    nthreads = job.nchunks;
+  }
+
+  // workers are not registered in xthread, and the current thread is one of them
+  pthread_t workers[xdefines::MAX_SCAN_THREADS];
+  int nworkers = 0;
+  for(long i = 1; i < nthreads; i++) {
+    if(Real::pthread_create(&workers[nworkers], NULL, checkMemoryWorker, &job) == 0) {
+      nworkers++;
+    }
+  }
+  checkMemoryWorker(&job);
+  for(int i = 0; i < nworkers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  double scanTime = getElapsedMs(&start) - mapsTime;
+
+  fprintf(stderr, "***integrity check: %zu MB in %zu chunks, %zu MB never touched, %d threads, maps %.1f ms, scan %.1f ms***\n",
+      total >> 20, job.nchunks, job.skipped >> 20, nworkers + 1, mapsTime, scanTime);
 }
 #endif
 
 //******* file operation ***************
-std::ostream& operator << (std::ostream& os, const callstack& cs) {
+static_assert((int)HISTORY_MAX_DEPTH == (int)xdefines::MAX_CALLSTACK_DEPTH, "history depth mismatch");
+static_assert((int)HISTORY_CONFIRMED_RATIO == (int)xdefines::MAX_WATCH_RATIO_UPPERBOUND, "history ratio mismatch");
+
+// Ratio saved for the next run, callsites that are rarely watched get boosted.
+static int getSavedRatio(const callstack& cs) {
 
   int ratio = cs.watchedRatio;
 
@@ -302,35 +745,50 @@ std::ostream& operator << (std::ostream& os, const callstack& cs) {
       ratio += (xdefines::MAX_WATCH_RATIO_UPPERBOUND / (cs.watchedCounter + 1)) * boostratio;
     }
 
-    if (ratio > xdefines::MAX_WATCH_RATIO_UPPERBOUND) {
+    // only confirmed callsites are saved with the upper bound
+    if (ratio >= xdefines::MAX_WATCH_RATIO_UPPERBOUND) {
       ratio = xdefines::MAX_WATCH_RATIO_UPPERBOUND - 1;
     }
   }
   //fprintf(stderr, "original ratio is %d, after boost is %d\n", cs.watchedRatio, ratio);
 
-  os << cs.depth << ' ' << cs.calledCounter << ' ' 
-    << cs.watchedCounter << ' ' << ratio << ' ' << cs.offset;
+  return ratio;
+}
+
+// Convert a callsite to a record, frames are saved as (module, offset).
+static void fillHistoryRecord(historywriter& writer, const callstack& cs, int ratio, historyRecord* r) {
+  r->depth = cs.depth;
+  r->calledCounter = cs.calledCounter;
+  r->watchedCounter = cs.watchedCounter;
+  r->watchedRatio = ratio;
+  r->offset = cs.offset;
+  r->hashcode = cs.hashcode;
 #ifdef STATISTICS
-  os << ' ' << cs.index;
-#endif
-  os << std::endl;
-
-  //Dl_info info;
-  if (cs.depth > 0)
-    for (int i = 0; i < cs.depth; i++) {
-      //if (dladdr(cs.stack[i], &info) && info.dli_saddr != 0) /* saddr can be 0x0 even if returns true */
-      mapping m = selfmap::getInstance().getMappingByAddress(cs.stack[i]);
-      if(m.valid()){
-        os << m.getFile() << ' ' << (uintptr_t)cs.stack[i] - m.getBase();
-        //os << info.dli_fname << ' ' << (uintptr_t)cs.stack[i] - (uintptr_t)info.dli_fbase;
-      } else {
-        os << "_ 0";
+  r->index = cs.index;
+#endif
+
+  for (int i = 0; i < cs.depth; i++) {
+    textmodule copy;
+    const textmodule* m = selfmap::getInstance().getModuleByAddress(cs.stack[i], &copy) ? &copy : NULL;
+    uint32_t module = HISTORY_NO_MODULE;
+    if(m != NULL){
+      module = writer.findModule(m->name, m->base);
+      if(module == HISTORY_NO_MODULE){
+        uint8_t buildid[HISTORY_MAX_BUILDID];
+        uint32_t size = selfmap::getBuildId((void*)m->base, buildid, HISTORY_MAX_BUILDID);
+        module = writer.addModule(m->name, m->base, buildid, size);
       }
-      os << ' ' << (uintptr_t)cs.stack[i] << std::endl;
     }
-  return os;
+    r->frames[i].module = module;
+    if(module != HISTORY_NO_MODULE){
+      r->frames[i].offset = (uintptr_t)cs.stack[i] - m->base;
+    } else {
+      r->frames[i].offset = (uintptr_t)cs.stack[i];
+    }
+  }
 }
 
+// Legacy text format, only kept to load files written by older versions.
 std::istream& operator >> (std::istream& is, callstack& cs) {
   is >> cs.depth >> cs.calledCounter >> cs.watchedCounter >> cs.watchedRatio >> cs.offset;
 
@@ -346,9 +804,10 @@ std::istream& operator >> (std::istream& is, callstack& cs) {
   for (int i = 0; i < cs.depth; i++) {
     is >> s >> off >> orig_addr;
     // find base address of library
-    mapping m = selfmap::getInstance().getMappingByFileName(s);
-    if(m.valid()){
-      s_addr = (void*)m.getBase();
+    textmodule module;
+    const textmodule* m = selfmap::getInstance().getModuleByName(s.c_str(), &module) ? &module : NULL;
+    if(m != NULL){
+      s_addr = (void*)m->base;
     }else{
       s_addr = 0;
     }
@@ -360,10 +819,76 @@ std::istream& operator >> (std::istream& is, callstack& cs) {
   cs.hashcode = hash_value(cs.stack[0], (unsigned int)cs.offset); 
   cs.periodcalled = 0;
   cs.period = getCurrentTime();
+  cs.version = 1;
+  cs.savedVersion = 0;
+  cs.snapshot = -1;
+#ifdef SHARED_CALLSITE_TABLE
+  cs.shared = NULL;
+  cs.sharedWatched = 0;
+#endif
+#ifdef ALLOC_TRACE
+  cs.traceId = 0;
+#endif
 
   return is;
 }
 
+// Write to a temp file and rename it, so the history file is never seen half written.
+static bool replaceHistoryFile(historywriter& writer, const char* filename) {
+  char tmpfile[PATH_MAX];
+  snprintf(tmpfile, PATH_MAX, "%s.tmp.%d", filename, getpid());
+
+  int fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1){
+    fprintf(stderr, "Failed to save history file %s: %s\n", tmpfile, strerror(errno));
+    return false;
+  }
+  bool ret = writer.write(fd);
+  close(fd);
+  if(!ret || rename(tmpfile, filename) == -1){
+    fprintf(stderr, "Failed to save history file %s: %s\n", filename, strerror(errno));
+    unlink(tmpfile);
+    return false;
+  }
+  return true;
+}
+
+// With MERGE_HISTORY, records already in the file are merged in first, and
+// processes sharing the file are serialized by an advisory lock.
+static bool writeHistoryFile(historywriter& writer, const char* filename) {
+#ifdef MERGE_HISTORY
+  char lockfile[PATH_MAX];
+  snprintf(lockfile, PATH_MAX, "%s.lock", filename);
+  int lockfd = open(lockfile, O_RDWR | O_CREAT, 0644);
+  if(lockfd == -1 || flock(lockfd, LOCK_EX) == -1){
+    fprintf(stderr, "Failed to lock history file %s: %s\n", lockfile, strerror(errno));
+  }
+
+  bool ret;
+  historyfile history;
+  if(history.map(filename)){
+    // merge into a copy, the checkpoint snapshot must only hold our own callsites
+    historywriter merged;
+    if(merged.merge(writer) && merged.merge(history)){
+      ret = replaceHistoryFile(merged, filename);
+    } else {
+      ret = replaceHistoryFile(writer, filename);
+    }
+    history.unmap();
+  } else {
+    ret = replaceHistoryFile(writer, filename);
+  }
+
+  if(lockfd != -1){
+    // closing the file releases the lock
+    close(lockfd);
+  }
+  return ret;
+#else
+  return replaceHistoryFile(writer, filename);
+#endif
+}
+
 // save history information
 void causer::saveHistoryInfo(char* filename){
   fprintf(stderr, "save history file %s, total callsite %zu\n", filename, _csMap.getEntryNumber());
@@ -379,23 +904,26 @@ void causer::saveHistoryInfo(char* filename){
       }
     }
 
-    // save callsite information to file
-    std::ofstream ofile;
-    ofile.open(filename, std::ofstream::out | std::ofstream::trunc);
-    ofile << _csMap.getEntryNumber() << std::endl;
-    for(i=_csMap.begin(); i!=_csMap.end(); i++)
-      ofile << i.getData();
-    ofile.close();
+    // convert all callsites, then save them with a single write
+    historywriter writer;
+    writer.reserve(_csMap.getEntryNumber());
+    for(i=_csMap.begin(); i!=_csMap.end(); i++){
+      callstack cs = i.getData();
+      if(cs.depth < 1){ continue; }
+      historyRecord* r = writer.addRecord();
+      if(r == NULL){ break; }
+      fillHistoryRecord(writer, cs, getSavedRatio(cs), r);
+    }
+
+    writeHistoryFile(writer, filename);
   }
 }
 
-void causer::loadHistoryInfo(char* filename) {
-  fprintf(stderr, "load history file %s\n", filename);
+void causer::loadTextHistoryInfo(char* filename) {
   std::ifstream ifile;
   ifile.open(filename);
   if (!ifile.is_open())
     return;
-  assert(_csMap.getEntryNumber()==0);
   size_t number;
   ifile >> number;
 
@@ -408,4 +936,189 @@ void causer::loadHistoryInfo(char* filename) {
   }
   ifile.close();
 }
+
+void causer::loadHistoryInfo(char* filename) {
+  fprintf(stderr, "load history file %s\n", filename);
+  assert(_csMap.getEntryNumber()==0);
+
+  if(!historyfile::isBinary(filename)) {
+    loadTextHistoryInfo(filename);
+    return;
+  }
+
+  historyfile history;
+  if(!history.map(filename)) {
+    fprintf(stderr, "history file %s is corrupted or of another version, ignore it\n", filename);
+    return;
+  }
+
+  // relocate each module once instead of once per frame,
+  // offsets into a module that has been rebuilt since point at other code
+  uintptr_t bases[HISTORY_MAX_MODULES];
+  bool stale[HISTORY_MAX_MODULES];
+  for(uint32_t m = 0; m < history.getModulesNumber(); m++) {
+    textmodule module;
+    const textmodule* mp = selfmap::getInstance().getModuleByName(history.getModuleName(m), &module) ? &module : NULL;
+    bases[m] = mp != NULL ? mp->base : (uintptr_t)history.getModuleBase(m);
+    stale[m] = false;
+    if(mp != NULL) {
+      uint32_t savedsize;
+      const uint8_t* saved = history.getModuleBuildId(m, &savedsize);
+      uint8_t buildid[HISTORY_MAX_BUILDID];
+      uint32_t size = selfmap::getBuildId((void*)mp->base, buildid, HISTORY_MAX_BUILDID);
+      stale[m] = !isSameBuildId(saved, savedsize, buildid, size);
+      if(stale[m]) {
+        fprintf(stderr, "%s has been rebuilt, drop its history\n", history.getModuleName(m));
+      }
+    }
+  }
+
+  callstack curstack;
+  unsigned long now = getCurrentTime();
+  for(uint32_t n = 0; n < history.getRecordsNumber(); n++) {
+    const historyRecord* r = history.getRecord(n);
+    if(r->depth < 1 || r->depth > xdefines::MAX_CALLSTACK_DEPTH){ continue; }
+    // the callsite key is in a rebuilt module
+    if(r->frames[0].module < history.getModulesNumber() && stale[r->frames[0].module]){ continue; }
+
+    curstack.depth = r->depth;
+    curstack.calledCounter = r->calledCounter;
+    curstack.watchedCounter = r->watchedCounter;
+    curstack.watchedRatio = r->watchedRatio;
+    curstack.offset = r->offset;
+#ifdef STATISTICS
+    curstack.index = r->index;
+#endif
+    for(int i = 0; i < r->depth; i++) {
+      uint32_t module = r->frames[i].module;
+      if(module < history.getModulesNumber() && stale[module]) {
+        // keep the frames before the rebuilt module for reports
+        curstack.depth = i;
+        break;
+      }
+      if(module < history.getModulesNumber()) {
+        curstack.stack[i] = (void*)(bases[module] + r->frames[i].offset);
+      } else {
+        curstack.stack[i] = (void*)r->frames[i].offset;
+      }
+    }
+
+    // the saved hash is still valid if the first frame is not relocated
+    uint32_t module = r->frames[0].module;
+    if(module < history.getModulesNumber() && bases[module] == history.getModuleBase(module)) {
+      curstack.hashcode = r->hashcode;
+    } else {
+      curstack.hashcode = hash_value(curstack.stack[0], (unsigned int)curstack.offset); 
+    }
+    curstack.periodcalled = 0;
+    curstack.period = now;
+    // loaded callsites are part of the first checkpoint
+    curstack.version = 1;
+    curstack.savedVersion = 0;
+    curstack.snapshot = -1;
+#ifdef SHARED_CALLSITE_TABLE
+    seedSharedCallsite(&curstack);
+#endif
+#ifdef ALLOC_TRACE
+    curstack.traceId = 0;
+#endif
+
+    _csMap.insert(curstack, sizeof(callstack), curstack);
+  }
+}
+
+#ifdef HISTORY_CHECKPOINT
+struct checkpointCopy {
+  callstack cs;
+  long nextSnapshot;
+  bool changed;
+};
+
+// Copy a callsite changed since the last checkpoint, under its bucket lock.
+static void copyChangedCallsite(callstack* cs, void* arg) {
+  checkpointCopy* copy = (checkpointCopy*)arg;
+
+  pthread_spin_lock(&cs->lock);
+  if(cs->version != cs->savedVersion && cs->depth > 0) {
+    if(cs->snapshot == -1) {
+      cs->snapshot = copy->nextSnapshot;
+    }
+    cs->savedVersion = cs->version;
+    copy->cs = *cs;
+    copy->changed = true;
+  }
+  pthread_spin_unlock(&cs->lock);
+}
+
+// Only records changed since the last checkpoint are copied from the live
+// table, all others are kept in the snapshot. Boosting depends on the whole
+// table, so checkpoints save the ratios as they are, only the final save
+// boosts them.
+void causer::checkpointHistoryInfo() {
+  _checkpointLock.lock();
+  if(_checkpointStopped) {
+    _checkpointLock.unlock();
+    return;
+  }
+
+  size_t changed = 0;
+  checkpointCopy copy;
+  csHashMap::cursor pos;
+  while(_snapshot.reserveRecord()) {
+    copy.nextSnapshot = _snapshot.getRecordsNumber();
+    copy.changed = false;
+    if(!_csMap.visitNext(&pos, copyChangedCallsite, &copy)) {
+      break;
+    }
+    if(!copy.changed) {
+      continue;
+    }
+
+    historyRecord* r;
+    if(copy.cs.snapshot == copy.nextSnapshot) {
+      r = _snapshot.addRecord();
+    } else {
+      r = _snapshot.getRecord(copy.cs.snapshot);
+      memset(r, 0, sizeof(historyRecord));
+    }
+    fillHistoryRecord(_snapshot, copy.cs, copy.cs.watchedRatio, r);
+    changed++;
+  }
+
+  if(changed > 0) {
+    writeHistoryFile(_snapshot, _checkpointFile);
+  }
+  _checkpointLock.unlock();
+}
+
+void* causer::checkpointer(void*) {
+  causer& c = causer::getInstance();
+  while(!c._checkpointStopped) {
+    sleep(c._checkpointInterval);
+    c.checkpointHistoryInfo();
+  }
+  return NULL;
+}
+
+void causer::startCheckpointer(char* filename) {
+  _checkpointFile = filename;
+  _checkpointInterval = tuning.checkpointInterval;
+  if(_checkpointInterval == 0) {
+    return;
+  }
+
+  pthread_t tid;
+  // the checkpointer is not registered in xthread, so it is never watched itself
+  if(Real::pthread_create(&tid, NULL, causer::checkpointer, NULL) != 0) {
+    fprintf(stderr, "Failed to create the history checkpointer\n");
+  }
+}
+
+// Wait for the checkpoint in progress, so it can not overwrite the final save.
+void causer::stopCheckpointer() {
+  _checkpointLock.lock();
+  _checkpointStopped = true;
+  _checkpointLock.unlock();
+}
+#endif
 //******* file operation end ***************
@@ -15,9 +15,12 @@
 #include "hashvalue.hh"
 #include "hashfuncs.hh"
 #include "hashmap.hh"
+#include "config.hh"
 #include "threadstruct.hh"
 
 #include "watchpoint.hh"
+#include "history.hh"
+#include "objectguard.hh"
 
 //extern char __executable_start;
 //extern char data_start;
@@ -50,32 +53,82 @@ class causer {
     void loadHistoryInfo(char* filename);
     void saveHistoryInfo(char* filename);
 
+#ifdef HISTORY_CHECKPOINT
+    void startCheckpointer(char* filename);
+    void stopCheckpointer();
+#endif
+
 #ifdef ENABLE_EVIDENCE
     void* checkPointer(void* addr);
 #endif
+#ifdef SOFTWARE_BOUNDS_CHECK
+    void reportBoundsOverflow(const char* op, objectGuard* obj, void* dst, size_t size, void* ip);
+#endif
+#ifdef BACKGROUND_VERIFIER
+    void startVerifier();
+    void stopVerifier();
+#endif
 #ifdef ENABLE_EVIDENCE_SCAN_MEMORY
     void checkAllMemory();
+#ifdef ENABLE_OBJECT_REGISTRY
+    size_t checkLiveObjects();
+#endif
 #endif
 
   private:
     causer() {
       // init global total number
-      boostratio = 1;
+      boostratio = tuning.historyBoost / 100.0;
 
       causer_stack_offset = 0;
 
-      _csMap.initialize(HashFuncs::hashCallStackT, HashFuncs::compareCallStackT, xdefines::CALLSTACK_MAP_SIZE);
+      _csMap.initialize(HashFuncs::hashCallStackT, HashFuncs::compareCallStackT, tuning.callstackMapSize);
+#ifdef HISTORY_CHECKPOINT
+      _checkpointLock.init();
+      _checkpointStopped = false;
+      _checkpointFile = NULL;
+      _checkpointInterval = 0;
+#endif
+#ifdef BACKGROUND_VERIFIER
+      _verifierLock.init();
+      _verifierStopped = false;
+      _verifyBudget = 0;
+#endif
       //_csMap.initialize(HashFuncs::hashSizeT, HashFuncs::compareSizeT, xdefines::CALLSTACK_MAP_SIZE);
       watchpoint::getInstance();
     }
     ~causer() {}
 
     void updateWatchedInfo(callstack* foundcs, mallocOpType type);
+    void loadTextHistoryInfo(char* filename);
+
+#ifdef HISTORY_CHECKPOINT
+    void checkpointHistoryInfo();
+    static void* checkpointer(void* arg);
+#endif
+#ifdef BACKGROUND_VERIFIER
+    static void* verifier(void* arg);
+#endif
 
     typedef HashMap<callstack, callstack, spinlock> csHashMap;
     //typedef HashMap<size_t, callstack, spinlock> csHashMap;
     csHashMap _csMap;
 
+#ifdef HISTORY_CHECKPOINT
+    // records of all callsites as of the last checkpoint
+    historywriter _snapshot;
+    spinlock _checkpointLock;
+    volatile bool _checkpointStopped;
+    char* _checkpointFile;
+    unsigned int _checkpointInterval;
+#endif
+
+#ifdef BACKGROUND_VERIFIER
+    spinlock _verifierLock;
+    volatile bool _verifierStopped;
+    unsigned int _verifyBudget;     // us of every VERIFY_PERIOD
+#endif
+
 };
 
 #endif
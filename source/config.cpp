@@ -0,0 +1,188 @@
+/*
+ * @file   config.cpp
+ * @brief  Parse the config file and the environment into tuning.
+ */
+
+#include "config.hh"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+tunables tuning = {
+  xdefines::INIT_WATCH_RATIO,
+  xdefines::WATCHED_REDUCTION,
+  xdefines::CALLED_REDUCTION,
+  xdefines::REDUCTION_TO_MIN,
+  xdefines::MAX_WATCH_THRESHOLD,
+  xdefines::MAX_WATCH_PERIOD,
+  xdefines::WP_PREEMPT_WEIGHT,
+  xdefines::WP_INSTALL_MIN_TIME,
+  xdefines::WP_PREEMPT_TIME_REDUCTION_BASE,
+  xdefines::CALLSTACK_MAP_SIZE,
+  xdefines::MAX_TRAP_REPEAT,
+  xdefines::CHECKPOINT_INTERVAL,
+  xdefines::VERIFY_BUDGET,
+  xdefines::QUARANTINE_BYTES,
+  xdefines::OVERHEAD_TARGET,
+  xdefines::MAX_WATCHPOINTS,
+  xdefines::HISTORY_BOOST,
+};
+
+struct tunable {
+  const char* name;
+  size_t offset;
+  bool isInt;
+  unsigned long min;
+  unsigned long max;
+  bool powerOfTwo;
+};
+
+#define INT_TUNABLE(name, field, min, max) \
+  { name, offsetof(tunables, field), true, min, max, false }
+#define ULONG_TUNABLE(name, field, min, max) \
+  { name, offsetof(tunables, field), false, min, max, false }
+
+static const tunable tunableList[] = {
+  INT_TUNABLE("INIT_WATCH_RATIO", initWatchRatio, 1, xdefines::MAX_WATCH_RATIO_UPPERBOUND - 1),
+  INT_TUNABLE("WATCHED_REDUCTION", watchedReduction, 0, 10),
+  INT_TUNABLE("CALLED_REDUCTION", calledReduction, 0, xdefines::MAX_WATCH_RATIO_UPPERBOUND),
+  INT_TUNABLE("REDUCTION_TO_MIN", reductionToMin, 0, xdefines::MAX_WATCH_RATIO_UPPERBOUND - 1),
+  ULONG_TUNABLE("MAX_WATCH_THRESHOLD", maxWatchThreshold, 0, ULONG_MAX),
+  ULONG_TUNABLE("MAX_WATCH_PERIOD", maxWatchPeriod, 1, ULONG_MAX),
+  INT_TUNABLE("WP_PREEMPT_WEIGHT", wpPreemptWeight, 0, 1000),
+  ULONG_TUNABLE("WP_INSTALL_MIN_TIME", wpInstallMinTime, 0, ULONG_MAX),
+  ULONG_TUNABLE("WP_PREEMPT_TIME_REDUCTION_BASE", wpPreemptTimeReductionBase, 1, ULONG_MAX),
+  { "CALLSTACK_MAP_SIZE", offsetof(tunables, callstackMapSize), false, 1024, 1UL << 28, true },
+  ULONG_TUNABLE("MAX_TRAP_REPEAT", maxTrapRepeat, 1, ULONG_MAX),
+  ULONG_TUNABLE("CHECKPOINT_INTERVAL", checkpointInterval, 0, UINT_MAX),
+  ULONG_TUNABLE("VERIFY_BUDGET", verifyBudget, 0, xdefines::VERIFY_PERIOD),
+  ULONG_TUNABLE("QUARANTINE_BYTES", quarantineBytes, 0, ULONG_MAX),
+  ULONG_TUNABLE("OVERHEAD_TARGET", overheadTarget, 0, 10000),
+  INT_TUNABLE("WATCHPOINTS", watchpoints, 0, xdefines::MAX_WATCHPOINTS),
+  INT_TUNABLE("HISTORY_BOOST", historyBoost, 0, 1000),
+};
+
+#define TUNABLES (sizeof(tunableList) / sizeof(tunableList[0]))
+
+bool config::set(const char* name, const char* value, const char* source) {
+  for(size_t i = 0; i < TUNABLES; i++) {
+    const tunable* t = &tunableList[i];
+    if(strcmp(t->name, name) != 0) {
+      continue;
+    }
+
+    char* end;
+    errno = 0;
+    unsigned long v = strtoul(value, &end, 0);
+    while(isspace((unsigned char)*end)) {
+      end++;
+    }
+    if(errno != 0 || end == value || *end != '\0' || value[0] == '-') {
+      fprintf(stderr, "Ignoring %s = %s from %s, it is not a number\n", name, value, source);
+      return false;
+    }
+    if(v < t->min || v > t->max || (t->powerOfTwo && (v & (v - 1)) != 0)) {
+      fprintf(stderr, "Ignoring %s = %s from %s, it must be in [%lu, %lu]%s\n",
+          name, value, source, t->min, t->max, t->powerOfTwo ? " and a power of 2" : "");
+      return false;
+    }
+
+    char* field = (char*)&tuning + t->offset;
+    if(t->isInt) {
+      *(int*)field = (int)v;
+    } else {
+      *(unsigned long*)field = v;
+    }
+    return true;
+  }
+  fprintf(stderr, "Unknown tuning value %s from %s\n", name, source);
+  return false;
+}
+
+// The whole file is read at once, there is no heap to grow a buffer yet.
+void config::loadFile(const char* path) {
+  char buf[xdefines::CONFIG_FILE_SIZE];
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd == -1) {
+    fprintf(stderr, "Failed to open config file %s\n", path);
+    return;
+  }
+  size_t size = 0;
+  ssize_t n;
+  while(size < sizeof(buf) - 1 && (n = read(fd, buf + size, sizeof(buf) - 1 - size)) > 0) {
+    size += n;
+  }
+  if(size == sizeof(buf) - 1 && read(fd, &buf[size], 1) > 0) {
+    fprintf(stderr, "Config file %s is larger than %d bytes, the rest is ignored\n", path, xdefines::CONFIG_FILE_SIZE - 1);
+  }
+  close(fd);
+  buf[size] = '\0';
+
+  char* line = buf;
+  while(line != NULL) {
+    char* next = strchr(line, '\n');
+    if(next != NULL) {
+      *next++ = '\0';
+    }
+    char* comment = strchr(line, '#');
+    if(comment != NULL) {
+      *comment = '\0';
+    }
+
+    // NAME = value, surrounding blanks are dropped
+    char* name = line;
+    while(isspace((unsigned char)*name)) {
+      name++;
+    }
+    char* equal = strchr(name, '=');
+    if(equal != NULL) {
+      char* value = equal + 1;
+      while(equal > name && isspace((unsigned char)equal[-1])) {
+        equal--;
+      }
+      *equal = '\0';
+      while(isspace((unsigned char)*value)) {
+        value++;
+      }
+      set(name, value, path);
+    } else if(*name != '\0') {
+      fprintf(stderr, "Ignoring line \"%s\" of %s\n", name, path);
+    }
+    line = next;
+  }
+}
+
+void config::load() {
+  char* path = getenv("CAUSER_CONFIG");
+  if(path != NULL) {
+    loadFile(path);
+  }
+
+  char envname[64];
+  for(size_t i = 0; i < TUNABLES; i++) {
+    snprintf(envname, sizeof(envname), "CAUSER_%s", tunableList[i].name);
+    char* value = getenv(envname);
+    if(value != NULL) {
+      set(tunableList[i].name, value, "the environment");
+    }
+  }
+}
+
+void config::print() {
+  char line[1024];
+  int len = snprintf(line, sizeof(line), "***tuning:");
+  for(size_t i = 0; i < TUNABLES && len < (int)sizeof(line); i++) {
+    const tunable* t = &tunableList[i];
+    char* field = (char*)&tuning + t->offset;
+    unsigned long v = t->isInt ? (unsigned long)*(int*)field : *(unsigned long*)field;
+    len += snprintf(line + len, sizeof(line) - len, " %s=%lu", t->name, v);
+  }
+  fprintf(stderr, "%s***\n", line);
+}
@@ -0,0 +1,70 @@
+#if !defined(_CONFIG_H)
+#define _CONFIG_H
+
+/*
+ * @file   config.hh
+ * @brief  Tuning values read at load time, instead of rebuilding the library.
+ *
+ * The defaults are the constants in xdefines. A file named by CAUSER_CONFIG
+ * holds lines of "NAME = value", and CAUSER_<NAME> in the environment wins
+ * over the file. Nothing is allocated, since this runs before malloc is up.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <new>
+
+#include "xdefines.hh"
+
+// Read on the hot paths, written only while loading.
+struct tunables {
+  // sampling of callsites, ratios out of MAX_WATCH_RATIO_UPPERBOUND
+  int initWatchRatio;
+  int watchedReduction;               // ratio is scaled by watchedReduction / 10
+  int calledReduction;
+  int reductionToMin;
+  unsigned long maxWatchThreshold;
+  unsigned long maxWatchPeriod;       // ms
+
+  // preemption of installed watchpoints
+  int wpPreemptWeight;
+  unsigned long wpInstallMinTime;     // ms
+  unsigned long wpPreemptTimeReductionBase; // ms
+
+  unsigned long callstackMapSize;     // power of 2
+  unsigned long maxTrapRepeat;
+  unsigned long checkpointInterval;   // s, 0 disables it
+  unsigned long verifyBudget;         // us of every VERIFY_PERIOD, 0 disables it
+  unsigned long quarantineBytes;
+  unsigned long overheadTarget;       // basis points of the CPU time, 0 only measures
+  int watchpoints;                    // debug registers to use, 0 only samples
+  int historyBoost;                   // percent of the boost of rarely watched callsites saved in the history
+} __attribute__((aligned(64)));
+
+extern tunables tuning;
+
+class config {
+
+  public:
+    static config& getInstance() {
+      static char buf[sizeof(config)];
+      static config* theOneTrueObject = new (buf) config();
+      return *theOneTrueObject;
+    }
+
+    // Apply the config file and then the environment to tuning.
+    void load();
+
+    // Log the values in use.
+    void print();
+
+  private:
+    config() {}
+    ~config() {}
+
+    void loadFile(const char* path);
+    bool set(const char* name, const char* value, const char* source);
+};
+
+#endif
@@ -149,6 +149,7 @@ extern "C" void * MYCDECL CUSTOM_CALLOC(size_t nelem, size_t elsize) {
   if(watching){
     enableCauser();
   }
+  TRACE_RECORD(TRACE_ALLOC, ptr, n);
 
   return ptr;
 }
@@ -237,6 +238,7 @@ extern "C" void * MYCDECL CUSTOM_REALLOC (void * ptr, size_t sz) {
 
   // remove watchpoint first
   xxmalloc_remove_watchpoint(ptr);
+  TRACE_BEGIN_REALLOC();
 
   size_t objSize = CUSTOM_GETSIZE (ptr);
 
@@ -253,6 +255,7 @@ extern "C" void * MYCDECL CUSTOM_REALLOC (void * ptr, size_t sz) {
 #endif
       // install watchpoint to new position
       xxmalloc_install_watchpoint(ptr, sz, 0);
+      TRACE_END_REALLOC(ptr, ptr, sz);
       return ptr;
     }
 
@@ -264,6 +267,7 @@ extern "C" void * MYCDECL CUSTOM_REALLOC (void * ptr, size_t sz) {
 
   // Free the old block.
   CUSTOM_FREE (ptr);
+  TRACE_END_REALLOC(ptr, buf, sz);
 
   // Return a pointer to the new one.
   return buf;
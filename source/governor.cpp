@@ -0,0 +1,114 @@
+/*
+ * @file   governor.cpp
+ * @brief  Epochs of the overhead governor, run by whichever thread ends one.
+ */
+
+#ifdef OVERHEAD_GOVERNOR
+#include "governor.hh"
+
+#include <stdio.h>
+
+#ifdef LIVE_STATS
+#include "livestats.hh"
+#endif
+
+__thread unsigned long governorCycles __attribute__((tls_model("initial-exec"))) = 0;
+__thread unsigned long governorCalls __attribute__((tls_model("initial-exec"))) = 0;
+
+static long readClock(clockid_t id) {
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void governor::initialize() {
+  _epochTsc = rdtsc();
+  _epochMonoNs = readClock(CLOCK_MONOTONIC);
+  _epochCpuNs = readClock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// Also called from the trap handler, only atomics and the clocks are used.
+void governor::flush() {
+  unsigned long cycles = governorCycles;
+  governorCycles = 0;
+  __atomic_add_fetch(&_pendingCycles, cycles, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&_stats.totalCycles, cycles, __ATOMIC_RELAXED);
+
+  long monoNs = readClock(CLOCK_MONOTONIC);
+  if(monoNs - __atomic_load_n(&_epochMonoNs, __ATOMIC_RELAXED) < xdefines::GOVERNOR_EPOCH * 1000000L) {
+    return;
+  }
+  if(__atomic_exchange_n(&_epochLock, 1, __ATOMIC_ACQUIRE) != 0) {
+    return;
+  }
+  evaluate(rdtsc(), monoNs, readClock(CLOCK_PROCESS_CPUTIME_ID));
+#ifdef LIVE_STATS
+  livestats::getInstance().updateGovernor(_stats.scale, _stats.lastOverhead, _stats.epochs);
+#endif
+  __atomic_store_n(&_epochLock, 0, __ATOMIC_RELEASE);
+}
+
+void governor::evaluate(unsigned long tsc, long monoNs, long cpuNs) {
+  unsigned long cycles = __atomic_exchange_n(&_pendingCycles, 0, __ATOMIC_RELAXED);
+  long elapsedNs = monoNs - _epochMonoNs;
+  long usedNs = cpuNs - _epochCpuNs;
+  unsigned long elapsedTsc = tsc - _epochTsc;
+
+  _epochTsc = tsc;
+  _epochCpuNs = cpuNs;
+  __atomic_store_n(&_epochMonoNs, monoNs, __ATOMIC_RELAXED);
+  if(elapsedNs <= 0 || usedNs <= 0 || elapsedTsc == 0) {
+    return;
+  }
+
+  // the TSC rate is measured against the clock in every epoch
+  double overheadNs = (double)cycles * elapsedNs / elapsedTsc;
+  unsigned long overhead = (unsigned long)(overheadNs * 10000 / usedNs);
+  _stats.lastOverhead = overhead;
+  _stats.epochs++;
+
+  unsigned long target = tuning.overheadTarget;
+  if(target == 0) {
+    return;
+  }
+
+  unsigned int scale = _stats.scale;
+  if(overhead > target) {
+    // cut in proportion, but at most by half in one epoch
+    unsigned long cut = scale * target / overhead;
+    scale = cut < scale / 2 ? scale / 2 : cut;
+    if(scale < xdefines::GOVERNOR_MIN_SCALE) {
+      scale = xdefines::GOVERNOR_MIN_SCALE;
+    }
+  } else if(overhead * 4 < target * 3 && scale < xdefines::GOVERNOR_SCALE_ONE) {
+    // far below the target, the cost is dominated by something else
+    scale += overhead * 4 < target ? scale : scale / 8 + 1;
+    if(scale > xdefines::GOVERNOR_SCALE_ONE) {
+      scale = xdefines::GOVERNOR_SCALE_ONE;
+    }
+  }
+
+  if(scale < _stats.scale) {
+    _stats.lowered++;
+  } else if(scale > _stats.scale) {
+    _stats.raised++;
+  }
+  if(scale < _stats.lowestScale) {
+    _stats.lowestScale = scale;
+  }
+  __atomic_store_n(&_stats.scale, scale, __ATOMIC_RELAXED);
+}
+
+void governor::getStats(governorStats* stats) {
+  *stats = _stats;
+  stats->totalCycles = __atomic_load_n(&_stats.totalCycles, __ATOMIC_RELAXED) + governorCycles;
+}
+
+void governor::printSummary() {
+  governorStats stats;
+  getStats(&stats);
+  fprintf(stderr, "***overhead governor: target %lu.%02lu%%, last epoch %lu.%02lu%%, scale %u/%d (lowest %u), %lu epochs, lowered %lu times, raised %lu times***\n",
+      tuning.overheadTarget / 100, tuning.overheadTarget % 100, stats.lastOverhead / 100, stats.lastOverhead % 100,
+      stats.scale, xdefines::GOVERNOR_SCALE_ONE, stats.lowestScale, stats.epochs, stats.lowered, stats.raised);
+}
+#endif
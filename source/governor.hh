@@ -0,0 +1,137 @@
+#if !defined(_GOVERNOR_H)
+#define _GOVERNOR_H
+
+/*
+ * @file   governor.hh
+ * @brief  Keep the time spent watching objects under a share of the CPU time.
+ *
+ * Installing and removing watchpoints and handling their traps is timed
+ * with the TSC, summed per thread and added up globally in large steps.
+ * Every GOVERNOR_EPOCH ms, the total is compared with the CPU time of the
+ * process. Above tuning.overheadTarget the share of allocations that are
+ * sampled at all is cut in proportion, and installed watchpoints are
+ * preempted less eagerly; well below it, both are raised again step by step.
+ * Skipped allocations are not charged the callsite lookup either, which is
+ * the largest part of the cost.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+
+#include "xdefines.hh"
+#include "config.hh"
+
+extern "C" {
+  extern uint32_t arc4random_uniform(uint32_t upper_bound);
+}
+
+// cycles of this thread not yet added to the total, and calls of sampled paths
+extern __thread unsigned long governorCycles __attribute__((tls_model("initial-exec")));
+extern __thread unsigned long governorCalls __attribute__((tls_model("initial-exec")));
+
+// Decisions of the governor so far.
+struct governorStats {
+  unsigned int scale;        // out of GOVERNOR_SCALE_ONE
+  unsigned int lowestScale;
+  unsigned long lastOverhead; // basis points of the CPU time in the last epoch
+  unsigned long epochs;
+  unsigned long lowered;
+  unsigned long raised;
+  unsigned long totalCycles;
+};
+
+class governor {
+
+  public:
+    static governor& getInstance() {
+      static char buf[sizeof(governor)];
+      static governor* theOneTrueObject = new (buf) governor();
+      return *theOneTrueObject;
+    }
+
+    // Start the first epoch.
+    void initialize();
+
+    // Time every call of a rare, costly path: start = begin(); ...; end(start).
+    static unsigned long begin() {
+      return rdtsc();
+    }
+
+    void end(unsigned long start) {
+      charge(rdtsc() - start);
+    }
+
+    // Time one in GOVERNOR_SAMPLE_PERIOD calls of a frequent path, and charge
+    // it for all of them. Reading the TSC costs about as much as such a path.
+    static unsigned long beginSampled() {
+      if((++governorCalls & (xdefines::GOVERNOR_SAMPLE_PERIOD - 1)) != 0) {
+        return 0;
+      }
+      return rdtsc();
+    }
+
+    void endSampled(unsigned long start) {
+      if(start != 0) {
+        charge((rdtsc() - start) * xdefines::GOVERNOR_SAMPLE_PERIOD);
+      }
+    }
+
+    unsigned int getScale() {
+      return __atomic_load_n(&_stats.scale, __ATOMIC_RELAXED);
+    }
+
+    // Whether to sample an allocation at all.
+    bool admit() {
+      unsigned int scale = getScale();
+      return scale == xdefines::GOVERNOR_SCALE_ONE || arc4random_uniform(xdefines::GOVERNOR_SCALE_ONE) < scale;
+    }
+
+    // How long an installed watchpoint is kept before it can be preempted.
+    unsigned long scaleInstallTime(unsigned long ms) {
+      unsigned int scale = getScale();
+      if(scale == xdefines::GOVERNOR_SCALE_ONE) {
+        return ms;
+      }
+      unsigned long minimum = ms > 0 ? ms : 1;
+      return minimum * xdefines::GOVERNOR_SCALE_ONE / scale;
+    }
+
+    void getStats(governorStats* stats);
+    void printSummary();
+
+  private:
+    void charge(unsigned long cycles) {
+      governorCycles += cycles;
+      if(unlikely(governorCycles >= xdefines::GOVERNOR_FLUSH_CYCLES)) {
+        flush();
+      }
+    }
+
+    governor() : _pendingCycles(0), _epochTsc(0), _epochMonoNs(0), _epochCpuNs(0), _epochLock(0) {
+      _stats.scale = xdefines::GOVERNOR_SCALE_ONE;
+      _stats.lowestScale = xdefines::GOVERNOR_SCALE_ONE;
+      _stats.lastOverhead = 0;
+      _stats.epochs = 0;
+      _stats.lowered = 0;
+      _stats.raised = 0;
+      _stats.totalCycles = 0;
+    }
+    ~governor() {}
+
+    void flush();
+    void evaluate(unsigned long tsc, long monoNs, long cpuNs);
+
+    governorStats _stats;
+    unsigned long _pendingCycles;  // total of the current epoch
+
+    // start of the current epoch, _epochLock is held to end it
+    unsigned long _epochTsc;
+    long _epochMonoNs;
+    long _epochCpuNs;
+    int _epochLock;
+};
+
+#endif
@@ -15,6 +15,7 @@
 #include "list.hh"
 #include "xdefines.hh"
 #include "real.hh"
+#include "config.hh"
 
 #ifdef STATISTICS
 extern unsigned int csindex;
@@ -184,9 +185,19 @@ public:
 #endif
       entry->value.calledCounter = 0;
       entry->value.watchedCounter = 0;
-      entry->value.watchedRatio = xdefines::INIT_WATCH_RATIO;
+      entry->value.watchedRatio = tuning.initWatchRatio;
       entry->value.period = 0;
       entry->value.periodcalled = 0;
+      entry->value.version = 0;
+      entry->value.savedVersion = 0;
+      entry->value.snapshot = -1;
+#ifdef SHARED_CALLSITE_TABLE
+      entry->value.shared = NULL;
+      entry->value.sharedWatched = 0;
+#endif
+#ifdef ALLOC_TRACE
+      entry->value.traceId = 0;
+#endif
     }
     // return the actual call stack value
     ret = &entry->value; 
@@ -266,6 +277,49 @@ public:
 
   size_t getEntryNumber() { return _totalEntry; }
 
+  size_t getBucketsNumber() { return _buckets; }
+
+  // Where visitNext is in the table. Entries are only appended to a bucket,
+  // so the last one visited stays in place between calls; the map should
+  // not be erased from during a walk.
+  class cursor {
+    friend class HashMap<KeyType, ValueType, LockType>;
+    size_t _bucket;
+    size_t _index;        // entries of the bucket visited so far
+    struct Entry* _entry; // the last of them
+
+  public:
+    cursor() : _bucket(0), _index(0), _entry(NULL) {}
+  };
+
+  // Call func on the entry after the one at c, and move c there. The bucket
+  // lock is only held while func handles this single entry, so func should
+  // just copy it out. Return false once every bucket is done.
+  bool visitNext(cursor* c, void (*func)(ValueType*, void*), void* arg) {
+    while(c->_bucket < _buckets) {
+      struct HashEntry* head = getHashEntry(c->_bucket);
+
+      // the rest of a bucket is skipped without locking, a new entry is seen next time
+      if(head->count > c->_index) {
+        head->Lock();
+        if(head->count > c->_index) {
+          struct Entry* entry = c->_entry == NULL ? (struct Entry*)head->getFirstEntry() : c->_entry->nextEntry();
+          func(&entry->value, arg);
+          head->Unlock();
+          c->_entry = entry;
+          c->_index++;
+          return true;
+        }
+        head->Unlock();
+      }
+
+      c->_bucket++;
+      c->_index = 0;
+      c->_entry = NULL;
+    }
+    return false;
+  }
+
   // Clear all _entries
   void clear() {}
 
@@ -0,0 +1,521 @@
+#if !defined(_HISTORY_H)
+#define _HISTORY_H
+
+/*
+ * @file   history.hh
+ * @brief  Binary, mmap-loadable format of the callsite history file.
+ *
+ * Layout of a history file:
+ *   historyHeader
+ *   historyModule[nmodules]
+ *   char strings[stringsize]      module paths, NUL terminated
+ *   historyRecord[nrecords]
+ *
+ * Frames are saved as (module, offset) so that loading only needs one
+ * relocation per module. Each module also keeps its GNU build-ID, so that
+ * offsets into a module that has been rebuilt since are not trusted. This
+ * header does not depend on the rest of the library, so that offline tools
+ * can read and write history files too.
+ *
+ * Merge policy, used when several processes save into one file:
+ *   - counters take the maximum. Every process starts from the counters it
+ *     loaded, so a run is never counted twice, even if it is merged again
+ *     by a later checkpoint, but concurrent runs are not summed either.
+ *   - the ratio of a confirmed overflow always wins, otherwise the ratio
+ *     comes from the side that observed more calls.
+ *   - records of a module whose build-ID differs from ours are stale and
+ *     dropped, so the first input wins when merging files offline.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+enum { HISTORY_MAGIC = 0x59524f5453494843UL }; // "CHISTORY"
+enum { HISTORY_VERSION = 2 };
+enum { HISTORY_NO_MODULE = 0xFFFFFFFF };
+enum { HISTORY_MAX_DEPTH = 14 };
+enum { HISTORY_MAX_MODULES = 1024 };
+enum { HISTORY_MAX_STRINGS = HISTORY_MAX_MODULES * 256 };
+enum { HISTORY_CONFIRMED_RATIO = 10000 };
+enum { HISTORY_MAX_BUILDID = 32 };
+
+struct historyHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t maxdepth;
+  uint32_t nmodules;
+  uint32_t nrecords;
+  uint64_t stringsize;
+};
+
+struct historyModule {
+  uint32_t name;        // offset into the string table
+  uint32_t buildidsize; // 0 if the module has no build-ID
+  uint64_t base;        // load address when saved
+  uint8_t buildid[HISTORY_MAX_BUILDID];
+};
+
+// Modules of version 1 files, which have no build-ID.
+struct historyModuleV1 {
+  uint32_t name;
+  uint32_t reserved;    // aligns base, written as 0
+  uint64_t base;
+};
+
+struct historyFrame {
+  uint32_t module;    // HISTORY_NO_MODULE if the frame is not in any module
+  uint32_t reserved;  // aligns offset, written as 0
+  uint64_t offset;    // offset from module base, or absolute address
+};
+
+struct historyRecord {
+  int32_t depth;
+  int32_t calledCounter;
+  int32_t watchedCounter;
+  int32_t watchedRatio;
+  uint64_t offset;    // stack offset, part of the callsite key
+  uint64_t hashcode;  // valid when the module of the first frame is not relocated
+  uint64_t index;
+  historyFrame frames[HISTORY_MAX_DEPTH];
+};
+
+// Build-IDs only conflict if both are known.
+static inline bool isSameBuildId(const uint8_t* id, uint32_t size, const uint8_t* other, uint32_t othersize) {
+  if(size == 0 || othersize == 0) {
+    return true;
+  }
+  return size == othersize && memcmp(id, other, size) == 0;
+}
+
+static inline void mergeHistoryRecord(historyRecord* mine, const historyRecord* other) {
+  bool confirmed = mine->watchedRatio == HISTORY_CONFIRMED_RATIO
+    || other->watchedRatio == HISTORY_CONFIRMED_RATIO;
+  if(other->calledCounter > mine->calledCounter) {
+    mine->watchedRatio = other->watchedRatio;
+  }
+  if(confirmed) {
+    mine->watchedRatio = HISTORY_CONFIRMED_RATIO;
+  }
+  if(other->calledCounter > mine->calledCounter) {
+    mine->calledCounter = other->calledCounter;
+  }
+  if(other->watchedCounter > mine->watchedCounter) {
+    mine->watchedCounter = other->watchedCounter;
+  }
+}
+
+// Hash of the callsite key: module and offset of the first frame, and stack offset.
+static inline uint64_t historyKey(const char* module, uint64_t frameoffset, uint64_t stackoffset) {
+  uint64_t h = 0xcbf29ce484222325UL;
+  if(module != NULL) {
+    for(const char* p = module; *p; p++) {
+      h = (h ^ (uint8_t)*p) * 0x100000001b3UL;
+    }
+  }
+  h = (h ^ frameoffset) * 0x100000001b3UL;
+  h = (h ^ stackoffset) * 0x100000001b3UL;
+  return h ^ (h >> 29);
+}
+
+/**
+ * A history file mapped read only.
+ */
+class historyfile {
+  public:
+    historyfile() : _image(NULL), _size(0), _header(NULL), _moduleSize(0) {}
+    ~historyfile() { unmap(); }
+
+    // Map and validate a history file, return false if it is not a binary
+    // history or if any offset or module index in it is out of range.
+    bool map(const char* filename) {
+      int fd = open(filename, O_RDONLY);
+      if(fd == -1) {
+        return false;
+      }
+      struct stat st;
+      if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(historyHeader)) {
+        close(fd);
+        return false;
+      }
+      _size = st.st_size;
+      _image = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if(_image == MAP_FAILED) {
+        _image = NULL;
+        return false;
+      }
+
+      _header = (const historyHeader*)_image;
+      _moduleSize = _header->version == 1 ? sizeof(historyModuleV1) : sizeof(historyModule);
+      if(_header->magic != HISTORY_MAGIC
+          || (_header->version != HISTORY_VERSION && _header->version != 1)
+          || _header->maxdepth != HISTORY_MAX_DEPTH
+          || _header->nmodules > HISTORY_MAX_MODULES
+          || _header->stringsize > HISTORY_MAX_STRINGS
+          || expectedSize() != _size
+          || !hasValidModules()
+          || !hasValidRecords()) {
+        unmap();
+        return false;
+      }
+      return true;
+    }
+
+    void unmap() {
+      if(_image != NULL) {
+        munmap(_image, _size);
+        _image = NULL;
+        _header = NULL;
+      }
+    }
+
+    // Whether the file starts with our magic, whatever its version is.
+    static bool isBinary(const char* filename) {
+      uint64_t magic = 0;
+      int fd = open(filename, O_RDONLY);
+      if(fd == -1) {
+        return false;
+      }
+      ssize_t n = read(fd, &magic, sizeof(magic));
+      close(fd);
+      return n == sizeof(magic) && magic == HISTORY_MAGIC;
+    }
+
+    uint32_t getModulesNumber() { return _header->nmodules; }
+    uint32_t getRecordsNumber() { return _header->nrecords; }
+
+    uint32_t getVersion() { return _header->version; }
+
+    const char* getModuleName(uint32_t i) { return getStrings() + getModule(i)->name; }
+    uint64_t getModuleBase(uint32_t i) { return getModule(i)->base; }
+    // Return the build-ID of a module and set its size, which is 0 if unknown.
+    const uint8_t* getModuleBuildId(uint32_t i, uint32_t* size) {
+      if(_header->version == 1) {
+        *size = 0;
+        return NULL;
+      }
+      const historyModule* m = (const historyModule*)getModule(i);
+      *size = m->buildidsize <= HISTORY_MAX_BUILDID ? m->buildidsize : 0;
+      return m->buildid;
+    }
+    const historyRecord* getRecord(uint32_t i) { return &getRecords()[i]; }
+
+  private:
+    // the first fields are shared by all versions
+    const historyModuleV1* getModule(uint32_t i) {
+      return (const historyModuleV1*)((const char*)(_header + 1) + i * _moduleSize);
+    }
+    const char* getStrings() { return (const char*)(_header + 1) + _header->nmodules * _moduleSize; }
+    const historyRecord* getRecords() { return (const historyRecord*)(getStrings() + _header->stringsize); }
+
+    size_t expectedSize() {
+      return sizeof(historyHeader) + _header->nmodules * _moduleSize
+        + _header->stringsize + (size_t)_header->nrecords * sizeof(historyRecord);
+    }
+
+    // Every module name starts in the string table and ends there.
+    bool hasValidModules() {
+      const char* strings = getStrings();
+      for(uint32_t i = 0; i < _header->nmodules; i++) {
+        uint32_t name = getModule(i)->name;
+        if(name >= _header->stringsize || memchr(strings + name, 0, _header->stringsize - name) == NULL) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Every frame of a record is in one of the modules, or in none.
+    bool hasValidRecords() {
+      const historyRecord* records = getRecords();
+      for(uint32_t n = 0; n < _header->nrecords; n++) {
+        const historyRecord* r = &records[n];
+        if(r->depth < 1 || r->depth > HISTORY_MAX_DEPTH) {
+          return false;
+        }
+        for(int i = 0; i < r->depth; i++) {
+          uint32_t m = r->frames[i].module;
+          if(m >= _header->nmodules && m != HISTORY_NO_MODULE) {
+            return false;
+          }
+        }
+      }
+      return true;
+    }
+
+    void* _image;
+    size_t _size;
+    const historyHeader* _header;
+    size_t _moduleSize;
+};
+
+/**
+ * Collect modules and records, then save them with a single write.
+ * Buffers come from mmap, so it can be used while malloc is interposed.
+ */
+class historywriter {
+  public:
+    historywriter() : _records(NULL), _nrecords(0), _capacity(0), _nmodules(0), _stringsize(0) {
+      void* buf = mmap(NULL, getTableSize(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(buf == MAP_FAILED) {
+        _modules = NULL;
+        _strings = NULL;
+      } else {
+        _modules = (historyModule*)buf;
+        _strings = (char*)(_modules + HISTORY_MAX_MODULES);
+      }
+    }
+
+    ~historywriter() {
+      if(_records != NULL) {
+        munmap(_records, _capacity * sizeof(historyRecord));
+      }
+      if(_modules != NULL) {
+        munmap(_modules, getTableSize());
+      }
+    }
+
+    bool reserve(size_t nrecords) {
+      if(nrecords <= _capacity) {
+        return true;
+      }
+      void* buf = mmap(NULL, nrecords * sizeof(historyRecord), PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(buf == MAP_FAILED) {
+        return false;
+      }
+      if(_records != NULL) {
+        memcpy(buf, _records, _nrecords * sizeof(historyRecord));
+        munmap(_records, _capacity * sizeof(historyRecord));
+      }
+      _records = (historyRecord*)buf;
+      _capacity = nrecords;
+      return true;
+    }
+
+    // Return the index of a module, HISTORY_NO_MODULE if it is not added yet.
+    uint32_t findModule(const char* name, uint64_t base) {
+      // frames of one callsite mostly share modules, check the last one first
+      for(uint32_t i = _nmodules; i > 0; i--) {
+        if(_modules[i - 1].base == base && strcmp(_strings + _modules[i - 1].name, name) == 0) {
+          return i - 1;
+        }
+      }
+      return HISTORY_NO_MODULE;
+    }
+
+    // Return the index of a module, add it if it is new.
+    uint32_t addModule(const char* name, uint64_t base, const uint8_t* buildid, uint32_t buildidsize) {
+      uint32_t found = findModule(name, base);
+      if(found != HISTORY_NO_MODULE) {
+        return found;
+      }
+      size_t len = strlen(name) + 1;
+      if(_modules == NULL || _nmodules >= HISTORY_MAX_MODULES || _stringsize + len + 7 > HISTORY_MAX_STRINGS) {
+        return HISTORY_NO_MODULE;
+      }
+      if(buildidsize > HISTORY_MAX_BUILDID) {
+        buildidsize = 0;
+      }
+      memset(&_modules[_nmodules], 0, sizeof(historyModule));
+      _modules[_nmodules].name = _stringsize;
+      _modules[_nmodules].buildidsize = buildidsize;
+      _modules[_nmodules].base = base;
+      if(buildidsize > 0) {
+        memcpy(_modules[_nmodules].buildid, buildid, buildidsize);
+      }
+      memcpy(_strings + _stringsize, name, len);
+      _stringsize += len;
+      return _nmodules++;
+    }
+
+    // Make sure that the next addRecord() succeeds.
+    bool reserveRecord() {
+      return _nrecords < _capacity || reserve(_capacity == 0 ? 1024 : _capacity * 2);
+    }
+
+    // Get a zeroed record to fill in, NULL if there is no space left.
+    historyRecord* addRecord() {
+      if(!reserveRecord()) {
+        return NULL;
+      }
+      historyRecord* r = &_records[_nrecords++];
+      memset(r, 0, sizeof(historyRecord));
+      return r;
+    }
+
+    size_t getRecordsNumber() { return _nrecords; }
+    historyRecord* getRecord(size_t i) { return &_records[i]; }
+
+    uint32_t getModulesNumber() { return _nmodules; }
+    const char* getModuleName(uint32_t m) {
+      return m < _nmodules ? _strings + _modules[m].name : NULL;
+    }
+    uint64_t getModuleBase(uint32_t m) { return _modules[m].base; }
+    const uint8_t* getModuleBuildId(uint32_t m, uint32_t* size) {
+      *size = _modules[m].buildidsize;
+      return _modules[m].buildid;
+    }
+
+    // Merge all records of a history file or writer into ours, see the merge
+    // policy above. New callsites are appended. Return false if out of memory.
+    template <class Source>
+    bool merge(Source& file) {
+      // open addressing index of our records, at most half full
+      size_t nslots = 1024;
+      while(nslots < (_nrecords + file.getRecordsNumber()) * 2) {
+        nslots <<= 1;
+      }
+      size_t indexsize = nslots * sizeof(uint32_t);
+      uint32_t* index = (uint32_t*)mmap(NULL, indexsize, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(index == MAP_FAILED) {
+        return false;
+      }
+      memset(index, 0xff, indexsize);
+      for(uint32_t i = 0; i < _nrecords; i++) {
+        size_t slot = getKey(&_records[i]) & (nslots - 1);
+        while(index[slot] != HISTORY_NO_MODULE) {
+          slot = (slot + 1) & (nslots - 1);
+        }
+        index[slot] = i;
+      }
+
+      // modules of the file that have been rebuilt since
+      uint8_t stale[HISTORY_MAX_MODULES];
+      for(uint32_t m = 0; m < file.getModulesNumber() && m < HISTORY_MAX_MODULES; m++) {
+        stale[m] = isStaleModule(file, m);
+      }
+
+      bool ret = true;
+      for(uint32_t n = 0; n < file.getRecordsNumber(); n++) {
+        const historyRecord* other = file.getRecord(n);
+        if(other->depth < 1 || other->depth > HISTORY_MAX_DEPTH) {
+          continue;
+        }
+        if(other->frames[0].module < file.getModulesNumber() && stale[other->frames[0].module]) {
+          continue;
+        }
+        const char* module = other->frames[0].module < file.getModulesNumber()
+          ? file.getModuleName(other->frames[0].module) : NULL;
+        size_t slot = historyKey(module, other->frames[0].offset, other->offset) & (nslots - 1);
+        while(index[slot] != HISTORY_NO_MODULE && !isSameCallsite(&_records[index[slot]], module, other)) {
+          slot = (slot + 1) & (nslots - 1);
+        }
+        if(index[slot] != HISTORY_NO_MODULE) {
+          mergeHistoryRecord(&_records[index[slot]], other);
+          continue;
+        }
+
+        // new callsite, copy it with frames moved to our module table
+        historyRecord* r = addRecord();
+        if(r == NULL) {
+          ret = false;
+          break;
+        }
+        memcpy(r, other, sizeof(historyRecord));
+        for(int i = 0; i < other->depth; i++) {
+          uint32_t m = other->frames[i].module;
+          if(m < file.getModulesNumber()) {
+            uint32_t size;
+            const uint8_t* buildid = file.getModuleBuildId(m, &size);
+            r->frames[i].module = addModule(file.getModuleName(m), file.getModuleBase(m), buildid, size);
+            if(r->frames[i].module == HISTORY_NO_MODULE) {
+              r->frames[i].offset += file.getModuleBase(m);
+            }
+          } else {
+            r->frames[i].module = HISTORY_NO_MODULE;
+          }
+        }
+        index[slot] = _nrecords - 1;
+      }
+
+      munmap(index, indexsize);
+      return ret;
+    }
+
+    // Write everything to fd with one writev.
+    bool write(int fd) {
+      historyHeader header;
+      header.magic = HISTORY_MAGIC;
+      header.version = HISTORY_VERSION;
+      header.maxdepth = HISTORY_MAX_DEPTH;
+      header.nmodules = _nmodules;
+      header.nrecords = _nrecords;
+      // keep records aligned when the file is mapped
+      header.stringsize = (_stringsize + 7) & ~7;
+
+      struct iovec iov[4];
+      iov[0].iov_base = &header;
+      iov[0].iov_len = sizeof(header);
+      iov[1].iov_base = _modules;
+      iov[1].iov_len = _nmodules * sizeof(historyModule);
+      iov[2].iov_base = _strings;
+      iov[2].iov_len = header.stringsize;
+      iov[3].iov_base = _records;
+      iov[3].iov_len = _nrecords * sizeof(historyRecord);
+
+      size_t total = 0;
+      for(int i = 0; i < 4; i++) {
+        total += iov[i].iov_len;
+      }
+      ssize_t n;
+      do {
+        n = writev(fd, iov, 4);
+      } while(n == -1 && errno == EINTR);
+      return n == (ssize_t)total;
+    }
+
+  private:
+    // Whether we have a module of the same path but another build-ID.
+    template <class Source>
+    bool isStaleModule(Source& file, uint32_t m) {
+      uint32_t size;
+      const uint8_t* buildid = file.getModuleBuildId(m, &size);
+      const char* name = file.getModuleName(m);
+      for(uint32_t i = 0; i < _nmodules; i++) {
+        if(strcmp(_strings + _modules[i].name, name) == 0
+            && !isSameBuildId(_modules[i].buildid, _modules[i].buildidsize, buildid, size)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    uint64_t getKey(const historyRecord* r) {
+      return historyKey(getModuleName(r->frames[0].module), r->frames[0].offset, r->offset);
+    }
+
+    bool isSameCallsite(const historyRecord* r, const char* module, const historyRecord* other) {
+      if(r->offset != other->offset || r->frames[0].offset != other->frames[0].offset) {
+        return false;
+      }
+      const char* name = getModuleName(r->frames[0].module);
+      if(name == NULL || module == NULL) {
+        return name == module;
+      }
+      return strcmp(name, module) == 0;
+    }
+
+    static size_t getTableSize() {
+      return HISTORY_MAX_MODULES * sizeof(historyModule) + HISTORY_MAX_STRINGS;
+    }
+
+    historyRecord* _records;
+    size_t _nrecords;
+    size_t _capacity;
+
+    uint32_t _nmodules;
+    uint32_t _stringsize;
+    historyModule* _modules;
+    char* _strings;
+};
+
+#endif
@@ -19,6 +19,39 @@
 #include "selfmap.hh"
 #include "watchpoint.hh"
 #include "objectguard.hh"
+#include "whitelist.hh"
+#include "trapreport.hh"
+#include "config.hh"
+#ifdef ENABLE_OBJECT_REGISTRY
+#include "registry.hh"
+#endif
+#ifdef QUARANTINE
+#include "quarantine.hh"
+#endif
+#ifdef OBJECT_MAP
+#include "objectmap.hh"
+#endif
+
+#if defined(QUARANTINE) && !defined(ENABLE_EVIDENCE)
+#error "QUARANTINE checks canaries, ENABLE_EVIDENCE is required"
+#endif
+#ifdef SHARED_CALLSITE_TABLE
+#include "sharedtable.hh"
+#endif
+#ifdef VECTOR_STRINGS
+#include "vstring.hh"
+#endif
+#ifdef SOFTWARE_BOUNDS_CHECK
+#include "boundscheck.hh"
+#endif
+#ifdef OVERHEAD_GOVERNOR
+#include "governor.hh"
+#endif
+#ifdef LIVE_STATS
+#include "livestats.hh"
+#endif
+#include "phases.hh"
+#include "tracer.hh"
 
 // glibc malloc hook
 #include "gnuwrapper.cpp"
@@ -65,6 +98,14 @@ __attribute__((constructor)) void initializer() {
   INIT_REALFUNCTION;
 
   if(!libInitialized) {
+    config::getInstance().load();
+    config::getInstance().print();
+#ifdef OVERHEAD_GOVERNOR
+    governor::getInstance().initialize();
+#endif
+#ifdef LIVE_STATS
+    livestats::getInstance().initialize();
+#endif
     xthread::getInstance().initialize();
     causer::getInstance().initialize();
     libInitialized = true;
@@ -73,6 +114,13 @@ __attribute__((constructor)) void initializer() {
   // get file name 
   snprintf(outputFile, MAX_FILENAME_LEN, "%s_callstack.info", program_invocation_name);
 
+#ifdef SHARED_CALLSITE_TABLE
+  sharedtable::getInstance().initialize();
+#endif
+#ifdef SOFTWARE_BOUNDS_CHECK
+  boundscheck::getInstance().initialize();
+#endif
+
   // load history information
   causer::getInstance().loadHistoryInfo(outputFile);
 }
@@ -80,11 +128,41 @@ __attribute__((constructor)) void initializer() {
 void finalizer() {
 
   disableCauser();
+#ifdef SAMPLE_RING_BUFFER
+  watchpoint::getInstance().stopRingConsumer();
+#endif
+#ifdef HISTORY_CHECKPOINT
+  causer::getInstance().stopCheckpointer();
+#endif
+#ifdef BACKGROUND_VERIFIER
+  causer::getInstance().stopVerifier();
+#endif
+#ifdef QUARANTINE
+  if(current != NULL) {
+    quarantine::getInstance().drain(current);
+  }
+#endif
 #ifdef ENABLE_EVIDENCE_SCAN_MEMORY
   causer::getInstance().checkAllMemory();
 #endif
   //snprintf(outputFile, MAX_FILENAME_LEN, "%s_%ld_callstack.info", program_invocation_name, syscall(__NR_gettid));
   causer::getInstance().saveHistoryInfo(outputFile);
+  trapreport::getInstance().printSummary();
+#ifdef OVERHEAD_GOVERNOR
+  governor::getInstance().printSummary();
+#endif
+#ifdef PHASE_ACCOUNTING
+  phases::getInstance().printSummary();
+#endif
+#ifdef ALLOC_TRACE
+  tracer::getInstance().finalize();
+#endif
+#ifdef LIVE_STATS
+  livestats::getInstance().finalize();
+#endif
+#ifdef SAMPLE_RING_BUFFER
+  watchpoint::getInstance().printRingStatistics();
+#endif
 }
 
 typedef int (*main_fn_t)(int, char**, char**);
@@ -103,7 +181,20 @@ extern "C" int causer_libc_start_main(main_fn_t main_fn, int argc, char** argv,
   current->startFrame = (char *)__builtin_frame_address(0);
   //stackTop = (void*)(((intptr_t)&real_libc_start_main + xdefines::PAGE_SIZE) & ~xdefines::PAGE_SIZE_MASK);
 
-  selfmap::getInstance().getTextRegions();
+  selfmap::getInstance().refreshIfChanged();
+  whitelist::getInstance().initialize();
+#ifdef SAMPLE_RING_BUFFER
+  watchpoint::getInstance().startRingConsumer();
+#endif
+#ifdef ALLOC_TRACE
+  tracer::getInstance().initialize();
+#endif
+#ifdef HISTORY_CHECKPOINT
+  causer::getInstance().startCheckpointer(outputFile);
+#endif
+#ifdef BACKGROUND_VERIFIER
+  causer::getInstance().startVerifier();
+#endif
 
   fprintf(stderr, "***enable Causer***\n");
   enableCauser();
@@ -143,17 +234,29 @@ void* xxmalloc(size_t sz) {
   }
   else {
     ptr = Real::malloc(realsize);
+#ifdef OBJECT_MAP
+    objectmap::getInstance().addObject(ptr);
+#endif
   }
 
 #ifdef ENABLE_EVIDENCE
+  PHASE_START(guardStart);
   objectGuard* o = new (ptr) objectGuard(ptr, sz);
   ptr = o->getStartPtr();
+#ifdef ENABLE_OBJECT_REGISTRY
+  registry::getInstance().registerObject(o);
+#endif
+#ifdef SOFTWARE_BOUNDS_CHECK
+  boundscheck::getInstance().addObject(o);
+#endif
+  PHASE_STOP(guardStart, PHASE_GUARD);
 #endif
 
   //fprintf(stderr, "thread %ld: call malloc sz %zu at %p, header size %lu\n", syscall(__NR_gettid), sz, ptr, sizeof(objectGuard));
 
   // install watchpoint
   xxmalloc_install_watchpoint(ptr, sz, 0);
+  TRACE_RECORD(TRACE_ALLOC, ptr, sz);
 
   return ptr;
 }
@@ -171,20 +274,33 @@ void *xxmemalign(size_t alignment, size_t sz){
 #endif
 
   void* ptr = Real::memalign(alignment, realsize);
+#ifdef OBJECT_MAP
+  objectmap::getInstance().addObject(ptr);
+#endif
 #ifdef ENABLE_EVIDENCE
   // set guard before real object
+  PHASE_START(guardStart);
   objectGuard* o = new ((void*)((intptr_t)ptr + objguardsize - sizeof(objectGuard))) objectGuard(ptr, sz);
   ptr = o->getStartPtr();
+#ifdef ENABLE_OBJECT_REGISTRY
+  registry::getInstance().registerObject(o);
+#endif
+#ifdef SOFTWARE_BOUNDS_CHECK
+  boundscheck::getInstance().addObject(o);
+#endif
+  PHASE_STOP(guardStart, PHASE_GUARD);
 #endif
 
   // install watchpoint
   xxmalloc_install_watchpoint(ptr, sz, 0);
+  TRACE_RECORD(TRACE_ALLOC, ptr, sz);
 
   return ptr;
 }
 
 void xxfree(void* ptr) {
   //fprintf(stderr, "thread %ld: call free at %p\n", syscall(__NR_gettid), ptr);
+  TRACE_RECORD(TRACE_FREE, ptr, 0);
   // remove watchpoint first
   xxmalloc_remove_watchpoint(ptr);
 
@@ -196,7 +312,21 @@ void xxrealfree(void* ptr){
         || (ptr < (void *)_buf))) {
     //fprintf(stderr, "thread %ld: call real free at %p\n", syscall(__NR_gettid), ptr);
 #ifdef ENABLE_EVIDENCE
+#ifdef SOFTWARE_BOUNDS_CHECK
+    boundscheck::getInstance().removeObject(getObjectGuard(ptr));
+#endif
+#ifdef ENABLE_OBJECT_REGISTRY
+    registry::getInstance().unregisterObject(getObjectGuard(ptr));
+#endif
+#ifdef QUARANTINE
+    if(quarantine::getInstance().deferFree(getObjectGuard(ptr))) {
+      return;
+    }
+#endif
     ptr = causer::getInstance().checkPointer(ptr);
+#endif
+#ifdef OBJECT_MAP
+    objectmap::getInstance().removeObject(ptr);
 #endif
     Real::free(ptr);
   }
@@ -221,7 +351,27 @@ bool xxmalloc_install_watchpoint (void *ptr, size_t sz, int offset){
   bool ret = false;
   if(isCauser() && ptr){
     disableCauser();
+#ifdef OVERHEAD_GOVERNOR
+    // over the overhead target, only a share of the allocations is sampled
+    bool admitted = governor::getInstance().admit();
+    if(admitted) {
+      unsigned long start = governor::beginSampled();
+      PHASE_START(watchStart);
+      ret = causer::getInstance().startWatch(ptr, sz-offset);
+      PHASE_STOP(watchStart, PHASE_START_WATCH);
+      governor::getInstance().endSampled(start);
+    }
+#ifdef LIVE_STATS
+    livestats::getInstance().countAllocation(admitted);
+#endif
+#else
+    PHASE_START(watchStart);
     ret = causer::getInstance().startWatch(ptr, sz-offset);
+    PHASE_STOP(watchStart, PHASE_START_WATCH);
+#ifdef LIVE_STATS
+    livestats::getInstance().countAllocation(true);
+#endif
+#endif
     enableCauser();
   }
   return ret;
@@ -230,8 +380,14 @@ bool xxmalloc_install_watchpoint (void *ptr, size_t sz, int offset){
 #ifdef ENABLE_EVIDENCE
 void xxmalloc_updateheader (void *ptr, size_t sz){
   objectGuard* obj = getObjectGuard(ptr);
+#ifdef SOFTWARE_BOUNDS_CHECK
+  boundscheck::getInstance().removeObject(obj);
+#endif
   obj->setObjectSize(sz);
   obj->setTailSentinel();
+#ifdef SOFTWARE_BOUNDS_CHECK
+  boundscheck::getInstance().addObject(obj);
+#endif
 }
 #endif
 
@@ -254,6 +410,174 @@ void pthread_exit(void*  /*  value_ptr */){
   throw PTHREADEXIT_CODE;
 }
 
+#ifdef SOFTWARE_BOUNDS_CHECK
+#define CHECK_WRITE(dst, size, op) \
+  boundscheck::getInstance().checkWrite((dst), (size), (op), __builtin_return_address(0))
+
+// Used until the real routines are found, the volatile accesses keep them
+// from being turned back into calls of the routines interposed here.
+static void* moveBytes(void* dst, const void* src, size_t n) {
+  volatile char* d = (volatile char*)dst;
+  const volatile char* s = (const volatile char*)src;
+  if(d < s) {
+    for(size_t i = 0; i < n; i++) {
+      d[i] = s[i];
+    }
+  } else {
+    for(size_t i = n; i > 0; i--) {
+      d[i - 1] = s[i - 1];
+    }
+  }
+  return dst;
+}
+
+static void* fillBytes(void* dst, int c, size_t n) {
+  volatile char* d = (volatile char*)dst;
+  for(size_t i = 0; i < n; i++) {
+    d[i] = (char)c;
+  }
+  return dst;
+}
+
+// Writes that have been checked already.
+static inline void* copyMemory(void* dst, const void* src, size_t n) {
+  if(unlikely(Real::memcpy == NULL)) {
+    return moveBytes(dst, src, n);
+  }
+  return Real::memcpy(dst, src, n);
+}
+
+static inline void* fillMemory(void* dst, int c, size_t n) {
+  if(unlikely(Real::memset == NULL)) {
+    return fillBytes(dst, c, n);
+  }
+  return Real::memset(dst, c, n);
+}
+
+void* memcpy(void* dst, const void* src, size_t n) {
+  CHECK_WRITE(dst, n, "memcpy");
+  return copyMemory(dst, src, n);
+}
+
+void* memmove(void* dst, const void* src, size_t n) {
+  CHECK_WRITE(dst, n, "memmove");
+  if(unlikely(Real::memmove == NULL)) {
+    return moveBytes(dst, src, n);
+  }
+  return Real::memmove(dst, src, n);
+}
+
+void* memset(void* dst, int c, size_t n) {
+  CHECK_WRITE(dst, n, "memset");
+  return fillMemory(dst, c, n);
+}
+
+// The fortified variants still check against the size known to the compiler.
+void* __memcpy_chk(void* dst, const void* src, size_t n, size_t dstlen) {
+  CHECK_WRITE(dst, n, "__memcpy_chk");
+  if(unlikely(Real::__memcpy_chk == NULL)) {
+    return moveBytes(dst, src, n);
+  }
+  return Real::__memcpy_chk(dst, src, n, dstlen);
+}
+
+void* __memmove_chk(void* dst, const void* src, size_t n, size_t dstlen) {
+  CHECK_WRITE(dst, n, "__memmove_chk");
+  if(unlikely(Real::__memmove_chk == NULL)) {
+    return moveBytes(dst, src, n);
+  }
+  return Real::__memmove_chk(dst, src, n, dstlen);
+}
+
+void* __memset_chk(void* dst, int c, size_t n, size_t dstlen) {
+  CHECK_WRITE(dst, n, "__memset_chk");
+  if(unlikely(Real::__memset_chk == NULL)) {
+    return fillBytes(dst, c, n);
+  }
+  return Real::__memset_chk(dst, c, n, dstlen);
+}
+#else
+#define CHECK_WRITE(dst, size, op)
+#define copyMemory memcpy
+#define fillMemory memset
+#endif
+
+#ifdef VECTOR_STRINGS
+// Strings are scanned with vectors, the copies are done by memcpy which
+// never touches a byte behind the terminator.
+#undef strlen
+size_t strlen(const char *str) {
+  return vstrlen(str);
+}
+
+#undef strcpy
+char * strcpy(char *to, const char *from) {
+  size_t size = vstrlen(from) + 1;
+  CHECK_WRITE(to, size, "strcpy");
+  return (char *)copyMemory(to, from, size);
+}
+
+int strcmp(const char *s1, const char *s2) {
+  return vstrcmp(s1, s2);
+}
+
+#undef strncpy
+char * strncpy(char *dst, const char *src, size_t n) {
+  size_t len = vstrnlen(src, n);
+  CHECK_WRITE(dst, n, "strncpy");
+  copyMemory(dst, src, len);
+  fillMemory(dst + len, 0, n - len);
+  return (dst);
+}
+
+// One bit per byte value, built from the set and then looked up a byte at
+// a time, instead of walking the whole set for every byte.
+static inline void buildByteSet(const char *set, uint64_t *bits) {
+  bits[0] = bits[1] = bits[2] = bits[3] = 0;
+  for (; *set; set++)
+    bits[(unsigned char)*set >> 6] |= 1UL << ((unsigned char)*set & 63);
+}
+
+static inline bool inByteSet(const uint64_t *bits, unsigned char c) {
+  return (bits[c >> 6] >> (c & 63)) & 1;
+}
+
+size_t strspn(const char *s1, const char *s2) {
+  uint64_t bits[4];
+  const char *p = s1;
+
+  buildByteSet(s2, bits);
+  // the terminator is never in the set
+  while (inByteSet(bits, (unsigned char)*p))
+    p++;
+  return (p - s1);
+}
+
+size_t strcspn(const char *s1, const char *s2) {
+  uint64_t bits[4];
+  const char *p = s1;
+
+  buildByteSet(s2, bits);
+  // stop at the terminator as well
+  bits[0] |= 1;
+  while (!inByteSet(bits, (unsigned char)*p))
+    p++;
+  return (p - s1);
+}
+
+#undef strdup
+char * strdup(const char *str) {
+  size_t siz;
+  char *copy;
+
+  siz = vstrlen(str) + 1;
+  if ((copy = (char *)malloc(siz)) == NULL)
+    return(NULL);
+  (void)copyMemory(copy, str, siz);
+  return(copy);
+}
+
+#else
 #undef strlen
 // copy code from OpenBSD
 size_t strlen(const char *str) {
@@ -268,6 +592,7 @@ size_t strlen(const char *str) {
 char * strcpy(char *to, const char *from) {
   char *save = to;
 
+  CHECK_WRITE(to, strlen(from) + 1, "strcpy");
   for (; (*to = *from) != '\0'; ++from, ++to);
   return(save);
 }
@@ -285,6 +610,7 @@ int strcmp(const char *s1, const char *s2) {
  *    */
 #undef strncpy
 char * strncpy(char *dst, const char *src, size_t n) {
+  CHECK_WRITE(dst, n, "strncpy");
   if (n != 0) {
     char *d = dst;
     const char *s = src;
@@ -349,6 +675,35 @@ char * strdup(const char *str) {
   return(copy);
 }
 
+#endif
+
+#ifdef SOFTWARE_BOUNDS_CHECK
+char * strcat(char *dst, const char *src) {
+  size_t len = strlen(dst);
+  size_t size = strlen(src) + 1;
+
+  CHECK_WRITE(dst, len + size, "strcat");
+  copyMemory(dst + len, src, size);
+  return (dst);
+}
+
+char * __strcpy_chk(char *dst, const char *src, size_t dstlen) {
+  if (boundscheck::getInstance().isEnabled())
+    CHECK_WRITE(dst, strlen(src) + 1, "__strcpy_chk");
+  if (unlikely(Real::__strcpy_chk == NULL))
+    return (char *)copyMemory(dst, src, strlen(src) + 1);
+  return Real::__strcpy_chk(dst, src, dstlen);
+}
+
+char * __strcat_chk(char *dst, const char *src, size_t dstlen) {
+  if (boundscheck::getInstance().isEnabled())
+    CHECK_WRITE(dst, strlen(dst) + strlen(src) + 1, "__strcat_chk");
+  if (unlikely(Real::__strcat_chk == NULL))
+    return strcat(dst, src);
+  return Real::__strcat_chk(dst, src, dstlen);
+}
+#endif
+
 pid_t fork(void){
   disableCauser();
   watchpointObject* obj = watchpoint::getInstance().getAllWatchpointObjects();
@@ -358,6 +713,12 @@ pid_t fork(void){
   pid_t ret = Real::fork();
   if(ret == 0){
     xthread::getInstance().reInitializeAtRuntime();
+#ifdef LIVE_STATS
+    livestats::getInstance().reinitializeChild();
+#endif
+#ifdef ALLOC_TRACE
+    tracer::getInstance().reinitializeChild();
+#endif
   }
   enableCauser();
   return ret;
@@ -454,6 +815,23 @@ size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream){
 
 }
 
+// Unloaded modules should not classify addresses that get reused.
+// dlopen is not wrapped, glibc resolves $ORIGIN and namespaces from its
+// caller, modules loaded by it are picked up when a lookup misses.
+int dlclose(void* handle) throw() {
+  int ret = -1;
+
+  COND_DISABLE;
+  INIT_REALFUNCTION;
+
+  ret = Real::dlclose(handle);
+  selfmap::getInstance().refreshIfChanged();
+
+  COND_ENABLE;
+
+  return ret;
+}
+
 int backtrace(void **buffer, int size){
   int ret = -1;
 
@@ -0,0 +1,233 @@
+/*
+ * @file   livestats.cpp
+ * @brief  Create the live statistics segment and keep its slots and callsites.
+ */
+
+#ifdef LIVE_STATS
+#include "livestats.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "selfmap.hh"
+
+static_assert((int)STATS_MAX_SLOTS == (int)xdefines::MAX_WATCHPOINTS, "a slot of the segment for every watchpoint");
+
+__thread unsigned int statsAllocations __attribute__((tls_model("initial-exec"))) = 0;
+__thread unsigned int statsSampled __attribute__((tls_model("initial-exec"))) = 0;
+
+void livestats::getName(char* name, size_t size, int pid) {
+  snprintf(name, size, "%s%d", STATS_NAME_PREFIX, pid);
+}
+
+void livestats::create() {
+  char name[NAME_MAX];
+  _pid = getpid();
+  getName(name, sizeof(name), _pid);
+
+  // left behind by an earlier process with the same pid
+  shm_unlink(name);
+  // only this mapping can write, readers can not open it for writing
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0444);
+  if(fd == -1) {
+    fprintf(stderr, "Failed to create live stats %s: %s\n", name, strerror(errno));
+    return;
+  }
+  if(ftruncate(fd, sizeof(statsSegment)) == -1) {
+    fprintf(stderr, "Failed to resize live stats %s: %s\n", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return;
+  }
+  void* ptr = mmap(NULL, sizeof(statsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(ptr == MAP_FAILED) {
+    fprintf(stderr, "Failed to map live stats %s: %s\n", name, strerror(errno));
+    shm_unlink(name);
+    return;
+  }
+
+  // a new segment is zero filled, magic is set last so readers see a complete header
+  statsSegment* seg = (statsSegment*)ptr;
+  seg->version = STATS_VERSION;
+  seg->size = sizeof(statsSegment);
+  seg->pid = _pid;
+  seg->startTime = getCurrentTime();
+  seg->updateTime = seg->startTime;
+#ifdef OVERHEAD_GOVERNOR
+  seg->counters.governorScale = xdefines::GOVERNOR_SCALE_ONE;
+  seg->counters.governorScaleOne = xdefines::GOVERNOR_SCALE_ONE;
+#endif
+  __atomic_store_n(&seg->magic, (uint64_t)STATS_MAGIC, __ATOMIC_RELEASE);
+  _seg = seg;
+}
+
+void livestats::initialize() {
+  create();
+}
+
+void livestats::reinitializeChild() {
+  // the mapping is shared with the parent, which still writes to it
+  if(_seg != NULL) {
+    munmap(_seg, sizeof(statsSegment));
+    _seg = NULL;
+  }
+  statsAllocations = 0;
+  statsSampled = 0;
+  _callsitesLock = 0;
+  create();
+}
+
+void livestats::finalize() {
+  if(_seg == NULL || getpid() != _pid) {
+    return;
+  }
+  flushAllocations();
+  char name[NAME_MAX];
+  getName(name, sizeof(name), _pid);
+  shm_unlink(name);
+}
+
+void livestats::flushAllocations() {
+  unsigned int allocations = statsAllocations;
+  unsigned int sampled = statsSampled;
+  statsAllocations = 0;
+  statsSampled = 0;
+  if(_seg != NULL) {
+    __atomic_add_fetch(&_seg->counters.allocations, allocations, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_seg->counters.sampled, sampled, __ATOMIC_RELAXED);
+  }
+}
+
+void livestats::setSlot(int index, void* addr, void* objectStart, size_t objectSize, callstack* cs,
+    unsigned long installTime, bool preempted) {
+  if(_seg == NULL) {
+    return;
+  }
+  __atomic_add_fetch(&_seg->counters.installs, 1, __ATOMIC_RELAXED);
+  if(preempted) {
+    __atomic_add_fetch(&_seg->counters.preemptions, 1, __ATOMIC_RELAXED);
+  }
+
+  statsSlot* slot = &_seg->slots[index];
+  statsBeginWrite(&slot->sequence);
+  slot->used = 1;
+  slot->addr = (uintptr_t)addr;
+  slot->objectStart = (uintptr_t)objectStart;
+  slot->objectSize = objectSize;
+  slot->callsite = (uintptr_t)cs->stack[0];
+  slot->installTime = installTime;
+  __atomic_store_n(&slot->hits, 0, __ATOMIC_RELAXED);
+  statsEndWrite(&slot->sequence);
+  _seg->updateTime = installTime;
+}
+
+void livestats::clearSlot(int index) {
+  if(_seg == NULL) {
+    return;
+  }
+  __atomic_add_fetch(&_seg->counters.removals, 1, __ATOMIC_RELAXED);
+
+  statsSlot* slot = &_seg->slots[index];
+  statsBeginWrite(&slot->sequence);
+  slot->used = 0;
+  statsEndWrite(&slot->sequence);
+  _seg->updateTime = getCurrentTime();
+}
+
+// Callsites are few and watched rarely, a linear scan of the list is enough.
+// Skipped if another thread is updating the list, or the trap handler
+// interrupted this one, the callsite will be seen on its next update.
+void livestats::noteCallsite(callstack* cs) {
+  if(_seg == NULL || __atomic_exchange_n(&_callsitesLock, 1, __ATOMIC_ACQUIRE) != 0) {
+    return;
+  }
+
+  bool confirmed = cs->watchedRatio == xdefines::MAX_WATCH_RATIO_UPPERBOUND;
+  int n = _seg->ncallsites;
+  int i = 0;
+  while(i < n && _callsites[i] != cs) {
+    i++;
+  }
+
+  textmodule module;
+  const textmodule* m = NULL;
+  if(i == n) {
+    // not in the list, it takes the place of the least watched one if it beats it
+    if(n == STATS_TOP_CALLSITES) {
+      statsCallsite* last = &_seg->callsites[n - 1];
+      if(cs->watchedCounter <= last->watchedCounter && !(confirmed && !last->confirmed)) {
+        __atomic_store_n(&_callsitesLock, 0, __ATOMIC_RELEASE);
+        return;
+      }
+      i = n - 1;
+    }
+    // may read the maps again, so done before readers are held off
+    m = selfmap::getInstance().getModuleByAddress(cs->stack[0], &module) ? &module : NULL;
+  }
+
+  statsBeginWrite(&_seg->callsitesSequence);
+  statsCallsite* entry = &_seg->callsites[i];
+  if(_callsites[i] != cs || i == n) {
+    _callsites[i] = cs;
+    entry->pc = (uintptr_t)cs->stack[0];
+    entry->moduleOffset = m != NULL ? entry->pc - m->base : 0;
+    entry->module[0] = '\0';
+    if(m != NULL) {
+      const char* base = strrchr(m->name, '/');
+      strncpy(entry->module, base != NULL ? base + 1 : m->name, STATS_MODULE_NAME - 1);
+      entry->module[STATS_MODULE_NAME - 1] = '\0';
+    }
+    if(i == n) {
+      _seg->ncallsites = n + 1;
+    }
+  }
+  entry->calledCounter = cs->calledCounter;
+  entry->watchedCounter = cs->watchedCounter;
+  entry->watchedRatio = cs->watchedRatio;
+  entry->confirmed = confirmed;
+
+  // counters only grow, so the entry can only move up
+  while(i > 0 && _seg->callsites[i - 1].watchedCounter < _seg->callsites[i].watchedCounter) {
+    statsCallsite tmp = _seg->callsites[i - 1];
+    _seg->callsites[i - 1] = _seg->callsites[i];
+    _seg->callsites[i] = tmp;
+    callstack* tmpcs = _callsites[i - 1];
+    _callsites[i - 1] = _callsites[i];
+    _callsites[i] = tmpcs;
+    i--;
+  }
+  _seg->updateTime = getCurrentTime();
+  statsEndWrite(&_seg->callsitesSequence);
+
+  __atomic_store_n(&_callsitesLock, 0, __ATOMIC_RELEASE);
+}
+
+void livestats::addPhases(const phaseHistogram* h) {
+  if(_seg == NULL) {
+    return;
+  }
+  for(int p = 0; p < PHASES; p++) {
+    for(int b = 0; b < PHASE_BUCKETS; b++) {
+      if(h->counts[p][b] != 0) {
+        __atomic_add_fetch(&_seg->phases.counts[p][b], h->counts[p][b], __ATOMIC_RELAXED);
+      }
+    }
+    __atomic_add_fetch(&_seg->phases.cycles[p], h->cycles[p], __ATOMIC_RELAXED);
+  }
+}
+
+void livestats::updateGovernor(unsigned int scale, unsigned long overhead, unsigned long epochs) {
+  if(_seg != NULL) {
+    __atomic_store_n(&_seg->counters.governorScale, scale, __ATOMIC_RELAXED);
+    __atomic_store_n(&_seg->counters.governorOverhead, overhead, __ATOMIC_RELAXED);
+    __atomic_store_n(&_seg->counters.governorEpochs, epochs, __ATOMIC_RELAXED);
+  }
+}
+#endif
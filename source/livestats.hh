@@ -0,0 +1,128 @@
+#if !defined(_LIVESTATS_H)
+#define _LIVESTATS_H
+
+/*
+ * @file   livestats.hh
+ * @brief  Publish what the library is doing in a segment other tools can read.
+ *
+ * With LIVE_STATS, each process creates /dev/shm/causer-stats-<pid> and keeps
+ * its counters, watchpoint slots and most watched callsites there, see
+ * statsformat.hh for the layout and tools/causerstat to read it. The segment
+ * is made read-only for everybody but the mapping of the process itself.
+ * Allocations are counted per thread and added up in steps, everything else
+ * is rare enough to go to the segment directly. The segment is removed at
+ * exit; one left by a process that was killed or called _exit is removed
+ * by causerstat -r.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+
+#include "xdefines.hh"
+#include "statsformat.hh"
+
+// allocations of this thread not yet added to the segment
+extern __thread unsigned int statsAllocations __attribute__((tls_model("initial-exec")));
+extern __thread unsigned int statsSampled __attribute__((tls_model("initial-exec")));
+
+class livestats {
+
+  public:
+    static livestats& getInstance() {
+      static char buf[sizeof(livestats)];
+      static livestats* theOneTrueObject = new (buf) livestats();
+      return *theOneTrueObject;
+    }
+
+    // Create the segment of this process.
+    void initialize();
+
+    // In the child of a fork, stop writing to the segment of the parent.
+    void reinitializeChild();
+
+    // Remove the segment, readers that have it mapped keep their copy.
+    void finalize();
+
+    static long now() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec * 1000000000L + ts.tv_nsec;
+    }
+
+    // sampled is whether the callsite of the allocation was looked up
+    void countAllocation(bool sampled) {
+      statsSampled += sampled;
+      if(unlikely(++statsAllocations >= xdefines::STATS_FLUSH_ALLOCATIONS)) {
+        flushAllocations();
+      }
+    }
+
+    void countTrap(bool benign) {
+      if(_seg != NULL) {
+        __atomic_add_fetch(benign ? &_seg->counters.benignTraps : &_seg->counters.realTraps, 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    void addSyscallTime(long ns) {
+      if(_seg != NULL) {
+        __atomic_add_fetch(&_seg->counters.syscallNs, ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&_seg->counters.syscalls, 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    // A watchpoint has been installed in the slot, called with its lock held.
+    void setSlot(int index, void* addr, void* objectStart, size_t objectSize, callstack* cs,
+        unsigned long installTime, bool preempted);
+
+    // The watchpoint of the slot has been removed, called with its lock held.
+    void clearSlot(int index);
+
+    void addSlotHit(int index) {
+      if(_seg != NULL) {
+        __atomic_add_fetch(&_seg->slots[index].hits, 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    // The callsite has been watched or confirmed, keep it if it is among the top ones.
+    void noteCallsite(callstack* cs);
+
+    void updateGovernor(unsigned int scale, unsigned long overhead, unsigned long epochs);
+
+    // Add the phase histogram of a thread.
+    void addPhases(const phaseHistogram* h);
+
+    void flushAllocations();
+
+  private:
+    livestats() : _seg(NULL), _pid(0), _callsitesLock(0) {}
+    ~livestats() {}
+
+    void create();
+    void getName(char* name, size_t size, int pid);
+
+    statsSegment* _seg;
+    int _pid;
+
+    // callstacks of the entries of _seg->callsites, _callsitesLock is held to change them
+    callstack* _callsites[STATS_TOP_CALLSITES];
+    int _callsitesLock;
+};
+
+#ifdef LIVE_STATS
+// Adds the time until the end of its scope to the syscall time.
+class syscallTimer {
+  public:
+    syscallTimer() : _start(livestats::now()) {}
+    ~syscallTimer() {
+      livestats::getInstance().addSyscallTime(livestats::now() - _start);
+    }
+
+  private:
+    long _start;
+};
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+#if !defined(_MEMSCAN_H)
+#define _MEMSCAN_H
+
+/*
+ * @file   memscan.hh
+ * @brief  Find head sentinels in memory several words at a time, and tell
+ *         which pages have ever been faulted in.
+ */
+
+#include <immintrin.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "xdefines.hh"
+
+typedef size_t* (*findHeadWordFunc)(size_t* it, size_t* end);
+
+// Return the first word in [it, end) that is SENTINEL_HEAD_WORD, or end.
+static size_t* findHeadWordScalar(size_t* it, size_t* end) {
+  while(it < end && *it != xdefines::SENTINEL_HEAD_WORD) {
+    it++;
+  }
+  return it;
+}
+
+__attribute__((target("avx2")))
+static size_t* findHeadWordAVX2(size_t* it, size_t* end) {
+  const __m256i magic = _mm256_set1_epi64x((long long)xdefines::SENTINEL_HEAD_WORD);
+  // 8 words per round, one test for both halves
+  while(it + 8 <= end) {
+    __m256i lo = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)it), magic);
+    __m256i hi = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(it + 4)), magic);
+    if(!_mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi))) {
+      int mask = _mm256_movemask_pd(_mm256_castsi256_pd(lo)) | (_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4);
+      return it + __builtin_ctz(mask);
+    }
+    it += 8;
+  }
+  return findHeadWordScalar(it, end);
+}
+
+static size_t* findHeadWordSSE2(size_t* it, size_t* end) {
+  const __m128i magic = _mm_set1_epi64x((long long)xdefines::SENTINEL_HEAD_WORD);
+  // SSE2 has no 64-bit compare, a word matches if both of its halves do
+  while(it + 4 <= end) {
+    __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)it), magic);
+    __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(it + 2)), magic);
+    lo = _mm_and_si128(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    hi = _mm_and_si128(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    int mask = _mm_movemask_pd(_mm_castsi128_pd(lo)) | (_mm_movemask_pd(_mm_castsi128_pd(hi)) << 2);
+    if(mask) {
+      return it + __builtin_ctz(mask);
+    }
+    it += 4;
+  }
+  return findHeadWordScalar(it, end);
+}
+
+static findHeadWordFunc selectFindHeadWord() {
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    return findHeadWordAVX2;
+  }
+  return findHeadWordSSE2;
+}
+
+// A page that is neither present nor swapped has never been written, so it
+// can not hold any sentinel. Entries are from /proc/self/pagemap.
+static inline bool isPageTouched(uint64_t entry) {
+  return (entry >> 62) != 0;
+}
+
+// Read the pagemap entries of npages pages from addr, return false on failure.
+static inline bool readPagemap(int pagemap, uintptr_t addr, uint64_t* entries, size_t npages) {
+  size_t size = npages * sizeof(uint64_t);
+  off_t offset = (addr / xdefines::PAGE_SIZE) * sizeof(uint64_t);
+  return pread(pagemap, entries, size, offset) == (ssize_t)size;
+}
+
+#endif
@@ -9,7 +9,11 @@
 class objectGuard {
   public:
     objectGuard(void* ptr, size_t sz)
-      : real_ptr(ptr), objectSize(sz), cs(NULL), head_sentinel(xdefines::SENTINEL_HEAD_WORD) {
+      : real_ptr(ptr), objectSize(sz), cs(NULL),
+#ifdef ENABLE_OBJECT_REGISTRY
+      slot(NULL),
+#endif
+      head_sentinel(xdefines::SENTINEL_HEAD_WORD) {
         // set tail sentinel
         *getTailSentinel() = xdefines::SENTINEL_TAIL_WORD;
       }
@@ -35,6 +39,11 @@ class objectGuard {
     void setCallstack(void* ptr) { cs = ptr; }
     void* getCallstack() { return cs; }
 
+#ifdef ENABLE_OBJECT_REGISTRY
+    void setSlot(void** ptr) { slot = ptr; }
+    void** getSlot() { return slot; }
+#endif
+
 #ifdef STATISTICS
     void setIndex(unsigned int idx) { index = idx; }
     unsigned int getIndex() { return index; }
@@ -50,6 +59,11 @@ class objectGuard {
     size_t objectSize;
 #endif
     void* cs;
+#ifdef ENABLE_OBJECT_REGISTRY
+    // slot in the object registry, padded to keep objects 16-byte aligned
+    void** slot;
+    void* padding;
+#endif
     size_t head_sentinel;
 };
 
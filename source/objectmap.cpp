@@ -0,0 +1,88 @@
+/*
+ * @file   objectmap.cpp
+ * @brief  Walk glibc chunks from a known allocation to a corrupted object.
+ */
+
+#ifdef OBJECT_MAP
+#include "objectmap.hh"
+
+// Header of a glibc malloc chunk, in front of the memory it returns.
+struct mallocChunk {
+  size_t prevSize;
+  size_t size;
+};
+
+enum { CHUNK_HEADER_SIZE = sizeof(mallocChunk) };
+enum { CHUNK_ALIGNMENT = 2 * sizeof(size_t) };
+enum { CHUNK_MMAPPED = 0x2 };
+enum { CHUNK_SIZE_BITS = 0x7 };
+
+uintptr_t objectmap::findStartBefore(uintptr_t addr, uintptr_t maxpages) {
+  uintptr_t page = addr / xdefines::PAGE_SIZE;
+  for(uintptr_t i = 0; i < maxpages && i <= page; i++) {
+    uintptr_t start = (uintptr_t)__atomic_load_n(&_starts[getIndex((page - i) * xdefines::PAGE_SIZE)], __ATOMIC_RELAXED);
+    // another page may share this entry
+    if(start / xdefines::PAGE_SIZE == page - i && start < addr) {
+      return start;
+    }
+  }
+  return 0;
+}
+
+mallocChunk* objectmap::findChunk(uintptr_t addr, uintptr_t maxpages, int maxwalk, mallocChunk** prev) {
+  uintptr_t start = findStartBefore(addr, maxpages);
+  if(start == 0) {
+    return NULL;
+  }
+
+  // chunks in front of addr are intact, only the header of its own chunk
+  // may have been overwritten together with the guard
+  mallocChunk* chunk = (mallocChunk*)(start - CHUNK_HEADER_SIZE);
+  mallocChunk* last = NULL;
+  for(int i = 0; i < maxwalk; i++) {
+    size_t size = chunk->size;
+    // a mmapped chunk has no neighbours
+    if(size & CHUNK_MMAPPED) {
+      return NULL;
+    }
+    size &= ~(size_t)CHUNK_SIZE_BITS;
+    if(size < 2 * CHUNK_HEADER_SIZE || size % CHUNK_ALIGNMENT != 0) {
+      return NULL;
+    }
+    if(addr < (uintptr_t)chunk + size) {
+      if(prev != NULL) {
+        *prev = last;
+      }
+      return chunk;
+    }
+    last = chunk;
+    chunk = (mallocChunk*)((uintptr_t)chunk + size);
+  }
+  return NULL;
+}
+
+objectGuard* objectmap::findGuard(mallocChunk* chunk, uintptr_t end) {
+  // memalign places the guard later in the chunk
+  uintptr_t mem = (uintptr_t)chunk + CHUNK_HEADER_SIZE;
+  if(end - mem > xdefines::MAX_GUARD_OFFSET + sizeof(objectGuard)) {
+    end = mem + xdefines::MAX_GUARD_OFFSET + sizeof(objectGuard);
+  }
+  for(uintptr_t guard = mem; guard + sizeof(objectGuard) <= end; guard += sizeof(size_t)) {
+    objectGuard* obj = (objectGuard*)guard;
+    if(obj->isGoodHead() && obj->getRealPtr() == (void*)mem) {
+      return obj;
+    }
+  }
+  return NULL;
+}
+
+objectGuard* objectmap::findPredecessor(objectGuard* obj) {
+  uintptr_t addr = (uintptr_t)obj;
+  mallocChunk* prev = NULL;
+  mallocChunk* chunk = findChunk(addr, xdefines::OBJECT_MAP_PAGES, xdefines::MAX_CHUNK_WALK, &prev);
+  if(chunk == NULL || prev == NULL || (uintptr_t)chunk > addr) {
+    return NULL;
+  }
+  return findGuard(prev, (uintptr_t)chunk);
+}
+#endif
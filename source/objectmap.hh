@@ -0,0 +1,91 @@
+#if !defined(_OBJECTMAP_H)
+#define _OBJECTMAP_H
+
+/*
+ * @file   objectmap.hh
+ * @brief  Side table of live allocations per page, to find the object in
+ *         front of a corrupted head without scanning memory.
+ *
+ * Every page remembers one live allocation that starts in it, the lowest
+ * one. An entry is cleared when its allocation is freed, so it is always a
+ * glibc chunk boundary. From there, the chunk headers lead forward to the
+ * corrupted object in a bounded number of steps.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+
+#include "xdefines.hh"
+#include "objectguard.hh"
+
+struct mallocChunk;
+
+class objectmap {
+
+  public:
+    static objectmap& getInstance() {
+      static char buf[sizeof(objectmap)];
+      static objectmap* theOneTrueObject = new (buf) objectmap();
+      return *theOneTrueObject;
+    }
+
+    // realptr is returned by Real::malloc or Real::memalign
+    void addObject(void* realptr) {
+      void** entry = &_starts[getIndex((uintptr_t)realptr)];
+      void* start = __atomic_load_n(entry, __ATOMIC_RELAXED);
+      // keep the lowest start of the page, any address behind it can use it
+      if(start == NULL || realptr < start
+          || (uintptr_t)start / xdefines::PAGE_SIZE != (uintptr_t)realptr / xdefines::PAGE_SIZE) {
+        __atomic_store_n(entry, realptr, __ATOMIC_RELAXED);
+      }
+    }
+
+    void removeObject(void* realptr) {
+      void** entry = &_starts[getIndex((uintptr_t)realptr)];
+      if(__atomic_load_n(entry, __ATOMIC_RELAXED) == realptr) {
+        __atomic_compare_exchange_n(entry, &realptr, NULL, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      }
+    }
+
+    // The guard of obj is corrupted, so its real pointer is unknown: clear
+    // any entry that may be it, one that is not only loses a starting point.
+    void removeCorruptedObject(objectGuard* obj) {
+      uintptr_t end = (uintptr_t)obj;
+      uintptr_t begin = end > xdefines::MAX_GUARD_OFFSET ? end - xdefines::MAX_GUARD_OFFSET : 0;
+      for(uintptr_t page = begin / xdefines::PAGE_SIZE; page <= end / xdefines::PAGE_SIZE; page++) {
+        void** entry = &_starts[getIndex(page * xdefines::PAGE_SIZE)];
+        void* start = __atomic_load_n(entry, __ATOMIC_RELAXED);
+        if((uintptr_t)start >= begin && (uintptr_t)start <= end) {
+          __atomic_compare_exchange_n(entry, &start, NULL, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+      }
+    }
+
+    // Find the guard of the object right in front of obj, NULL if it can
+    // not be found in a bounded number of steps.
+    objectGuard* findPredecessor(objectGuard* obj);
+
+  private:
+    objectmap() {}
+    ~objectmap() {}
+
+    static size_t getIndex(uintptr_t addr) {
+      return (addr / xdefines::PAGE_SIZE) & (xdefines::OBJECT_MAP_ENTRIES - 1);
+    }
+
+    // A live allocation starting before addr, not farther than maxpages pages.
+    uintptr_t findStartBefore(uintptr_t addr, uintptr_t maxpages);
+
+    // The chunk holding addr, walking at most maxwalk chunks from a known
+    // allocation, and the chunk in front of it if prev is not NULL.
+    mallocChunk* findChunk(uintptr_t addr, uintptr_t maxpages, int maxwalk, mallocChunk** prev);
+
+    // The guard placed in a chunk by malloc or memalign.
+    objectGuard* findGuard(mallocChunk* chunk, uintptr_t end);
+
+    void* _starts[xdefines::OBJECT_MAP_ENTRIES];
+};
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * @file   phases.cpp
+ * @brief  Add up the phase histograms of all threads and print them.
+ */
+
+#ifdef PHASE_ACCOUNTING
+#include "phases.hh"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef LIVE_STATS
+#include "livestats.hh"
+#endif
+
+void phases::flush(threadPhases* t) {
+  phaseHistogram* h = &t->histogram;
+  for(int p = 0; p < PHASES; p++) {
+    for(int b = 0; b < PHASE_BUCKETS; b++) {
+      if(h->counts[p][b] != 0) {
+        __atomic_add_fetch(&_total.counts[p][b], h->counts[p][b], __ATOMIC_RELAXED);
+      }
+    }
+    __atomic_add_fetch(&_total.cycles[p], h->cycles[p], __ATOMIC_RELAXED);
+  }
+#ifdef LIVE_STATS
+  livestats::getInstance().addPhases(h);
+#endif
+  memset(h, 0, sizeof(phaseHistogram));
+  t->samples = 0;
+}
+
+// Percentiles are the upper bounds of their buckets.
+void phases::printSummary() {
+  if(current != NULL) {
+    flush(&current->phases);
+  }
+  fprintf(stderr, "***phase accounting, in cycles***\n");
+  fprintf(stderr, "%-14s %12s %10s %10s %10s %10s\n", "phase", "calls", "mean", "p50<=", "p90<=", "p99<=");
+  for(int p = 0; p < PHASES; p++) {
+    uint64_t calls = phaseCalls(&_total, p);
+    if(calls == 0) {
+      continue;
+    }
+    fprintf(stderr, "%-14s %12lu %10lu %10lu %10lu %10lu\n", phaseNames[p], (unsigned long)calls,
+        (unsigned long)(_total.cycles[p] / calls), (unsigned long)phasePercentile(&_total, p, 0.5),
+        (unsigned long)phasePercentile(&_total, p, 0.9), (unsigned long)phasePercentile(&_total, p, 0.99));
+  }
+}
+#endif
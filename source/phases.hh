@@ -0,0 +1,71 @@
+#if !defined(_PHASES_H)
+#define _PHASES_H
+
+/*
+ * @file   phases.hh
+ * @brief  Cycles spent in each phase of the allocation path, with PHASE_ACCOUNTING.
+ *
+ * PHASE_START(t) and PHASE_STOP(t, phase) put rdtscp around a phase and add
+ * the difference to a histogram of the current thread, see statsformat.hh
+ * for the phases and buckets. Every PHASE_FLUSH_SAMPLES samples, and when
+ * the thread exits, its histogram is added to the process total and to the
+ * live stats. Without PHASE_ACCOUNTING the macros are empty.
+ */
+
+#ifdef PHASE_ACCOUNTING
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+
+#include "xdefines.hh"
+#include "threadstruct.hh"
+#include "statsformat.hh"
+
+class phases {
+
+  public:
+    static phases& getInstance() {
+      static char buf[sizeof(phases)];
+      static phases* theOneTrueObject = new (buf) phases();
+      return *theOneTrueObject;
+    }
+
+    static void record(int phase, unsigned long cycles) {
+      if(current == NULL) {
+        return;
+      }
+      threadPhases* t = &current->phases;
+      int bucket = cycles == 0 ? 0 : 63 - __builtin_clzl(cycles);
+      if(bucket >= PHASE_BUCKETS) {
+        bucket = PHASE_BUCKETS - 1;
+      }
+      t->histogram.counts[phase][bucket]++;
+      t->histogram.cycles[phase] += cycles;
+      if(unlikely(++t->samples >= xdefines::PHASE_FLUSH_SAMPLES)) {
+        getInstance().flush(t);
+      }
+    }
+
+    // Add the histogram of a thread to the total and clear it.
+    void flush(threadPhases* t);
+
+    void printSummary();
+
+  private:
+    phases() {
+      memset(&_total, 0, sizeof(_total));
+    }
+    ~phases() {}
+
+    phaseHistogram _total;
+};
+
+#define PHASE_START(t) unsigned long t = rdtscp()
+#define PHASE_STOP(t, phase) phases::record((phase), rdtscp() - (t))
+#else
+#define PHASE_START(t)
+#define PHASE_STOP(t, phase)
+#endif
+
+#endif
@@ -0,0 +1,92 @@
+#if !defined(_POLICY_H)
+#define _POLICY_H
+
+/*
+ * @file   policy.hh
+ * @brief  Which allocations get a watchpoint, apart from installing it.
+ *
+ * The sampling of callsites in causer and the choice of a slot in
+ * watchpoint call these, and so does tools/policysim, which replays
+ * allocation traces against them without any perf syscalls. A change of
+ * the decay of watchedRatio or of the preemption formula made here can be
+ * tried on traces first. Callsites are any type with the fields of
+ * callstack that are used. The values come from tuning, see config.hh.
+ */
+
+#include "config.hh"
+#include "xdefines.hh"
+
+class policy {
+
+  public:
+    // The first maxWatchThreshold allocations of a callsite in a period
+    // take a free slot whenever there is one.
+    template<typename CS>
+    static bool inFirstAllocations(const CS* cs) {
+      return cs->periodcalled < tuning.maxWatchThreshold;
+    }
+
+    // Bound of the draw that is compared with watchedRatio, the draw is
+    // ten times harder once the first allocations of the period are done.
+    static unsigned int drawBound(bool firstAllocations) {
+      if(firstAllocations) {
+        return xdefines::MAX_WATCH_RATIO_UPPERBOUND;
+      }
+      return xdefines::MAX_WATCH_RATIO_SECOND_UPPERBOUND;
+    }
+
+    template<typename CS>
+    static bool drawWins(const CS* cs, int rnd) {
+      return rnd <= cs->watchedRatio;
+    }
+
+    // Whether a callsite with ratio can take a slot that a callsite with
+    // installedRatio has held for age ms. The hold of the installed one
+    // fades over wpPreemptTimeReductionBase.
+    static bool canPreempt(int ratio, int installedRatio, unsigned long age, unsigned long mintime) {
+      return age >= mintime
+        && ratio > (installedRatio * tuning.wpPreemptWeight * (1 - age * 1.0 / tuning.wpPreemptTimeReductionBase));
+    }
+
+    // Slots are tried round robin, from the one after the last installed.
+    static int nextSlot(int sidx, int slots) {
+      return sidx + 1 == slots ? 0 : sidx + 1;
+    }
+
+    // Count an allocation of cs and lower its ratio, by a step when it was
+    // not watched and by a factor when it was. A callsite whose overflow is
+    // confirmed stays at the upper bound.
+    template<typename CS>
+    static void countAllocation(CS* cs, bool watched) {
+      cs->calledCounter++;
+      cs->periodcalled++;
+      if(watched) {
+        cs->watchedCounter++;
+      }
+      if(cs->watchedRatio != xdefines::MAX_WATCH_RATIO_UPPERBOUND) {
+        if(watched) {
+          cs->watchedRatio *= tuning.watchedReduction * 0.1;
+        } else {
+          cs->watchedRatio -= tuning.calledReduction;
+        }
+      }
+    }
+
+    template<typename CS>
+    static void clampRatio(CS* cs) {
+      if(cs->watchedRatio < tuning.reductionToMin) {
+        cs->watchedRatio = tuning.reductionToMin;
+      }
+    }
+
+    // Start a new period once maxWatchPeriod ms have passed.
+    template<typename CS>
+    static void updatePeriod(CS* cs, unsigned long now) {
+      if((now - cs->period) > tuning.maxWatchPeriod) {
+        cs->periodcalled = 0;
+        cs->period = now;
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * @file   quarantine.cpp
+ * @brief  Batched checks of objects leaving the quarantine.
+ */
+
+#ifdef QUARANTINE
+#include "quarantine.hh"
+
+#include <stdio.h>
+
+#include "real.hh"
+#include "causer.hh"
+#ifdef OBJECT_MAP
+#include "objectmap.hh"
+#endif
+
+#ifdef QUARANTINE_FILL
+// Return the offset of the first byte written after free, or size if none.
+static size_t findWriteAfterFree(objectGuard* obj, size_t size) {
+  const unsigned char* start = (const unsigned char*)obj->getStartPtr();
+  const size_t pattern = (size_t)0x0101010101010101UL * xdefines::QUARANTINE_FILL_BYTE;
+
+  // objects are word aligned
+  size_t i = 0;
+  for(; i + sizeof(size_t) <= size; i += sizeof(size_t)) {
+    if(*(const size_t*)(start + i) != pattern) {
+      break;
+    }
+  }
+  for(; i < size; i++) {
+    if(start[i] != xdefines::QUARANTINE_FILL_BYTE) {
+      return i;
+    }
+  }
+  return size;
+}
+#endif
+
+void quarantine::evict(quarantineRing* q) {
+  objectGuard* batch[xdefines::QUARANTINE_BATCH];
+  size_t sizes[xdefines::QUARANTINE_BATCH];
+  unsigned int n = q->count < xdefines::QUARANTINE_BATCH ? q->count : xdefines::QUARANTINE_BATCH;
+
+  for(unsigned int i = 0; i < n; i++) {
+    quarantineEntry* e = &q->entries[(q->head + i) % xdefines::QUARANTINE_ENTRIES];
+    batch[i] = (objectGuard*)e->object;
+    sizes[i] = e->size;
+    __builtin_prefetch(batch[i]);
+    // the size in the guard may have been overwritten since
+    q->bytes -= sizes[i];
+  }
+  // the guards are in cache by now, fetch the tails
+  for(unsigned int i = 0; i < n; i++) {
+    __builtin_prefetch(batch[i]->getTailSentinel());
+  }
+  q->head = (q->head + n) % xdefines::QUARANTINE_ENTRIES;
+  q->count -= n;
+
+  for(unsigned int i = 0; i < n; i++) {
+    objectGuard* obj = batch[i];
+#ifdef QUARANTINE_FILL
+    // a corrupted head is reported by checkPointer
+    if(obj->isGoodHead()) {
+      size_t offset = findWriteAfterFree(obj, sizes[i]);
+      if(offset != sizes[i]) {
+        fprintf(stderr, "[check in quarantine] Object %p is written after free at offset %zu\n",
+            obj->getStartPtr(), offset);
+      }
+    }
+#endif
+    void* ptr = causer::getInstance().checkPointer(obj->getStartPtr());
+#ifdef OBJECT_MAP
+    objectmap::getInstance().removeObject(ptr);
+#endif
+    Real::free(ptr);
+  }
+}
+#endif
@@ -0,0 +1,82 @@
+#if !defined(_QUARANTINE_H)
+#define _QUARANTINE_H
+
+/*
+ * @file   quarantine.hh
+ * @brief  Per-thread quarantine of freed objects.
+ *
+ * Freed objects wait in a ring of their thread until it runs out of entries
+ * or bytes. Then the oldest ones are checked together, with their guards
+ * and tail sentinels prefetched, and given back to libc in one go.
+ * With QUARANTINE_FILL, a freed object is filled with a pattern, which is
+ * verified when it leaves the ring to catch writes after free.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+
+#include "xdefines.hh"
+#include "threadstruct.hh"
+#include "objectguard.hh"
+#include "config.hh"
+
+class quarantine {
+
+  public:
+    static quarantine& getInstance() {
+      static char buf[sizeof(quarantine)];
+      static quarantine* theOneTrueObject = new (buf) quarantine();
+      return *theOneTrueObject;
+    }
+
+    // Keep obj in the quarantine of the current thread, return false if it
+    // should be freed right now.
+    bool deferFree(objectGuard* obj) {
+      thread_t* thread = current;
+      // helper threads are not created through xthread
+      if(thread == NULL || !obj->isGoodHead()) {
+        return false;
+      }
+      size_t size = obj->getObjectSize();
+      if(size > xdefines::QUARANTINE_MAX_OBJECT) {
+        return false;
+      }
+
+      quarantineRing* q = &thread->quarantine;
+      if(q->count == xdefines::QUARANTINE_ENTRIES) {
+        evict(q);
+      }
+#ifdef QUARANTINE_FILL
+      memset(obj->getStartPtr(), xdefines::QUARANTINE_FILL_BYTE, size);
+#endif
+      quarantineEntry* e = &q->entries[(q->head + q->count) % xdefines::QUARANTINE_ENTRIES];
+      e->object = obj;
+      e->size = size;
+      q->count++;
+      q->bytes += size;
+      if(q->bytes > tuning.quarantineBytes) {
+        evict(q);
+      }
+      return true;
+    }
+
+    // Check and free all objects in the quarantine of thread.
+    void drain(thread_t* thread) {
+      quarantineRing* q = &thread->quarantine;
+      while(q->count != 0) {
+        evict(q);
+      }
+    }
+
+  private:
+    quarantine() {}
+    ~quarantine() {}
+
+    // Check and free the oldest QUARANTINE_BATCH objects.
+    void evict(quarantineRing* q);
+};
+
+#endif
@@ -25,6 +25,18 @@ DEFINE_WRAPPER(getservbyname);
 DEFINE_WRAPPER(setlocale);
 DEFINE_WRAPPER(unlink);
 DEFINE_WRAPPER(backtrace);
+DEFINE_WRAPPER(dlclose);
+
+#ifdef SOFTWARE_BOUNDS_CHECK
+DEFINE_WRAPPER(memcpy);
+DEFINE_WRAPPER(memmove);
+DEFINE_WRAPPER(memset);
+DEFINE_WRAPPER(__memcpy_chk);
+DEFINE_WRAPPER(__memmove_chk);
+DEFINE_WRAPPER(__memset_chk);
+DEFINE_WRAPPER(__strcpy_chk);
+DEFINE_WRAPPER(__strcat_chk);
+#endif
 
 void initializer() {
   INIT_WRAPPER(free, RTLD_NEXT);
@@ -44,9 +56,25 @@ void initializer() {
   INIT_WRAPPER(setlocale, RTLD_NEXT);
   INIT_WRAPPER(unlink, RTLD_NEXT);
   INIT_WRAPPER(backtrace, RTLD_NEXT);
+  INIT_WRAPPER(dlclose, RTLD_NEXT);
+
+#ifdef SOFTWARE_BOUNDS_CHECK
+  INIT_WRAPPER(memcpy, RTLD_NEXT);
+  INIT_WRAPPER(memmove, RTLD_NEXT);
+  INIT_WRAPPER(memset, RTLD_NEXT);
+  INIT_WRAPPER(__memcpy_chk, RTLD_NEXT);
+  INIT_WRAPPER(__memmove_chk, RTLD_NEXT);
+  INIT_WRAPPER(__memset_chk, RTLD_NEXT);
+  INIT_WRAPPER(__strcpy_chk, RTLD_NEXT);
+  INIT_WRAPPER(__strcat_chk, RTLD_NEXT);
+#endif
 
 //  INIT_WRAPPER(pthread_create, RTLD_NEXT);
   void* pthread_handle = dlopen("libpthread.so.0", RTLD_NOW | RTLD_GLOBAL | RTLD_NOLOAD);
+  // pthread lives in libc since glibc 2.34, libpthread may not be loaded at all
+  if(pthread_handle == NULL) {
+    pthread_handle = RTLD_NEXT;
+  }
   INIT_WRAPPER(pthread_create, pthread_handle);
 }
 
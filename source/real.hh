@@ -11,6 +11,18 @@
 #include <netdb.h>
 #include <locale.h>
 #include <execinfo.h>
+#include <string.h>
+
+#ifdef SOFTWARE_BOUNDS_CHECK
+// fortified variants, only declared by the libc headers under _FORTIFY_SOURCE
+extern "C" {
+void* __memcpy_chk(void* dst, const void* src, size_t len, size_t dstlen);
+void* __memmove_chk(void* dst, const void* src, size_t len, size_t dstlen);
+void* __memset_chk(void* dst, int c, size_t len, size_t dstlen);
+char* __strcpy_chk(char* dst, const char* src, size_t dstlen);
+char* __strcat_chk(char* dst, const char* src, size_t dstlen);
+}
+#endif
 
 #define DECLARE_WRAPPER(name) extern decltype(::name) * name;
 
@@ -36,6 +48,18 @@ DECLARE_WRAPPER(getservbyname);
 DECLARE_WRAPPER(setlocale);
 DECLARE_WRAPPER(unlink);
 DECLARE_WRAPPER(backtrace);
+DECLARE_WRAPPER(dlclose);
+
+#ifdef SOFTWARE_BOUNDS_CHECK
+DECLARE_WRAPPER(memcpy);
+DECLARE_WRAPPER(memmove);
+DECLARE_WRAPPER(memset);
+DECLARE_WRAPPER(__memcpy_chk);
+DECLARE_WRAPPER(__memmove_chk);
+DECLARE_WRAPPER(__memset_chk);
+DECLARE_WRAPPER(__strcpy_chk);
+DECLARE_WRAPPER(__strcat_chk);
+#endif
 };
 
 #endif
@@ -0,0 +1,135 @@
+/*
+ * @file   registry.cpp
+ * @brief  Chunk management of the live object registry.
+ */
+
+#ifdef ENABLE_OBJECT_REGISTRY
+#include "registry.hh"
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+__thread registryChunk* registryCurrent = NULL;
+
+registryChunk* registry::nextChunk(registryChunk* full) {
+  registryChunk* chunk = NULL;
+
+  _lock.lock();
+  if(_region == NULL && _complete) {
+    // only address space is reserved, pages are faulted in as chunks are used
+    void* ptr = mmap(NULL, (size_t)xdefines::REGISTRY_MAX_CHUNKS * xdefines::PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(ptr == MAP_FAILED) {
+      fprintf(stderr, "Failed to reserve the object registry, objects will not be registered\n");
+      _complete = false;
+    } else {
+      _region = (char*)ptr;
+    }
+  }
+
+  if(_freeChunks != NULL) {
+    chunk = _freeChunks;
+    _freeChunks = chunk->next;
+  } else if(_region != NULL && _nchunks < xdefines::REGISTRY_MAX_CHUNKS) {
+    chunk = (registryChunk*)(_region + _nchunks * xdefines::PAGE_SIZE);
+    chunk->count = 0;
+    chunk->freed = 0;
+    // published after the chunk is initialized, see forEachObject
+    __atomic_store_n(&_nchunks, _nchunks + 1, __ATOMIC_RELEASE);
+  } else if(_complete) {
+    fprintf(stderr, "Object registry is full, objects will not be registered\n");
+    _complete = false;
+  }
+  _lock.unlock();
+
+  // the owner leaves the full chunk
+  if(full != NULL) {
+    releaseSlot(full);
+  }
+  registryCurrent = chunk;
+  return chunk;
+}
+
+void registry::recycleChunk(registryChunk* chunk) {
+  chunk->count = 0;
+  chunk->freed = 0;
+
+  _lock.lock();
+  chunk->next = _freeChunks;
+  _freeChunks = chunk;
+  _lock.unlock();
+}
+
+void registry::releaseThread() {
+  registryChunk* chunk = registryCurrent;
+  registryCurrent = NULL;
+
+  // a full chunk is left as usual, others keep their free slots for new threads
+  if(chunk == NULL) {
+    return;
+  }
+  if(chunk->count == CHUNK_ENTRIES) {
+    releaseSlot(chunk);
+    return;
+  }
+  _lock.lock();
+  chunk->next = _freeChunks;
+  _freeChunks = chunk;
+  _lock.unlock();
+}
+
+size_t registry::forEachObject(void (*func)(objectGuard*, void*), void* arg) {
+  size_t objects = 0;
+  size_t nchunks = __atomic_load_n(&_nchunks, __ATOMIC_ACQUIRE);
+  for(size_t i = 0; i < nchunks; i++) {
+    registryChunk* chunk = (registryChunk*)(_region + i * xdefines::PAGE_SIZE);
+    unsigned int count = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE);
+    for(unsigned int j = 0; j < count && j < CHUNK_ENTRIES; j++) {
+      uintptr_t value = (uintptr_t)__atomic_load_n(&chunk->entries[j], __ATOMIC_RELAXED);
+      objectGuard* obj = (objectGuard*)(value & ~(uintptr_t)SLOT_FLAGS);
+      if(obj != NULL) {
+        func(obj, arg);
+        objects++;
+      }
+    }
+  }
+  return objects;
+}
+
+size_t registry::verifyObjects(size_t* cursor, size_t limit, bool (*func)(objectGuard*, void*), void* arg) {
+  size_t nchunks = __atomic_load_n(&_nchunks, __ATOMIC_ACQUIRE);
+  size_t index = *cursor;
+  size_t visited = 0;
+
+  while(visited < limit) {
+    size_t i = index / CHUNK_ENTRIES;
+    if(i >= nchunks) {
+      index = 0;
+      break;
+    }
+    registryChunk* chunk = (registryChunk*)(_region + i * xdefines::PAGE_SIZE);
+    unsigned int j = index % CHUNK_ENTRIES;
+    unsigned int count = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE);
+    if(j >= count) {
+      // skip the unused part of the chunk
+      index = (i + 1) * CHUNK_ENTRIES;
+      continue;
+    }
+
+    void** slot = &chunk->entries[j];
+    void* value = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if(value != NULL && ((uintptr_t)value & SLOT_FLAGS) == 0
+        && __atomic_compare_exchange_n(slot, &value, (void*)((uintptr_t)value | SLOT_PINNED),
+          false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      bool corrupted = func((objectGuard*)value, arg);
+      // the owner only waits for the pin, so the slot still holds our value
+      __atomic_store_n(slot, corrupted ? (void*)((uintptr_t)value | SLOT_REPORTED) : value, __ATOMIC_RELEASE);
+    }
+    index++;
+    visited++;
+  }
+
+  *cursor = index;
+  return visited;
+}
+#endif
@@ -0,0 +1,133 @@
+#if !defined(_REGISTRY_H)
+#define _REGISTRY_H
+
+/*
+ * @file   registry.hh
+ * @brief  Registry of live guarded objects, so that checks visit only real
+ *         objects instead of scanning memory for head sentinels.
+ *
+ * Every thread appends its objects to its own chunk, which needs no lock.
+ * An object keeps the address of its slot, so any thread can free it by
+ * clearing the slot. A chunk is recycled once all of its slots have been
+ * freed and its owner has moved on, which is counted in freed as one more
+ * slot. All chunks come from one reserved region, so a slot address read
+ * from a corrupted guard can be validated before it is written.
+ *
+ * The background verifier pins a slot with its low bit while it checks the
+ * object, and free waits for the pin before the object goes back to libc.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+
+#include "xdefines.hh"
+#include "spinlock.hh"
+#include "objectguard.hh"
+
+struct registryChunk {
+  unsigned int count;           // slots used, only written by the owner
+  unsigned int freed;           // slots freed, plus one once the owner leaves
+  registryChunk* next;          // in the list of chunks with free slots
+  void* entries[(xdefines::PAGE_SIZE - 16) / sizeof(void*)];
+};
+
+extern __thread registryChunk* registryCurrent;
+
+class registry {
+
+  public:
+    enum { CHUNK_ENTRIES = (xdefines::PAGE_SIZE - 16) / sizeof(void*) };
+
+    // flags in the low bits of a slot, objects are 16-byte aligned
+    enum { SLOT_PINNED = 1, SLOT_REPORTED = 2, SLOT_FLAGS = 3 };
+
+    static registry& getInstance() {
+      static char buf[sizeof(registry)];
+      static registry* theOneTrueObject = new (buf) registry();
+      return *theOneTrueObject;
+    }
+
+    void registerObject(objectGuard* obj) {
+      registryChunk* chunk = registryCurrent;
+      if(unlikely(chunk == NULL || chunk->count == CHUNK_ENTRIES)) {
+        chunk = nextChunk(chunk);
+        if(chunk == NULL) {
+          return;
+        }
+      }
+      unsigned int count = chunk->count;
+      chunk->entries[count] = obj;
+      obj->setSlot(&chunk->entries[count]);
+      // readers see the entry before the count
+      __atomic_store_n(&chunk->count, count + 1, __ATOMIC_RELEASE);
+    }
+
+    void unregisterObject(objectGuard* obj) {
+      void** slot = obj->getSlot();
+      if(slot == NULL || (char*)slot < _region || (char*)slot >= _region + _nchunks * xdefines::PAGE_SIZE) {
+        return;
+      }
+      void* value = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+      do {
+        if(((uintptr_t)value & ~(uintptr_t)SLOT_FLAGS) != (uintptr_t)obj) {
+          return;
+        }
+        // the verifier is checking this object, it may have been preempted
+        for(int spins = 0; (uintptr_t)value & SLOT_PINNED; spins++) {
+          if(spins < 64) {
+            __asm__("pause");
+          } else {
+            sched_yield();
+          }
+          value = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        }
+      } while(!__atomic_compare_exchange_n(slot, &value, NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+      obj->setSlot(NULL);
+      releaseSlot((registryChunk*)((uintptr_t)slot & ~xdefines::PAGE_SIZE_MASK));
+    }
+
+    // Give the chunk of the current thread to others, called when it exits.
+    void releaseThread();
+
+    // Call func on every registered object.
+    size_t forEachObject(void (*func)(objectGuard*, void*), void* arg);
+
+    // Visit up to limit slots from *cursor, which wraps to 0 after the last
+    // chunk. Every live object that has not been reported is pinned while
+    // func checks it, and marked as reported if func returns true.
+    // Return the number of slots visited, 0 once the registry is exhausted.
+    size_t verifyObjects(size_t* cursor, size_t limit, bool (*func)(objectGuard*, void*), void* arg);
+
+    // Whether all objects have been registered since the start.
+    bool isComplete() { return _complete; }
+
+  private:
+    registry() : _region(NULL), _nchunks(0), _freeChunks(NULL), _complete(true) {
+      _lock.init();
+    }
+    ~registry() {}
+
+    static_assert(sizeof(registryChunk) == xdefines::PAGE_SIZE, "a chunk is one page");
+
+    registryChunk* nextChunk(registryChunk* full);
+
+    void releaseSlot(registryChunk* chunk) {
+      if(__atomic_add_fetch(&chunk->freed, 1, __ATOMIC_ACQ_REL) == CHUNK_ENTRIES + 1) {
+        recycleChunk(chunk);
+      }
+    }
+
+    void recycleChunk(registryChunk* chunk);
+
+    spinlock _lock;
+    char* _region;
+    size_t _nchunks;
+    registryChunk* _freeChunks;
+    bool _complete;
+};
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * @file   selfmap.cpp
+ * @brief  Build the table of text ranges from the loaded modules.
+ */
+
+#include "selfmap.hh"
+
+struct tablebuilder {
+  selfmap* maps;
+  texttable* table;
+  uintptr_t self;       // an address inside our own library
+  const char* mainExe;
+  bool full;
+};
+
+// The copy of name in the pool, added if it is not there yet. The pool is
+// only appended to, so a name stays valid after its table is reused.
+const char* selfmap::internName(const char* name) {
+  size_t len = strlen(name) + 1;
+  const char* ret = NULL;
+  _lock.lock();
+  for(size_t pos = 0; pos < _namesize; pos += strlen(&_names[pos]) + 1) {
+    if(strcmp(&_names[pos], name) == 0) {
+      ret = &_names[pos];
+      break;
+    }
+  }
+  if(ret == NULL && _names != NULL && _namesize + len <= xdefines::TEXT_NAMES_SIZE) {
+    ret = (char*)memcpy(&_names[_namesize], name, len);
+    _namesize += len;
+  }
+  _lock.unlock();
+  return ret != NULL ? ret : "";
+}
+
+static uint32_t getModuleKind(const char* name, bool self, bool main) {
+  if(self) {
+    return TEXT_CAUSER;
+  } else if(main) {
+    return TEXT_APPLICATION;
+  } else if(strstr(name, "/libc.so") != NULL || strstr(name, "/libc-") != NULL) {
+    return TEXT_LIBC;
+  } else if(strstr(name, "/libpthread") != NULL) {
+    return TEXT_PTHREAD;
+  }
+  return TEXT_OTHER;
+}
+
+int selfmap::addModule(struct dl_phdr_info* info, size_t size, void* data) {
+  tablebuilder* builder = (tablebuilder*)data;
+  texttable* table = builder->table;
+
+  // the main program always comes first
+  bool main = (table->adds == 0 && table->nmodules == 0 && table->nranges == 0
+      && (info->dlpi_name == NULL || info->dlpi_name[0] == '\0'));
+  if(size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+    table->adds = info->dlpi_adds;
+    table->subs = info->dlpi_subs;
+  }
+
+  bool self = false;
+  uint32_t first = table->nranges;
+  for(int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if(phdr->p_type != PT_LOAD) {
+      continue;
+    }
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+    uintptr_t end = start + phdr->p_memsz;
+    if(builder->self >= start && builder->self < end) {
+      self = true;
+    }
+    if(!(phdr->p_flags & PF_X)) {
+      continue;
+    }
+    if(table->nranges == xdefines::MAX_TEXT_RANGES || table->nmodules == xdefines::MAX_TEXT_MODULES) {
+      builder->full = true;
+      break;
+    }
+    // the same bounds as the mapping in /proc/self/maps
+    textrange* r = &table->ranges[table->nranges++];
+    r->start = start & ~xdefines::PAGE_SIZE_MASK;
+    r->end = (end + xdefines::PAGE_SIZE_MASK) & ~xdefines::PAGE_SIZE_MASK;
+    r->module = table->nmodules;
+  }
+  if(table->nranges == first) {
+    return 0;
+  }
+
+  const char* name = main ? builder->mainExe : info->dlpi_name;
+  textmodule* m = &table->modules[table->nmodules++];
+  m->name = builder->maps->internName(name != NULL ? name : "");
+  m->base = table->ranges[first].start;
+  m->load = info->dlpi_addr;
+  uint32_t kind = getModuleKind(m->name, self, main);
+  for(uint32_t i = first; i < table->nranges; i++) {
+    table->ranges[i].kind = kind;
+  }
+  return 0;
+}
+
+static int readCounters(struct dl_phdr_info* info, size_t size, void* data) {
+  unsigned long long* counters = (unsigned long long*)data;
+  if(size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+    counters[0] = info->dlpi_adds;
+    counters[1] = info->dlpi_subs;
+  }
+  return 1;
+}
+
+static void sortRanges(texttable* table) {
+  // insertion sort, modules are mostly in order already and qsort may allocate
+  for(uint32_t i = 1; i < table->nranges; i++) {
+    textrange r = table->ranges[i];
+    int j = i - 1;
+    while(j >= 0 && table->ranges[j].start > r.start) {
+      table->ranges[j + 1] = table->ranges[j];
+      j--;
+    }
+    table->ranges[j + 1] = r;
+  }
+}
+
+// A retired table that no lookup uses any more, NULL if all are busy.
+// Called with _lock held.
+texttable* selfmap::takeRetiredTable() {
+  texttable** prev = &_retired;
+  for(texttable* table = _retired; table != NULL; table = table->next) {
+    if(__atomic_load_n(&table->readers, __ATOMIC_SEQ_CST) == 0) {
+      *prev = table->next;
+      return table;
+    }
+    prev = &table->next;
+  }
+  return NULL;
+}
+
+// Keep a table that was swapped out, lookups may still hold it. Called with
+// _lock held.
+void selfmap::retireTable(texttable* table) {
+  table->next = _retired;
+  _retired = table;
+}
+
+// The loader lock is taken by dl_iterate_phdr, and a thread in dlopen may
+// call malloc with it held, so our lock only covers the swap.
+void selfmap::refresh() {
+  _lock.lock();
+  texttable* table = takeRetiredTable();
+  _lock.unlock();
+
+  if(table != NULL) {
+    // readers is left alone, a lookup racing with the swap may bump it
+    table->adds = 0;
+    table->subs = 0;
+    table->nranges = 0;
+    table->nmodules = 0;
+  } else {
+    void* ptr = mmap(NULL, sizeof(texttable), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED) {
+      fprintf(stderr, "Failed to allocate the table of text ranges\n");
+      return;
+    }
+    table = (texttable*)ptr;
+  }
+
+  tablebuilder builder = { this, table, (uintptr_t)&selfmap::addModule, _mainExe, false };
+  dl_iterate_phdr(addModule, &builder);
+  if(builder.full) {
+    fprintf(stderr, "Too many text ranges, some modules are not classified\n");
+  }
+  sortRanges(table);
+
+  _lock.lock();
+  texttable* old = _table;
+  // a concurrent rebuild may have seen more changes
+  if(old == NULL || table->adds + table->subs >= old->adds + old->subs) {
+    // a lookup that bumped the count of old sees the new table and lets go
+    __atomic_store_n(&_table, table, __ATOMIC_SEQ_CST);
+    table = old;
+  }
+  if(table != NULL) {
+    retireTable(table);
+  }
+  _lock.unlock();
+}
+
+bool selfmap::refreshIfChanged() {
+  unsigned long long counters[2] = { 0, 0 };
+  dl_iterate_phdr(readCounters, counters);
+
+  texttable* table = getTable();
+  if(table != NULL && table->adds == counters[0] && table->subs == counters[1]) {
+    return false;
+  }
+  refresh();
+  return true;
+}
@@ -3,23 +3,38 @@
 
 /*
  * @file   selfmap.h
- * @brief  Process the /proc/self/map file.
+ * @brief  Process the /proc/self/map file, and classify code addresses.
+ *
+ * Text ranges of all loaded modules are kept in an immutable table sorted
+ * by address, so that lookups from getCallsites and the trap handler are
+ * binary searches that never allocate or lock. A new table is built from
+ * dl_iterate_phdr and swapped in atomically when a module is loaded or
+ * unloaded. Every lookup counts itself as a reader of the table it uses,
+ * and a table that was swapped out is only reused for a new build once it
+ * has no readers. Tables are never unmapped, since a lookup may still bump
+ * the count of a table that was swapped out under it. Module names are kept in a pool that is only appended to, so
+ * the copies of textmodule handed out stay valid.
  */
 
+#include <elf.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <link.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
-#include <fstream>
-#include <functional>
-#include <map>
 #include <new>
 #include <string>
-#include <utility>
 
-#include "interval.hh"
+#include "xdefines.hh"
+#include "spinlock.hh"
 
 using namespace std;
 
@@ -28,14 +43,51 @@ struct regioninfo {
   void* end;
 };
 
+// A loaded module, base is the start of its first text mapping, which is
+// what offsets in the history are relative to. load is the bias of its
+// addresses, as needed by addr2line.
+struct textmodule {
+  const char* name;
+  uintptr_t base;
+  uintptr_t load;
+};
+
+// What a text range belongs to, used by the frequent checks.
+enum {
+  TEXT_OTHER = 0,
+  TEXT_CAUSER,
+  TEXT_LIBC,
+  TEXT_PTHREAD,
+  TEXT_APPLICATION
+};
+
+struct textrange {
+  uintptr_t start;
+  uintptr_t end;      // exclusive
+  uint32_t module;
+  uint32_t kind;
+};
+
+struct texttable {
+  unsigned long readers;    // lookups using it
+  texttable* next;          // in the list of retired tables
+  unsigned long long adds;  // dl_iterate_phdr counters when it was built
+  unsigned long long subs;
+  uint32_t nranges;
+  uint32_t nmodules;
+  textrange ranges[xdefines::MAX_TEXT_RANGES];
+  textmodule modules[xdefines::MAX_TEXT_MODULES];
+};
+
 /**
- * A single mapping parsed from the /proc/self/maps file
+ * A single mapping parsed from the /proc/self/maps file. The file name is
+ * not copied, it lives in the buffer of the mapsreader that produced it.
  */
 class mapping {
   public:
-    mapping() : _valid(false) {}
+    mapping() : _valid(false), _file("") {}
 
-    mapping(uintptr_t base, uintptr_t limit, char* perms, size_t offset, std::string file)
+    mapping(uintptr_t base, uintptr_t limit, const char* perms, size_t offset, const char* file)
       : _valid(true), _base(base), _limit(limit), _readable(perms[0] == 'r'),
       _writable(perms[1] == 'w'), _executable(perms[2] == 'x'), _copy_on_write(perms[3] == 'p'),
       _offset(offset), _file(file) {}
@@ -46,27 +98,27 @@ class mapping {
 
     bool isData() const { return _readable && _writable && !_executable && _copy_on_write; }
 
-    bool isStack() const { return _file.find("[stack") != std::string::npos; }
+    bool isStack() const { return strncmp(_file, "[stack", 6) == 0; }
 
-    bool isGlobals(std::string mainfile) const {
+    bool isGlobals(const char* mainfile) const {
       // global mappings are RW_P, and either the heap, or the mapping is backed
       // by a file (and all files have absolute paths)
       // the file is the current executable file, with [heap], or with lib*.so
       // Actually, the mainfile can be longer if it has some parameters.
       return (_readable && _writable && !_executable && _copy_on_write) &&
-        (_file.size() > 0 && (_file == mainfile ||  _file == "[heap]" || _file.find(".so") != std::string::npos));
+        (_file[0] != '\0' && (strcmp(_file, mainfile) == 0 || strcmp(_file, "[heap]") == 0 || strstr(_file, ".so") != NULL));
     }
 
     //maybe it is global area
     bool isGlobalsExt() const {
-      return _readable && _writable && !_executable && _copy_on_write && _file.size() == 0;
+      return _readable && _writable && !_executable && _copy_on_write && _file[0] == '\0';
     }
 
     uintptr_t getBase() const { return _base; }
 
     uintptr_t getLimit() const { return _limit; }
 
-    const std::string& getFile() const { return _file; }
+    const char* getFile() const { return _file; }
 
   private:
     bool _valid;
@@ -77,52 +129,131 @@ class mapping {
     bool _executable;
     bool _copy_on_write;
     size_t _offset;
-    std::string _file;
+    const char* _file;
 };
 
-/// Read a mapping from a file input stream
-static std::ifstream& operator>>(std::ifstream& f, mapping& m) {
-  if(f.good() && !f.eof()) {
-    uintptr_t base, limit;
-    char perms[5];
-    size_t offset;
-    size_t dev_major, dev_minor;
-    int inode;
-    string path;
-
-    // Skip over whitespace
-    f >> std::skipws;
-
-    // Read in "<base>-<limit> <perms> <offset> <dev_major>:<dev_minor> <inode>"
-    f >> std::hex >> base;
-    if(f.get() != '-')
-      return f;
-    f >> std::hex >> limit;
-
-    if(f.get() != ' ')
-      return f;
-    f.get(perms, 5);
-
-    f >> std::hex >> offset;
-    f >> std::hex >> dev_major;
-    if(f.get() != ':')
-      return f;
-    f >> std::hex >> dev_minor;
-    f >> std::dec >> inode;
-
-    // Skip over spaces and tabs
-    while(f.peek() == ' ' || f.peek() == '\t') {
-      f.ignore(1);
+/**
+ * Read /proc/self/maps with read() into its own buffer and parse the fields
+ * in place, so that no memory is allocated however many mappings there are.
+ * It is meant to live on the stack:
+ *
+ *   mapsreader maps;
+ *   mapping m;
+ *   while(maps.next(m)) { ... }
+ */
+class mapsreader {
+  public:
+    mapsreader() : _start(0), _end(0), _eof(false) {
+      _fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+      if(_fd == -1) {
+        fprintf(stderr, "Failed to open /proc/self/maps\n");
+        _eof = true;
+      }
+    }
+
+    ~mapsreader() {
+      if(_fd != -1) {
+        close(_fd);
+      }
+    }
+
+    /// Parse the next mapping, its file name is only valid until the next call.
+    bool next(mapping& m) {
+      while(true) {
+        char* line = _buf + _start;
+        char* newline = (char*)memchr(line, '\n', _end - _start);
+        if(newline == NULL) {
+          if(_eof) {
+            return false;
+          }
+          fill();
+          continue;
+        }
+        *newline = '\0';
+        _start = newline + 1 - _buf;
+        if(parseLine(line, m)) {
+          return true;
+        }
+      }
+    }
+
+  private:
+    // Keep the partial line and read more after it.
+    void fill() {
+      if(_start > 0) {
+        memmove(_buf, _buf + _start, _end - _start);
+        _end -= _start;
+        _start = 0;
+      }
+      // a line longer than the buffer is dropped
+      if(_end == sizeof(_buf) - 1) {
+        _end = 0;
+      }
+      ssize_t n = read(_fd, _buf + _end, sizeof(_buf) - 1 - _end);
+      if(n <= 0) {
+        // terminate the last line if it has no newline
+        if(_end > 0) {
+          _buf[_end++] = '\n';
+        }
+        _eof = true;
+        return;
+      }
+      _end += n;
     }
 
-    // Read out the mapped file's path
-    getline(f, path);
+    static uintptr_t parseHex(const char** str) {
+      const char* p = *str;
+      uintptr_t value = 0;
+      while(true) {
+        char c = *p;
+        if(c >= '0' && c <= '9') {
+          value = (value << 4) | (c - '0');
+        } else if(c >= 'a' && c <= 'f') {
+          value = (value << 4) | (c - 'a' + 10);
+        } else {
+          break;
+        }
+        p++;
+      }
+      *str = p;
+      return value;
+    }
 
-    m = mapping(base, limit, perms, offset, path);
-  }
+    static const char* skipField(const char* p) {
+      while(*p != ' ' && *p != '\0') p++;
+      while(*p == ' ' || *p == '\t') p++;
+      return p;
+    }
 
-  return f;
-}
+    // "<base>-<limit> <perms> <offset> <dev_major>:<dev_minor> <inode>   <path>"
+    static bool parseLine(const char* p, mapping& m) {
+      uintptr_t base = parseHex(&p);
+      if(*p++ != '-') {
+        return false;
+      }
+      uintptr_t limit = parseHex(&p);
+      if(*p++ != ' ') {
+        return false;
+      }
+      const char* perms = p;
+      p = skipField(p);
+      if(p - perms < 4) {
+        return false;
+      }
+      size_t offset = parseHex(&p);
+      p = skipField(p);     // offset
+      p = skipField(p);     // device
+      p = skipField(p);     // inode
+      m = mapping(base, limit, perms, offset, p);
+      return true;
+    }
+
+    int _fd;
+    size_t _start;
+    size_t _end;
+    bool _eof;
+    char _buf[xdefines::MAPS_BUFFER_SIZE];
+};
 
 class selfmap {
   public:
@@ -132,26 +263,17 @@ class selfmap {
       return *theOneTrueObject;
     }
 
-    /// Check whether an address is inside the DoubleTake library itself.
+    /// Check whether an address is inside the Causer library itself.
     bool isCauserLibrary(void* pcaddr, void** offset = NULL) {
-      if(offset != NULL){
-        *offset = (void*)((intptr_t)pcaddr - (intptr_t)_causerStart);
-      }
-      return ((pcaddr >= _causerStart) && (pcaddr <= _causerEnd));
+      return isKind(pcaddr, TEXT_CAUSER, offset);
     }
 
     bool isPthreadLibrary(void* pcaddr, void** offset = NULL) {
-      if(offset != NULL){
-        *offset = (void*)((intptr_t)pcaddr - (intptr_t)_libthreadStart);
-      }
-      return ((pcaddr >= _libthreadStart) && (pcaddr <= _libthreadEnd));
+      return isKind(pcaddr, TEXT_PTHREAD, offset);
     }
 
     bool isLibcLibrary(void* pcaddr, void** offset = NULL) {
-      if(offset != NULL){
-        *offset = (void*)((intptr_t)pcaddr - (intptr_t)_libcStart);
-      }
-      return ((pcaddr >= _libcStart) && (pcaddr <= _libcEnd));
+      return isKind(pcaddr, TEXT_LIBC, offset);
     }
 
     /// Check whether an address is inside the main application.
@@ -159,131 +281,191 @@ class selfmap {
       if(offset != NULL){
         *offset = pcaddr;
       }
-      return ((pcaddr >= _appTextStart) && (pcaddr <= _appTextEnd));
+      texttable* table = holdTable();
+      const textrange* r = findRange(table, (uintptr_t)pcaddr);
+      bool ret = r != NULL && r->kind == TEXT_APPLICATION;
+      releaseTable(table);
+      return ret;
     }
 
     std::string getMainNameString(){
-      return _main_exe;
-    }
-    
-    std::string getPthreadLibNameString(){
-      return _threadLibrary;
-    }
-    
-    std::string getLibcNameString(){
-      return _libcLibrary;
+      return std::string(_mainExe);
     }
 
     const char* getMainName(){
-      return _main_exe.c_str();
+      return _mainExe;
     }
-    
-    const char* getPthreadLibName(){
-      return _threadLibrary.c_str();
-    }
-    
-    const char* getLibcName(){
-      return _libcLibrary.c_str();
+
+    /// Get the GNU build-ID of the module containing addr, return its size,
+    /// or 0 if the module has none. buildid should hold at least size bytes.
+    static uint32_t getBuildId(void* addr, uint8_t* buildid, uint32_t size) {
+      buildidinfo info = { (uintptr_t)addr, buildid, size, 0 };
+      dl_iterate_phdr(findBuildId, &info);
+      return info.found;
     }
 
-    mapping getMappingByAddress(void* ptr){
-      auto found = _mappings.find(interval(ptr, ptr));
-      if(found != _mappings.end()) {
-        return found->second;
+    /// Copy the module containing pc to m, return false if there is none.
+    /// Never allocates or locks, so it can be used in the signal handler.
+    bool findModule(void* pc, textmodule* m) {
+      texttable* table = holdTable();
+      const textrange* r = findRange(table, (uintptr_t)pc);
+      if(r != NULL) {
+        *m = table->modules[r->module];
       }
-      return mapping();
+      releaseTable(table);
+      return r != NULL;
     }
 
-    mapping getMappingByFileName(std::string name){
-      auto found = _textmappings.find(name);
-      if(found != _textmappings.end()) {
-        return found->second;
-      }
-      return mapping();
+    /// Copy the module containing pc to m, the table is rebuilt if a module
+    /// has been loaded since. Not for the signal handler.
+    bool getModuleByAddress(void* pc, textmodule* m) {
+      return findModule(pc, m) || (refreshIfChanged() && findModule(pc, m));
     }
 
-    void getStackInformation(void** stackBottom, void** stackTop) {
-      for(const auto& entry : _mappings) {
-        const mapping& m = entry.second;
-        if(m.isStack()) {
-          *stackBottom = (void*)m.getBase();
-          *stackTop = (void*)m.getLimit();
-          return;
+    bool getModuleByName(const char* name, textmodule* m) {
+      texttable* table = holdTable();
+      bool found = false;
+      for(uint32_t i = 0; table != NULL && i < table->nmodules; i++) {
+        if(strcmp(table->modules[i].name, name) == 0) {
+          *m = table->modules[i];
+          found = true;
+          break;
         }
       }
-      fprintf(stderr, "Couldn't find stack mapping. Giving up.\n");
-      abort();
+      releaseTable(table);
+      return found;
     }
 
-    /// Get information about global regions.
-    void getTextRegions() {
-      for(const auto& entry : _mappings) {
-        const mapping& m = entry.second;
-        if(m.isText()) {
-          //if(m.getFile().find("/libcauser") != std::string::npos) {
-          if(m.getFile().find("/mylibrary") != std::string::npos) {
-            _causerStart = (void*)m.getBase();
-            _causerEnd = (void*)m.getLimit();
-            _currentLibrary = std::string(m.getFile());
-            //fprintf(stderr, "causer region start %lx, end %lx\n", m.getBase(), m.getLimit());
-          } else if(m.getFile().find("/libpthread-") != std::string::npos) {
-            _libthreadStart = (void*)m.getBase();
-            _libthreadEnd = (void*)m.getLimit();
-            _threadLibrary = std::string(m.getFile());
-          } else if(m.getFile().find("/libc-") != std::string::npos) {
-            _libcStart = (void*)m.getBase();
-            _libcEnd = (void*)m.getLimit();
-            _libcLibrary = std::string(m.getFile());
-          }else if(m.getFile() == _main_exe) {
-            _appTextStart = (void*)m.getBase();
-            _appTextEnd = (void*)m.getLimit();
+    /// Rebuild the table of text ranges.
+    void refresh();
+
+    /// Rebuild the table if modules have been loaded or unloaded since it was
+    /// built, return whether it has been rebuilt.
+    bool refreshIfChanged();
+
+  private:
+    struct buildidinfo {
+      uintptr_t addr;
+      uint8_t* buildid;
+      uint32_t size;
+      uint32_t found;
+    };
+
+    static int findBuildId(struct dl_phdr_info* info, size_t, void* data) {
+      buildidinfo* b = (buildidinfo*)data;
+
+      bool contains = false;
+      for(int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+        if(phdr->p_type == PT_LOAD && b->addr >= start && b->addr < start + phdr->p_memsz) {
+          contains = true;
+          break;
+        }
+      }
+      if(!contains) {
+        return 0;
+      }
+
+      for(int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if(phdr->p_type != PT_NOTE) {
+          continue;
+        }
+        const char* note = (const char*)(info->dlpi_addr + phdr->p_vaddr);
+        const char* end = note + phdr->p_memsz;
+        while(note + sizeof(ElfW(Nhdr)) <= end) {
+          const ElfW(Nhdr)* nhdr = (const ElfW(Nhdr)*)note;
+          const char* name = note + sizeof(ElfW(Nhdr));
+          const char* desc = name + ((nhdr->n_namesz + 3) & ~3);
+          if(nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0
+              && nhdr->n_descsz <= b->size && desc + nhdr->n_descsz <= end) {
+            memcpy(b->buildid, desc, nhdr->n_descsz);
+            b->found = nhdr->n_descsz;
+            return 1;
           }
-          //fprintf(stderr, "text region start %lx, end %lx\n", m.getBase(), m.getLimit());
+          note = desc + ((nhdr->n_descsz + 3) & ~3);
         }
       }
+      // the module has no build-ID, stop searching
+      return 1;
     }
 
-  private:
-    selfmap() {
-      // Read the name of the main executable
-      bool gotMainExe = false;
-      // Build the mappings data structure
-      ifstream maps_file("/proc/self/maps");
-
-      mapping m;
-      while(maps_file >> m) {
-        // It is more clean that that of using readlink. 
-        // readlink will have some additional bytes after the executable file 
-        // if there are parameters.	
-        if(!gotMainExe) {
-          _main_exe = std::string(m.getFile());
-          gotMainExe = true;
-        }
+    selfmap() : _table(NULL), _retired(NULL), _namesize(0) {
+      _lock.init();
+      void* ptr = mmap(NULL, xdefines::TEXT_NAMES_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      _names = ptr != MAP_FAILED ? (char*)ptr : NULL;
+      // the same name as in /proc/self/maps, without any parameters
+      ssize_t len = readlink("/proc/self/exe", _mainExe, PATH_MAX - 1);
+      _mainExe[len > 0 ? len : 0] = '\0';
+      refresh();
+    }
+
+    texttable* getTable() {
+      return __atomic_load_n(&_table, __ATOMIC_ACQUIRE);
+    }
 
-        if(m.isText()) {
-        //if(m.valid()) {
-          //fprintf(stderr, "Base %lx limit %lx, %s\n", m.getBase(), m.getLimit(), m.getFile().c_str()); 
-          _mappings[interval(m.getBase(), m.getLimit())] = m;
-          _textmappings[m.getFile()] = m;
+    // Count a lookup as a reader of the current table. A table that is
+    // swapped out meanwhile may be reused already, so it is not held.
+    texttable* holdTable() {
+      while(true) {
+        texttable* table = __atomic_load_n(&_table, __ATOMIC_SEQ_CST);
+        if(table == NULL) {
+          return NULL;
         }
+        __atomic_add_fetch(&table->readers, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&_table, __ATOMIC_SEQ_CST) == table) {
+          return table;
+        }
+        __atomic_sub_fetch(&table->readers, 1, __ATOMIC_RELEASE);
+      }
+    }
+
+    static void releaseTable(texttable* table) {
+      if(table != NULL) {
+        __atomic_sub_fetch(&table->readers, 1, __ATOMIC_RELEASE);
       }
     }
 
-    std::map<interval, mapping> _mappings;
-    std::map<std::string, mapping> _textmappings;
-
-    std::string _main_exe;
-    std::string _currentLibrary;
-    std::string _threadLibrary;
-    std::string _libcLibrary;
-    void* _appTextStart;
-    void* _appTextEnd;
-    void * _libthreadStart;
-    void * _libthreadEnd;
-    void* _causerStart;
-    void* _causerEnd;
-    void* _libcStart;
-    void* _libcEnd;
+    texttable* takeRetiredTable();
+    void retireTable(texttable* table);
+    const char* internName(const char* name);
+
+    // The last range starting at or below pc, if it contains pc.
+    static const textrange* findRange(texttable* table, uintptr_t pc) {
+      if(table == NULL || table->nranges == 0) {
+        return NULL;
+      }
+      const textrange* base = table->ranges;
+      uint32_t n = table->nranges;
+      while(n > 1) {
+        uint32_t half = n >> 1;
+        base = (base[half].start <= pc) ? base + half : base;
+        n -= half;
+      }
+      return (pc >= base->start && pc < base->end) ? base : NULL;
+    }
+
+    bool isKind(void* pcaddr, uint32_t kind, void** offset) {
+      texttable* table = holdTable();
+      const textrange* r = findRange(table, (uintptr_t)pcaddr);
+      bool ret = r != NULL && r->kind == kind;
+      if(ret && offset != NULL){
+        *offset = (void*)((uintptr_t)pcaddr - table->modules[r->module].base);
+      }
+      releaseTable(table);
+      return ret;
+    }
+
+    static int addModule(struct dl_phdr_info* info, size_t, void* data);
+
+    spinlock _lock;       // serializes rebuilding, and guards the names
+    texttable* _table;
+    // tables swapped out, newest first
+    texttable* _retired;
+    char* _names;
+    size_t _namesize;
+    char _mainExe[PATH_MAX];
 };
 
 #endif
@@ -0,0 +1,107 @@
+/*
+ * @file   sharedtable.cpp
+ * @brief  Open the shared callsite table of the running program.
+ */
+
+#include "sharedtable.hh"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "selfmap.hh"
+#include "history.hh"
+
+// changes whenever the layout of the segment does
+enum { SHARED_TABLE_TAG = 0x4c42415453524301UL ^ xdefines::SHARED_TABLE_SLOTS };
+
+static size_t getSegmentSize() {
+  return sizeof(sharedHeader) + xdefines::SHARED_TABLE_SLOTS * sizeof(sharedCallsite);
+}
+
+void sharedtable::initialize() {
+  selfmap& maps = selfmap::getInstance();
+
+  // name the segment after the build of the program, or its path if it has no build-ID
+  char name[NAME_MAX];
+  uint8_t buildid[HISTORY_MAX_BUILDID];
+  textmodule module;
+  const textmodule* m = maps.getModuleByName(maps.getMainName(), &module) ? &module : NULL;
+  uint32_t size = m != NULL ? selfmap::getBuildId((void*)m->base, buildid, HISTORY_MAX_BUILDID) : 0;
+  int len = snprintf(name, NAME_MAX, "/causer-");
+  if(size > 0) {
+    for(uint32_t i = 0; i < size && len < NAME_MAX - 3; i++) {
+      len += snprintf(name + len, NAME_MAX - len, "%02x", buildid[i]);
+    }
+  } else {
+    snprintf(name + len, NAME_MAX - len, "%016lx", (unsigned long)historyKey(maps.getMainName(), 0, 0));
+  }
+
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+  if(fd == -1) {
+    fprintf(stderr, "Failed to open shared callsite table %s: %s\n", name, strerror(errno));
+    return;
+  }
+  // every process truncates to the same size, so it does not matter who is first
+  struct stat st;
+  if(fstat(fd, &st) == -1 || ((size_t)st.st_size < getSegmentSize() && ftruncate(fd, getSegmentSize()) == -1)) {
+    fprintf(stderr, "Failed to resize shared callsite table %s: %s\n", name, strerror(errno));
+    close(fd);
+    return;
+  }
+  void* ptr = mmap(NULL, getSegmentSize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(ptr == MAP_FAILED) {
+    fprintf(stderr, "Failed to map shared callsite table %s: %s\n", name, strerror(errno));
+    return;
+  }
+
+  sharedHeader* header = (sharedHeader*)ptr;
+  uint64_t tag = 0;
+  if(!__atomic_compare_exchange_n(&header->tag, &tag, (uint64_t)SHARED_TABLE_TAG, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+      && tag != (uint64_t)SHARED_TABLE_TAG) {
+    fprintf(stderr, "Shared callsite table %s is of another version, ignore it\n", name);
+    munmap(ptr, getSegmentSize());
+    return;
+  }
+
+  _header = header;
+  _slots = (sharedCallsite*)(header + 1);
+}
+
+sharedCallsite* sharedtable::lookup(void* pc, unsigned long offset) {
+  if(_slots == NULL) {
+    return SHARED_NO_SLOT;
+  }
+  textmodule module;
+  const textmodule* m = selfmap::getInstance().getModuleByAddress(pc, &module) ? &module : NULL;
+  if(m == NULL) {
+    return SHARED_NO_SLOT;
+  }
+
+  uint64_t key = historyKey(m->name, (uintptr_t)pc - m->base, offset);
+  if(key == 0) {
+    key = 1;
+  }
+
+  size_t index = key & (xdefines::SHARED_TABLE_SLOTS - 1);
+  for(int i = 0; i < xdefines::SHARED_TABLE_PROBES; i++) {
+    sharedCallsite* s = &_slots[index];
+    uint64_t cur = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+    if(cur == 0) {
+      // cur is updated to the winner's key if another process takes the slot first
+      if(__atomic_compare_exchange_n(&s->key, &cur, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return s;
+      }
+    }
+    if(cur == key) {
+      return s;
+    }
+    index = (index + 1) & (xdefines::SHARED_TABLE_SLOTS - 1);
+  }
+  return SHARED_NO_SLOT;
+}
@@ -0,0 +1,66 @@
+#if !defined(_SHAREDTABLE_H)
+#define _SHAREDTABLE_H
+
+/*
+ * @file   sharedtable.hh
+ * @brief  Sampling state of callsites shared by all processes of one build.
+ *
+ * Workers of a prefork server learn the same callsites separately. With
+ * SHARED_CALLSITE_TABLE, a named shared memory segment keyed by the build-ID
+ * of the program holds, for each callsite, how often it has been watched by
+ * any process and whether an overflow has been confirmed on it. Callsites
+ * are keyed by (module, offset), so they match across ASLR. Slots are only
+ * ever added, by a CAS on the key, so lookups never take a lock.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+
+#include "xdefines.hh"
+
+struct sharedHeader {
+  uint64_t tag;                // identifies the layout, set by the first process
+  uint64_t reserved[7];        // slots start at the next cache line
+};
+
+struct sharedCallsite {
+  uint64_t key;                // 0 if the slot is free
+  unsigned int watched;        // watched times by all processes
+  unsigned int confirmed;      // an overflow has been confirmed
+};
+
+// callstack::shared of a callsite that can not be shared
+#define SHARED_NO_SLOT ((sharedCallsite*)1)
+
+class sharedtable {
+
+  public:
+    static sharedtable& getInstance() {
+      static char buf[sizeof(sharedtable)];
+      static sharedtable* theOneTrueObject = new (buf) sharedtable();
+      return *theOneTrueObject;
+    }
+
+    // Open or create the segment of the running program.
+    void initialize();
+
+    // Find or add the slot of the callsite (stack[0], offset),
+    // SHARED_NO_SLOT if it is not in a module or the table is full.
+    sharedCallsite* lookup(void* pc, unsigned long offset);
+
+    static bool isShared(sharedCallsite* s) {
+      return s != NULL && s != SHARED_NO_SLOT;
+    }
+
+  private:
+    sharedtable() : _header(NULL), _slots(NULL) {}
+    ~sharedtable() {}
+
+    sharedHeader* _header;
+    sharedCallsite* _slots;
+};
+
+#endif
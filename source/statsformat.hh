@@ -0,0 +1,174 @@
+#if !defined(_STATSFORMAT_H)
+#define _STATSFORMAT_H
+
+/*
+ * @file   statsformat.hh
+ * @brief  Layout of the live statistics segment, /dev/shm/causer-stats-<pid>.
+ *
+ * Only the process itself writes the segment; readers map it read-only and
+ * never disturb it. Counters are single words updated atomically. Watchpoint
+ * slots and the top callsites change together with several fields, so each
+ * of them is guarded by a sequence number: odd while it is written, readers
+ * copy and retry until they see the same even number before and after.
+ * This header does not depend on the rest of the library, so that tools can
+ * read the segment too. The histograms of PHASE_ACCOUNTING are laid out here
+ * for the same reason.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define STATS_NAME_PREFIX "/causer-stats-"
+
+enum { STATS_MAGIC = 0x5354415453524343UL }; // "CCRSTATS"
+enum { STATS_VERSION = 2 };
+enum { STATS_MAX_SLOTS = 4 };
+enum { STATS_TOP_CALLSITES = 16 };
+enum { STATS_MODULE_NAME = 48 };
+
+// Phases of the allocation path, timed with PHASE_ACCOUNTING.
+enum {
+  PHASE_START_WATCH = 0,   // all of the sampling of an allocation
+  PHASE_CALLSITE_KEY,      // getCallSiteKey and its hash
+  PHASE_LOOKUP,            // findOrAdd in the callsite map
+  PHASE_UPDATE,            // updateWatchedInfo, PHASE_CALLSITES included
+  PHASE_CALLSITES,         // getCallsites, the first time a callsite is watched
+  PHASE_SET_WATCHPOINT,    // setWatchpoint, installed or not
+  PHASE_GUARD,             // objectGuard in front of the object
+  PHASES
+};
+
+// bucket b holds durations of [2^b, 2^(b+1)) cycles, the last one all above
+enum { PHASE_BUCKETS = 32 };
+
+static const char* const phaseNames[PHASES] = {
+  "startWatch", "callsiteKey", "lookup", "update", "callsites", "setWatchpoint", "guard"
+};
+
+struct phaseHistogram {
+  uint64_t counts[PHASES][PHASE_BUCKETS];
+  uint64_t cycles[PHASES];
+};
+
+struct statsCounters {
+  uint64_t allocations;
+  uint64_t sampled;        // allocations whose callsite has been looked up
+  uint64_t installs;       // watchpoints installed, preemptions included
+  uint64_t preemptions;    // installs that replaced a watched object
+  uint64_t removals;       // watchpoints removed when their object is freed
+  uint64_t benignTraps;
+  uint64_t realTraps;
+  uint64_t syscallNs;      // in perf_event_open, ioctl and close of watchpoints
+  uint64_t syscalls;
+
+  // overhead governor, governorScaleOne is 0 if it is not built in
+  uint32_t governorScale;
+  uint32_t governorScaleOne;
+  uint64_t governorOverhead; // basis points of the CPU time in the last epoch
+  uint64_t governorEpochs;
+};
+
+struct statsSlot {
+  uint64_t sequence;
+  uint64_t used;
+  uint64_t addr;           // the watched byte
+  uint64_t objectStart;
+  uint64_t objectSize;
+  uint64_t callsite;       // first frame of the allocation callsite
+  uint64_t installTime;    // ms since the epoch
+  uint64_t hits;           // traps that were not benign
+};
+
+struct statsCallsite {
+  uint64_t pc;
+  uint64_t moduleOffset;   // pc - base of its module
+  int64_t calledCounter;
+  int64_t watchedCounter;
+  int32_t watchedRatio;
+  int32_t confirmed;       // an overflow has been confirmed
+  char module[STATS_MODULE_NAME]; // base name, empty if pc is in no module
+};
+
+struct statsSegment {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t size;           // of the whole segment
+  int64_t pid;
+  uint64_t startTime;      // ms since the epoch
+  uint64_t updateTime;     // last change of the slots or callsites
+
+  statsCounters counters;
+  statsSlot slots[STATS_MAX_SLOTS];
+
+  // ordered by watchedCounter, ncallsites entries are valid
+  uint64_t callsitesSequence;
+  uint32_t ncallsites;
+  uint32_t reserved;
+  statsCallsite callsites[STATS_TOP_CALLSITES];
+
+  // all zero without PHASE_ACCOUNTING, added up by threads every PHASE_FLUSH_SAMPLES
+  phaseHistogram phases;
+};
+
+static inline uint64_t statsBeginRead(const uint64_t* sequence) {
+  uint64_t seq;
+  while((seq = __atomic_load_n(sequence, __ATOMIC_ACQUIRE)) & 1) {
+  }
+  return seq;
+}
+
+static inline bool statsEndRead(const uint64_t* sequence, uint64_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(sequence, __ATOMIC_RELAXED) == seq;
+}
+
+static inline void statsBeginWrite(uint64_t* sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void statsEndWrite(uint64_t* sequence) {
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t phaseCalls(const phaseHistogram* h, int phase) {
+  uint64_t calls = 0;
+  for(int b = 0; b < PHASE_BUCKETS; b++) {
+    calls += h->counts[phase][b];
+  }
+  return calls;
+}
+
+// Upper bound of the bucket holding the given fraction of the calls of a phase.
+static inline uint64_t phasePercentile(const phaseHistogram* h, int phase, double fraction) {
+  uint64_t rank = (uint64_t)(phaseCalls(h, phase) * fraction);
+  uint64_t seen = 0;
+  for(int b = 0; b < PHASE_BUCKETS; b++) {
+    seen += h->counts[phase][b];
+    if(seen > rank) {
+      return 2UL << b;
+    }
+  }
+  return 2UL << (PHASE_BUCKETS - 1);
+}
+
+// Copy a consistent view of a mapped segment, for readers.
+static inline void statsSnapshot(const statsSegment* seg, statsSegment* copy) {
+  memcpy(copy, seg, sizeof(statsSegment));
+  for(int i = 0; i < STATS_MAX_SLOTS; i++) {
+    uint64_t seq;
+    do {
+      seq = statsBeginRead(&seg->slots[i].sequence);
+      memcpy(&copy->slots[i], &seg->slots[i], sizeof(statsSlot));
+    } while(!statsEndRead(&seg->slots[i].sequence, seq));
+  }
+  uint64_t seq;
+  do {
+    seq = statsBeginRead(&seg->callsitesSequence);
+    copy->ncallsites = seg->ncallsites;
+    memcpy(copy->callsites, seg->callsites, sizeof(copy->callsites));
+  } while(!statsEndRead(&seg->callsitesSequence, seq));
+}
+
+#endif
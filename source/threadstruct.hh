@@ -9,6 +9,49 @@
 #include "xdefines.hh"
 
 typedef void * threadFunction(void *);
+
+#ifdef QUARANTINE
+// a freed object, with its size when it was freed, the guard may be
+// overwritten while it waits
+typedef struct quarantineEntry {
+  void* object;
+  size_t size;
+} quarantineEntry;
+
+// objects freed by a thread, oldest at head
+typedef struct quarantineRing {
+  unsigned int head;
+  unsigned int count;
+  size_t bytes;
+  quarantineEntry entries[xdefines::QUARANTINE_ENTRIES];
+} quarantineRing;
+#endif
+
+#ifdef PHASE_ACCOUNTING
+#include "statsformat.hh"
+
+// cycles of the allocation phases of a thread, not yet added to the total
+typedef struct threadPhases {
+  unsigned long samples;
+  phaseHistogram histogram;
+} threadPhases;
+#endif
+
+#ifdef ALLOC_TRACE
+struct traceBuffer;
+
+// allocation events of a thread, see tracer.hh
+typedef struct threadTrace {
+  struct traceBuffer* buffer;
+  unsigned int nested;    // inside a realloc, which records its own events
+  unsigned int callsite;  // trace id of the callsite of the allocation being made
+} threadTrace;
+#endif
+
+#ifdef VECTOR_STRINGS
+struct stringScan;
+#endif
+
 typedef struct thread {
   list_t listentry;
   int index;
@@ -26,6 +69,19 @@ typedef struct thread {
   // Starting parameters
   void * startArg;
   threadFunction * startRoutine;
+#ifdef QUARANTINE
+  quarantineRing quarantine;
+#endif
+#ifdef PHASE_ACCOUNTING
+  threadPhases phases;
+#endif
+#ifdef ALLOC_TRACE
+  threadTrace trace;
+#endif
+#ifdef VECTOR_STRINGS
+  // last string scan of the thread, replayed for the samples of the ring buffer
+  struct stringScan* scan;
+#endif
 } thread_t;
 
 extern __thread thread_t* current;
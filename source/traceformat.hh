@@ -0,0 +1,93 @@
+#if !defined(_TRACEFORMAT_H)
+#define _TRACEFORMAT_H
+
+/*
+ * @file   traceformat.hh
+ * @brief  Layout of the allocation traces recorded with ALLOC_TRACE.
+ *
+ * A trace is a traceHeader followed by blocks. Every block starts with a
+ * traceBlock and holds count records of its type. Events come in blocks of
+ * one thread, in the order that thread made them; blocks of different
+ * threads are interleaved as they were written, so readers that need a
+ * global order merge them by time. The time of an event is the baseTsc of
+ * its block plus the deltas of the events up to and including it. The
+ * dictionary of a callsite and of its module is written before the first
+ * block with an event from it. The END block is last and gives a second
+ * pair of TSC and clock readings, to convert TSC ticks to ns.
+ * Everything is in host byte order. This header does not depend on the
+ * rest of the library, so that tools can read the trace too.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum { TRACE_MAGIC = 0x4543415254524343UL }; // "CCRTRACE"
+enum { TRACE_VERSION = 1 };
+enum { TRACE_MODULE_NAME = 240 };
+
+// callsite of events whose callsite was not looked up
+enum { TRACE_UNKNOWN_CALLSITE = 0 };
+
+enum {
+  TRACE_BLOCK_EVENTS = 1,
+  TRACE_BLOCK_MODULES,
+  TRACE_BLOCK_CALLSITES,
+  TRACE_BLOCK_END
+};
+
+enum {
+  TRACE_ALLOC = 1,  // malloc, calloc, memalign and the like
+  TRACE_FREE,
+  TRACE_REALLOC     // the new object of a realloc, after a TRACE_FREE of the old one
+};
+
+struct traceHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint64_t startTsc;
+  uint64_t startNs;   // CLOCK_MONOTONIC
+};
+
+struct traceBlock {
+  uint32_t type;
+  uint32_t count;
+  uint64_t baseTsc;   // of an events block, 0 for the others
+};
+
+struct traceEvent {
+  uint64_t addr;
+  uint32_t size;      // capped at UINT32_MAX, 0 for TRACE_FREE
+  uint32_t callsite;  // id of a traceCallsite, or TRACE_UNKNOWN_CALLSITE
+  uint32_t delta;     // TSC ticks since the previous event of the block
+  uint16_t thread;    // index of the thread in the library
+  uint8_t op;
+  uint8_t reserved;
+};
+
+struct traceModule {
+  uint32_t id;
+  uint32_t reserved;
+  uint64_t base;      // what the pc of its callsites is relative to
+  char name[TRACE_MODULE_NAME];
+};
+
+// The callsite key of the library: the pc of the allocating call and the
+// offset of its stack frame.
+struct traceCallsite {
+  uint32_t id;
+  uint32_t module;    // 0 if the pc is in no known module, pc is absolute then
+  uint64_t pc;
+  uint64_t stackOffset;
+};
+
+struct traceEnd {
+  uint64_t endTsc;
+  uint64_t endNs;
+  uint64_t events;
+  uint64_t lost;      // events dropped while the writer was behind
+};
+
+static_assert(sizeof(traceBlock) == 16 && sizeof(traceEvent) == 24, "trace records are packed");
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * @file   tracer.cpp
+ * @brief  Hand the trace buffers around and write them with the dictionary.
+ */
+
+#ifdef ALLOC_TRACE
+#include "tracer.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "real.hh"
+#include "selfmap.hh"
+#include "xthread.hh"
+
+extern char * program_invocation_name;
+
+static uint64_t monotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void tracer::initialize() {
+  _fd = -1;
+  _pid = getpid();
+  _bufferLock.init();
+  _dictionaryLock.init();
+  _writeLock.init();
+
+  void* ptr = mmap(NULL, xdefines::TRACE_MAX_CALLSITES * sizeof(traceDictionaryEntry),
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(ptr == MAP_FAILED) {
+    fprintf(stderr, "Failed to allocate the trace dictionary: %s\n", strerror(errno));
+    return;
+  }
+  _callsites = (traceDictionaryEntry*)ptr;
+
+  if(openTrace()) {
+    startWriter();
+    _active = true;
+  }
+}
+
+void tracer::reinitializeChild() {
+  if(!_active) {
+    return;
+  }
+  // the parent writes the buffers and the file it had at the fork
+  close(_fd);
+  _fd = -1;
+  _pid = getpid();
+  _bufferLock.init();
+  _dictionaryLock.init();
+  _writeLock.init();
+  _full = NULL;
+  _free = NULL;
+  _buffers = 0;
+  _writtenCallsites = 0;
+  _nmodules = 0;
+  _events = 0;
+  _lost = 0;
+  _writerStopped = false;
+
+  _active = openTrace();
+  if(_active) {
+    startWriter();
+  }
+}
+
+void tracer::finalize() {
+  if(!_active || getpid() != _pid) {
+    return;
+  }
+  _active = false;
+  _writerStopped = true;
+  // threads still running at exit get no new buffers now, take the ones they have
+  thread_t* iterthread = NULL;
+  list_t* aliveThreadsList = xthread::getInstance().getAliveThreadsList();
+  acquireGlobalRLock();
+  if(!isListEmpty(aliveThreadsList)) {
+    FOR_EACH_THREAD_START(iterthread, aliveThreadsList) {
+      flushThread(&iterthread->trace);
+      FOR_EACH_THREAD_NEXT(iterthread, aliveThreadsList)
+    }
+  }
+  releaseGlobalLock();
+  if(current != NULL) {
+    flushThread(&current->trace);
+  }
+  writePending();
+
+  _writeLock.lock();
+  struct {
+    traceBlock block;
+    traceEnd end;
+  } last;
+  last.block.type = TRACE_BLOCK_END;
+  last.block.count = 1;
+  last.block.baseTsc = 0;
+  last.end.endTsc = rdtsc();
+  last.end.endNs = monotonicNs();
+  last.end.events = _events;
+  last.end.lost = _lost;
+  writeAll(&last, sizeof(last));
+  close(_fd);
+  _fd = -1;
+  _writeLock.unlock();
+
+  fprintf(stderr, "trace %lu events, %lu lost\n", _events, _lost);
+}
+
+bool tracer::openTrace() {
+  char filename[PATH_MAX];
+  snprintf(filename, PATH_MAX, "%s_%d.trace", program_invocation_name, _pid);
+  _fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(_fd == -1) {
+    fprintf(stderr, "Failed to create trace file %s: %s\n", filename, strerror(errno));
+    return false;
+  }
+
+  traceHeader header;
+  header.magic = TRACE_MAGIC;
+  header.version = TRACE_VERSION;
+  header.pid = _pid;
+  header.startTsc = rdtsc();
+  header.startNs = monotonicNs();
+  if(!writeAll(&header, sizeof(header))) {
+    close(_fd);
+    _fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void* tracer::writer(void*) {
+  tracer& t = tracer::getInstance();
+  while(!t._writerStopped) {
+    usleep(xdefines::TRACE_WRITE_INTERVAL * 1000);
+    if(!t._writerStopped) {
+      t.writePending();
+    }
+  }
+  return NULL;
+}
+
+void tracer::startWriter() {
+  pthread_t tid;
+  // the writer is not registered in xthread, so its own calls are not recorded
+  if(Real::pthread_create(&tid, NULL, tracer::writer, NULL) != 0) {
+    fprintf(stderr, "Failed to create the trace writer\n");
+    abort();
+  }
+}
+
+traceBuffer* tracer::getFreeBuffer() {
+  _bufferLock.lock();
+  traceBuffer* b = _free;
+  if(b != NULL) {
+    _free = b->next;
+    _bufferLock.unlock();
+    return b;
+  }
+  if(_buffers >= xdefines::TRACE_MAX_BUFFERS) {
+    _bufferLock.unlock();
+    return NULL;
+  }
+  _buffers++;
+  _bufferLock.unlock();
+
+  void* ptr = mmap(NULL, sizeof(traceBuffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(ptr == MAP_FAILED) {
+    __atomic_sub_fetch(&_buffers, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return (traceBuffer*)ptr;
+}
+
+void tracer::putFullBuffer(traceBuffer* b) {
+  _bufferLock.lock();
+  b->next = _full;
+  _full = b;
+  _bufferLock.unlock();
+}
+
+traceBuffer* tracer::replaceBuffer(threadTrace* t, unsigned long now) {
+  if(!_active) {
+    return NULL;
+  }
+  traceBuffer* b = t->buffer;
+  // an empty buffer only needs a new base
+  if(b == NULL || b->block.count != 0) {
+    traceBuffer* fresh = getFreeBuffer();
+    if(fresh == NULL) {
+      if(b == NULL) {
+        return NULL;
+      }
+      // the writer is behind, the events of this buffer are dropped
+      __atomic_add_fetch(&_lost, b->block.count, __ATOMIC_RELAXED);
+    } else {
+      if(b != NULL) {
+        putFullBuffer(b);
+      }
+      b = fresh;
+    }
+  }
+  b->block.type = TRACE_BLOCK_EVENTS;
+  b->block.count = 0;
+  b->block.baseTsc = now;
+  b->lastTsc = now;
+  t->buffer = b;
+  return b;
+}
+
+void tracer::flushThread(threadTrace* t) {
+  // at exit this is also called for threads that may still be recording
+  traceBuffer* b = __atomic_exchange_n(&t->buffer, NULL, __ATOMIC_ACQ_REL);
+  t->nested = 0;
+  t->callsite = TRACE_UNKNOWN_CALLSITE;
+  if(b == NULL) {
+    return;
+  }
+  if(__atomic_load_n(&b->block.count, __ATOMIC_ACQUIRE) != 0) {
+    putFullBuffer(b);
+  } else {
+    _bufferLock.lock();
+    b->next = _free;
+    _free = b;
+    _bufferLock.unlock();
+  }
+}
+
+unsigned int tracer::addCallsite(callstack* cs) {
+  if(_callsites == NULL || _nextCallsite + 1 >= xdefines::TRACE_MAX_CALLSITES) {
+    return TRACE_UNKNOWN_CALLSITE;
+  }
+  _dictionaryLock.lock();
+  unsigned int id = cs->traceId;
+  if(id == TRACE_UNKNOWN_CALLSITE && _nextCallsite + 1 < xdefines::TRACE_MAX_CALLSITES) {
+    id = _nextCallsite + 1;
+    _callsites[id].pc = cs->stack[0];
+    _callsites[id].stackOffset = cs->offset;
+    // the writer reads the entries below _nextCallsite
+    __atomic_store_n(&_nextCallsite, id, __ATOMIC_RELEASE);
+    __atomic_store_n(&cs->traceId, id, __ATOMIC_RELEASE);
+  }
+  _dictionaryLock.unlock();
+  return id;
+}
+
+bool tracer::writeAll(const void* data, size_t size) {
+  const char* p = (const char*)data;
+  while(size > 0) {
+    ssize_t n = write(_fd, p, size);
+    if(n == -1 && errno == EINTR) {
+      continue;
+    }
+    if(n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Id of the module of pc, written to the trace the first time.
+uint32_t tracer::getModuleId(void* pc, uint64_t* offset) {
+  textmodule copy;
+  const textmodule* m = selfmap::getInstance().getModuleByAddress(pc, &copy) ? &copy : NULL;
+  if(m == NULL) {
+    *offset = (uintptr_t)pc;
+    return 0;
+  }
+  *offset = (uintptr_t)pc - m->base;
+  for(unsigned int i = 0; i < _nmodules; i++) {
+    if(_modules[i].base == m->base && strcmp(_modules[i].name, m->name) == 0) {
+      return _modules[i].id;
+    }
+  }
+  if(_nmodules == xdefines::MAX_TEXT_MODULES) {
+    *offset = (uintptr_t)pc;
+    return 0;
+  }
+
+  traceModule* module = &_modules[_nmodules++];
+  memset(module, 0, sizeof(traceModule));
+  module->id = _nmodules;
+  module->base = m->base;
+  strncpy(module->name, m->name, TRACE_MODULE_NAME - 1);
+  traceBlock block = { TRACE_BLOCK_MODULES, 1, 0 };
+  writeAll(&block, sizeof(block));
+  writeAll(module, sizeof(traceModule));
+  return module->id;
+}
+
+// Callsites given an id since the last call, called with _writeLock held.
+void tracer::writeDictionary() {
+  enum { BATCH = 256 };
+  traceCallsite batch[BATCH];
+  unsigned int last = __atomic_load_n(&_nextCallsite, __ATOMIC_ACQUIRE);
+
+  while(_writtenCallsites < last) {
+    unsigned int n = 0;
+    while(n < BATCH && _writtenCallsites < last) {
+      unsigned int id = ++_writtenCallsites;
+      traceCallsite* c = &batch[n++];
+      c->id = id;
+      c->module = getModuleId(_callsites[id].pc, &c->pc);
+      c->stackOffset = _callsites[id].stackOffset;
+    }
+    traceBlock block = { TRACE_BLOCK_CALLSITES, n, 0 };
+    writeAll(&block, sizeof(block));
+    writeAll(batch, n * sizeof(traceCallsite));
+  }
+}
+
+void tracer::writePending() {
+  _writeLock.lock();
+  if(_fd == -1) {
+    _writeLock.unlock();
+    return;
+  }
+
+  _bufferLock.lock();
+  traceBuffer* full = _full;
+  _full = NULL;
+  _bufferLock.unlock();
+
+  // oldest first, so the blocks of a thread stay in order
+  traceBuffer* pending = NULL;
+  while(full != NULL) {
+    traceBuffer* next = full->next;
+    full->next = pending;
+    pending = full;
+    full = next;
+  }
+
+  // the ids in these buffers were given before they were filled
+  writeDictionary();
+
+  while(pending != NULL) {
+    traceBuffer* b = pending;
+    pending = b->next;
+    // the owner of a buffer taken at exit may still be adding events, the
+    // block written says how many of them follow
+    traceBlock block;
+    block.type = b->block.type;
+    block.count = __atomic_load_n(&b->block.count, __ATOMIC_ACQUIRE);
+    block.baseTsc = b->block.baseTsc;
+    writeAll(&block, sizeof(traceBlock));
+    writeAll(b->events, block.count * sizeof(traceEvent));
+    _events += block.count;
+
+    _bufferLock.lock();
+    b->next = _free;
+    _free = b;
+    _bufferLock.unlock();
+  }
+  _writeLock.unlock();
+}
+#endif
@@ -0,0 +1,184 @@
+#if !defined(_TRACER_H)
+#define _TRACER_H
+
+/*
+ * @file   tracer.hh
+ * @brief  Record every allocation and free to a trace file, with ALLOC_TRACE.
+ *
+ * Each thread appends a traceEvent to a buffer of its own, which only takes
+ * a TSC reading and a few stores. A full buffer is put on a list for the
+ * writer thread and replaced by an empty one. The writer appends the blocks
+ * to <program>_<pid>.trace, after the dictionary entries of the callsites
+ * and modules they use, see traceformat.hh for the layout. Buffers are
+ * reused once written; when the writer is behind and TRACE_MAX_BUFFERS are
+ * in use, events are dropped and counted instead. The file is not
+ * compressed here, the deltas and small ids in it make gzip or zstd do well.
+ *
+ * Only calls made by the program are recorded, and the allocations sampled
+ * by the library have a callsite id; with OVERHEAD_GOVERNOR the others have
+ * TRACE_UNKNOWN_CALLSITE. The buffers of threads that exit are written, and
+ * at exit those of the threads still running; an event such a thread is
+ * recording right then may be missing. A forked child writes a trace of
+ * its own.
+ */
+
+#ifdef ALLOC_TRACE
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+
+#include "xdefines.hh"
+#include "threadstruct.hh"
+#include "spinlock.hh"
+#include "traceformat.hh"
+
+struct traceBuffer {
+  traceBuffer* next;        // in the list of full or of free buffers
+  unsigned long lastTsc;
+  traceBlock block;
+  traceEvent events[xdefines::TRACE_BUFFER_EVENTS];
+};
+
+// A callsite given an id, its module is looked up by the writer.
+struct traceDictionaryEntry {
+  void* pc;
+  unsigned long stackOffset;
+};
+
+class tracer {
+
+  public:
+    static tracer& getInstance() {
+      static char buf[sizeof(tracer)];
+      static tracer* theOneTrueObject = new (buf) tracer();
+      return *theOneTrueObject;
+    }
+
+    // Create the trace file and start the writer.
+    void initialize();
+
+    // In the child of a fork, start a trace of its own.
+    void reinitializeChild();
+
+    // Write what is left, including the buffers of the threads still running.
+    void finalize();
+
+    static void record(int op, void* addr, size_t size) {
+      thread_t* t = current;
+      if(t == NULL || t->trace.nested != 0 || !isCauser() || addr == NULL) {
+        return;
+      }
+      threadTrace* tt = &t->trace;
+      traceBuffer* b = tt->buffer;
+      unsigned long now = rdtsc();
+      // a delta that does not fit starts a new block, with a new base
+      if(unlikely(b == NULL || b->block.count == xdefines::TRACE_BUFFER_EVENTS || now - b->lastTsc > UINT32_MAX)) {
+        b = getInstance().replaceBuffer(tt, now);
+        if(b == NULL) {
+          return;
+        }
+      }
+      uint32_t count = b->block.count;
+      traceEvent* e = &b->events[count];
+      e->addr = (uintptr_t)addr;
+      e->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+      e->delta = (uint32_t)(now - b->lastTsc);
+      e->thread = (uint16_t)t->index;
+      e->op = (uint8_t)op;
+      e->reserved = 0;
+      if(op == TRACE_FREE) {
+        e->callsite = TRACE_UNKNOWN_CALLSITE;
+      } else {
+        e->callsite = tt->callsite;
+        tt->callsite = TRACE_UNKNOWN_CALLSITE;
+      }
+      b->lastTsc = now;
+      // at exit the writer may read a buffer that is still being filled
+      __atomic_store_n(&b->block.count, count + 1, __ATOMIC_RELEASE);
+    }
+
+    // The allocation being made comes from cs, called from startWatch.
+    void setCallsite(callstack* cs) {
+      unsigned int id = __atomic_load_n(&cs->traceId, __ATOMIC_ACQUIRE);
+      if(unlikely(id == TRACE_UNKNOWN_CALLSITE)) {
+        id = addCallsite(cs);
+      }
+      if(current != NULL) {
+        current->trace.callsite = id;
+      }
+    }
+
+    // The nested calls of a realloc are recorded as one free and one realloc.
+    static void beginRealloc() {
+      if(current != NULL) {
+        current->trace.nested++;
+      }
+    }
+
+    static void endRealloc(void* ptr, void* newptr, size_t size) {
+      if(current == NULL) {
+        return;
+      }
+      current->trace.nested--;
+      // the old object is freed even if the new one could not be allocated
+      record(TRACE_FREE, ptr, 0);
+      record(TRACE_REALLOC, newptr, size);
+    }
+
+    // Hand the buffer of an exiting thread to the writer.
+    void flushThread(threadTrace* t);
+
+  private:
+    tracer() : _fd(-1) {}
+    ~tracer() {}
+
+    traceBuffer* replaceBuffer(threadTrace* t, unsigned long now);
+    traceBuffer* getFreeBuffer();
+    void putFullBuffer(traceBuffer* b);
+    unsigned int addCallsite(callstack* cs);
+
+    bool openTrace();
+    void startWriter();
+    void writePending();
+    void writeDictionary();
+    uint32_t getModuleId(void* pc, uint64_t* offset);
+    bool writeAll(const void* data, size_t size);
+    static void* writer(void*);
+
+    int _fd;
+    int _pid;
+    bool _active;
+    volatile bool _writerStopped;
+
+    spinlock _bufferLock;
+    traceBuffer* _full;       // newest first
+    traceBuffer* _free;
+    unsigned long _buffers;
+
+    spinlock _dictionaryLock;
+    traceDictionaryEntry* _callsites;
+    unsigned int _nextCallsite;
+    unsigned int _writtenCallsites;
+    // modules written so far, only used by the writer
+    unsigned int _nmodules;
+    traceModule _modules[xdefines::MAX_TEXT_MODULES];
+
+    // taken by the writer, and by finalize to wait for it
+    spinlock _writeLock;
+    unsigned long _events;
+    unsigned long _lost;
+};
+
+#define TRACE_RECORD(op, addr, size) tracer::record((op), (addr), (size))
+#define TRACE_CALLSITE(cs) tracer::getInstance().setCallsite(cs)
+#define TRACE_BEGIN_REALLOC() tracer::beginRealloc()
+#define TRACE_END_REALLOC(ptr, newptr, size) tracer::endRealloc((ptr), (newptr), (size))
+#else
+#define TRACE_RECORD(op, addr, size)
+#define TRACE_CALLSITE(cs)
+#define TRACE_BEGIN_REALLOC()
+#define TRACE_END_REALLOC(ptr, newptr, size)
+#endif
+
+#endif
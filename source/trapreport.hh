@@ -0,0 +1,90 @@
+#if !defined(_TRAPREPORT_H)
+#define _TRAPREPORT_H
+
+/*
+ * @file   trapreport.hh
+ * @brief  Deduplicate overflow reports by (faulting ip, allocation callsite).
+ *
+ * An overflow inside a loop traps on every iteration. Only the first hit of
+ * each pair is reported and symbolized, repeats are counted and summarized
+ * at exit.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+
+#include "xdefines.hh"
+#include "spinlock.hh"
+#include "hashvalue.hh"
+
+class trapreport {
+
+  public:
+    static trapreport& getInstance() {
+      static char buf[sizeof(trapreport)];
+      static trapreport* theOneTrueObject = new (buf) trapreport();
+      return *theOneTrueObject;
+    }
+
+    // Count a hit of (ip, cs), return how many times it has been hit.
+    // It never allocates, so it is safe inside the signal handler.
+    unsigned long recordHit(void* ip, void* cs) {
+      size_t idx = hash_value(ip, (int)(intptr_t)cs) & (xdefines::MAX_TRAP_RECORDS - 1);
+      unsigned long hits = 0;
+
+      _lock.lock();
+      for(int i = 0; i < xdefines::MAX_TRAP_RECORDS; i++) {
+        trapRecord* r = &_records[idx];
+        if(r->hits == 0) {
+          r->ip = ip;
+          r->cs = cs;
+          _numRecords++;
+        }
+        if(r->ip == ip && r->cs == cs) {
+          hits = ++r->hits;
+          break;
+        }
+        idx = (idx + 1) & (xdefines::MAX_TRAP_RECORDS - 1);
+      }
+      _lock.unlock();
+
+      // table is full, report it every time
+      return hits == 0 ? 1 : hits;
+    }
+
+    void printSummary() {
+      if(_numRecords == 0) {
+        return;
+      }
+      fprintf(stderr, "***overflow summary: %d unique (ip, callsite) pairs***\n", _numRecords);
+      for(int i = 0; i < xdefines::MAX_TRAP_RECORDS; i++) {
+        trapRecord* r = &_records[i];
+        if(r->hits != 0) {
+          fprintf(stderr, "ip %p, callsite %p, hits %lu\n", r->ip, r->cs, r->hits);
+        }
+      }
+    }
+
+  private:
+    trapreport() : _numRecords(0) {
+      _lock.init();
+      memset(_records, 0, sizeof(_records));
+    }
+    ~trapreport() {}
+
+    struct trapRecord {
+      void* ip;
+      void* cs;
+      unsigned long hits;
+    };
+
+    spinlock _lock;
+    int _numRecords;
+    trapRecord _records[xdefines::MAX_TRAP_RECORDS];
+};
+
+#endif
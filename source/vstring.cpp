@@ -0,0 +1,322 @@
+/*
+ * @file   vstring.cpp
+ * @brief  Vectorized string routines, and the replay of their scans.
+ *
+ * Every vector load is either aligned or stops before a page boundary, so
+ * it never faults past the terminator. All routines that load strings live
+ * in their own section, the trap handler tells them apart by the pc.
+ */
+
+#ifdef VECTOR_STRINGS
+#include "vstring.hh"
+
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "xdefines.hh"
+
+#define STRING_ROUTINE __attribute__((section("causer_strings"), noinline))
+
+// start and end of the section, provided by the linker
+extern char __start_causer_strings[] __attribute__((visibility("hidden")));
+extern char __stop_causer_strings[] __attribute__((visibility("hidden")));
+
+__thread stringScan currentScan __attribute__((tls_model("initial-exec")));
+
+typedef size_t (*strnlenFunc)(const char* s, size_t n);
+typedef int (*strcmpFunc)(const char* s1, const char* s2);
+
+static strnlenFunc strnlenImpl = NULL;
+static strcmpFunc strcmpImpl = NULL;
+
+static inline size_t minSize(size_t a, size_t b) {
+  return a < b ? a : b;
+}
+
+static inline size_t pageOffset(const char* p) {
+  return (uintptr_t)p & xdefines::PAGE_SIZE_MASK;
+}
+
+STRING_ROUTINE
+static size_t strnlenSSE2(const char* s, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  uintptr_t offset = (uintptr_t)s & 15;
+  const char* p = s - offset;
+
+  // drop the bytes in front of s
+  unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero)) >> offset;
+  if(mask) {
+    return minSize(__builtin_ctz(mask), n);
+  }
+  p += 16;
+
+  // one vector at a time until p is aligned to a round
+  while(((uintptr_t)p & 63) != 0) {
+    if((size_t)(p - s) >= n) {
+      return n;
+    }
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero));
+    if(mask) {
+      return minSize(p - s + __builtin_ctz(mask), n);
+    }
+    p += 16;
+  }
+
+  // 64 bytes per round, a round never crosses a page
+  while((size_t)(p - s) < n) {
+    __m128i a = _mm_load_si128((const __m128i*)p);
+    __m128i b = _mm_load_si128((const __m128i*)(p + 16));
+    __m128i c = _mm_load_si128((const __m128i*)(p + 32));
+    __m128i d = _mm_load_si128((const __m128i*)(p + 48));
+    __m128i m = _mm_min_epu8(_mm_min_epu8(a, b), _mm_min_epu8(c, d));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero))) {
+      uint64_t masks = (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero))
+        | ((uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(b, zero)) << 16)
+        | ((uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(c, zero)) << 32)
+        | ((uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(d, zero)) << 48);
+      return minSize(p - s + __builtin_ctzll(masks), n);
+    }
+    p += 64;
+  }
+  return n;
+}
+
+__attribute__((target("avx2")))
+STRING_ROUTINE
+static size_t strnlenAVX2(const char* s, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  uintptr_t offset = (uintptr_t)s & 31;
+  const char* p = s - offset;
+
+  unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero)) >> offset;
+  if(mask) {
+    return minSize(__builtin_ctz(mask), n);
+  }
+  p += 32;
+
+  // one vector at a time until p is aligned to a round
+  while(((uintptr_t)p & 127) != 0) {
+    if((size_t)(p - s) >= n) {
+      return n;
+    }
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero));
+    if(mask) {
+      return minSize(p - s + __builtin_ctz(mask), n);
+    }
+    p += 32;
+  }
+
+  // 128 bytes per round
+  while((size_t)(p - s) < n) {
+    __m256i a = _mm256_load_si256((const __m256i*)p);
+    __m256i b = _mm256_load_si256((const __m256i*)(p + 32));
+    __m256i c = _mm256_load_si256((const __m256i*)(p + 64));
+    __m256i d = _mm256_load_si256((const __m256i*)(p + 96));
+    __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_min_epu8(a, b), _mm256_min_epu8(c, d)), zero);
+    if(!_mm256_testz_si256(m, m)) {
+      uint64_t low = (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero))
+        | ((uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, zero)) << 32);
+      if(low) {
+        return minSize(p - s + __builtin_ctzll(low), n);
+      }
+      uint64_t high = (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, zero))
+        | ((uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(d, zero)) << 32);
+      return minSize(p + 64 - s + __builtin_ctzll(high), n);
+    }
+    p += 128;
+  }
+  return n;
+}
+
+// Bytes where the strings differ or end, one bit per byte.
+__attribute__((always_inline))
+static inline unsigned compareSSE2(const char* s1, const char* s2) {
+  __m128i a = _mm_loadu_si128((const __m128i*)s1);
+  __m128i b = _mm_loadu_si128((const __m128i*)s2);
+  __m128i m = _mm_min_epu8(a, _mm_cmpeq_epi8(a, b));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(m, _mm_setzero_si128()));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline unsigned compareAVX2(const char* s1, const char* s2) {
+  __m256i a = _mm256_loadu_si256((const __m256i*)s1);
+  __m256i b = _mm256_loadu_si256((const __m256i*)s2);
+  __m256i m = _mm256_min_epu8(a, _mm256_cmpeq_epi8(a, b));
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(m, _mm256_setzero_si256()));
+}
+
+// The two strings are rarely aligned alike, so both are loaded unaligned.
+// Between page boundaries no vector can fault; at a boundary the vector is
+// moved back to end right on it, the bytes it loads again are known equal.
+STRING_ROUTINE
+static int strcmpSSE2(const char* s1, const char* s2) {
+  size_t i = 0;
+  while(true) {
+    size_t room = minSize(xdefines::PAGE_SIZE - pageOffset(s1 + i), xdefines::PAGE_SIZE - pageOffset(s2 + i));
+    if(room < 16) {
+      if(i < 16 - room) {
+        // too close to the start, a byte at a time
+        unsigned char c1 = s1[i], c2 = s2[i];
+        if(c1 != c2 || c1 == 0) {
+          return c1 - c2;
+        }
+        i++;
+        continue;
+      }
+      i -= 16 - room;
+      room = 16;
+    }
+
+    for(; room >= 32; room -= 32, i += 32) {
+      uint32_t mask = compareSSE2(s1 + i, s2 + i) | (compareSSE2(s1 + i + 16, s2 + i + 16) << 16);
+      if(mask) {
+        i += __builtin_ctz(mask);
+        return (unsigned char)s1[i] - (unsigned char)s2[i];
+      }
+    }
+    if(room >= 16) {
+      unsigned mask = compareSSE2(s1 + i, s2 + i);
+      if(mask) {
+        i += __builtin_ctz(mask);
+        return (unsigned char)s1[i] - (unsigned char)s2[i];
+      }
+      i += 16;
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+STRING_ROUTINE
+static int strcmpAVX2(const char* s1, const char* s2) {
+  size_t i = 0;
+  while(true) {
+    size_t room = minSize(xdefines::PAGE_SIZE - pageOffset(s1 + i), xdefines::PAGE_SIZE - pageOffset(s2 + i));
+    if(room < 32) {
+      if(i < 32 - room) {
+        unsigned char c1 = s1[i], c2 = s2[i];
+        if(c1 != c2 || c1 == 0) {
+          return c1 - c2;
+        }
+        i++;
+        continue;
+      }
+      i -= 32 - room;
+      room = 32;
+    }
+
+    for(; room >= 64; room -= 64, i += 64) {
+      uint64_t mask = compareAVX2(s1 + i, s2 + i) | ((uint64_t)compareAVX2(s1 + i + 32, s2 + i + 32) << 32);
+      if(mask) {
+        i += __builtin_ctzll(mask);
+        return (unsigned char)s1[i] - (unsigned char)s2[i];
+      }
+    }
+    if(room >= 32) {
+      unsigned mask = compareAVX2(s1 + i, s2 + i);
+      if(mask) {
+        i += __builtin_ctz(mask);
+        return (unsigned char)s1[i] - (unsigned char)s2[i];
+      }
+      i += 32;
+    }
+  }
+}
+
+static void selectStringRoutines() {
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    strcmpImpl = strcmpAVX2;
+    strnlenImpl = strnlenAVX2;
+  } else {
+    strcmpImpl = strcmpSSE2;
+    strnlenImpl = strnlenSSE2;
+  }
+}
+
+static inline void recordScan(const char* first, const char* second, size_t limit) {
+  currentScan.first = first;
+  currentScan.second = second;
+  currentScan.limit = limit;
+}
+
+size_t vstrlen(const char* s) {
+  if(unlikely(strnlenImpl == NULL)) {
+    selectStringRoutines();
+  }
+  recordScan(s, NULL, SIZE_MAX);
+  return strnlenImpl(s, SIZE_MAX);
+}
+
+size_t vstrnlen(const char* s, size_t n) {
+  if(unlikely(strnlenImpl == NULL)) {
+    selectStringRoutines();
+  }
+  recordScan(s, NULL, n);
+  return strnlenImpl(s, n);
+}
+
+int vstrcmp(const char* s1, const char* s2) {
+  if(unlikely(strcmpImpl == NULL)) {
+    selectStringRoutines();
+  }
+  recordScan(s1, s2, SIZE_MAX);
+  return strcmpImpl(s1, s2);
+}
+
+// The trap comes after the load, so pc may be right behind the section.
+bool isStringRoutine(void* pc) {
+  return (char*)pc > __start_causer_strings && (char*)pc <= __stop_causer_strings;
+}
+
+// Whether scanning s, and other along with it, up to w reads w.
+static bool replayScan(const char* s, const char* other, size_t limit, const char* w) {
+  // the string starting closest below w is the one that reaches it first
+  if(other != NULL && other <= w && (s > w || other > s)) {
+    const char* t = s;
+    s = other;
+    other = t;
+  }
+  if(s == NULL || s > w) {
+    // w was only loaded along with the aligned bytes in front of s
+    return false;
+  }
+
+  size_t reach = w - s;
+  if(reach >= limit) {
+    return false;
+  }
+  for(size_t i = 0; i < reach; i++) {
+    if(s[i] == '\0' || (other != NULL && other[i] != s[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Called by the trap handler of the same thread, it never reads addr itself.
+bool isStringOverread(void* addr) {
+  return replayScan(currentScan.first, currentScan.second, currentScan.limit, (const char*)addr);
+}
+
+bool isStringOverread(const stringScan* scan, void* start, void* addr) {
+  const char* w = (const char*)addr;
+  const char* first = scan->first;
+  const char* second = scan->second;
+  size_t limit = scan->limit;
+
+  // strings outside of the object may be gone, and are not read
+  if(first < (const char*)start || first >= w) {
+    first = NULL;
+  }
+  if(second < (const char*)start || second >= w) {
+    second = NULL;
+  }
+  if(first == NULL) {
+    first = second;
+    second = NULL;
+  }
+  return replayScan(first, second, limit, w);
+}
+#endif
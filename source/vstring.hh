@@ -0,0 +1,40 @@
+#if !defined(_VSTRING_H)
+#define _VSTRING_H
+
+/*
+ * @file   vstring.hh
+ * @brief  Vectorized string routines that replace the libc ones.
+ *
+ * Like the libc routines, they load whole vectors and may touch a watched
+ * sentinel right behind the terminator. Each routine records the strings
+ * it scans in the current thread, so the trap handler can replay the scan
+ * up to the watched byte and tell whether that byte was really read.
+ */
+
+#include <stddef.h>
+
+struct stringScan {
+  const char* first;
+  const char* second; // the other string of a comparison, or NULL
+  size_t limit;       // no more than limit bytes of each string are read
+};
+
+extern __thread stringScan currentScan __attribute__((tls_model("initial-exec")));
+
+size_t vstrlen(const char* s);
+size_t vstrnlen(const char* s, size_t n);
+int vstrcmp(const char* s1, const char* s2);
+
+// Whether pc is inside one of the routines above.
+bool isStringRoutine(void* pc);
+
+// Whether the scan recorded by this thread has read addr, as opposed to
+// only loading it together with the bytes in front of it.
+bool isStringOverread(void* addr);
+
+// The same for the last scan of another thread, which may have moved on
+// since. Only strings that start inside [start, addr) are replayed, so
+// nothing but the watched object is read.
+bool isStringOverread(const stringScan* scan, void* start, void* addr);
+
+#endif
@@ -5,6 +5,19 @@
 #include "watchpoint.hh"
 
 #include "xthread.hh"
+#include "whitelist.hh"
+#include "trapreport.hh"
+#include "config.hh"
+#include "policy.hh"
+#ifdef OVERHEAD_GOVERNOR
+#include "governor.hh"
+#endif
+#ifdef VECTOR_STRINGS
+#include "vstring.hh"
+#endif
+#ifdef LIVE_STATS
+#include "livestats.hh"
+#endif
 #include <execinfo.h>
 #include <dlfcn.h>
 #include <sys/mman.h>
@@ -26,15 +39,20 @@ int sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
 bool watchpoint::setWatchpoint(void* addr, void* objectstart, size_t objectsize, void* cs, bool ispreempt) {
   //fprintf(stderr, "[try to] set watchpoint at %p, object %p, size %zu\n", addr, objectstart, objectsize);
   bool ret = false;
+  // only the first tuning.watchpoints slots are used
+  int slots = tuning.watchpoints;
+  if(slots == 0){
+    return false;
+  }
 #ifdef RANDOM_SEARCH_WP
-  int sidx = arc4random_uniform(xdefines::MAX_WATCHPOINTS);
+  int sidx = arc4random_uniform(slots);
 #else
   int sidx = curIndex; 
 #endif
-  for(int i=0; i<xdefines::MAX_WATCHPOINTS && !ret; i++){
+  for(int i=0; i<slots && !ret; i++){
 
     watchpointObject* obj = &_wp[sidx];
-    sidx = (sidx + 1) & xdefines::WP_SEARCH_INDEX_MASK;
+    sidx = policy::nextSlot(sidx, slots);
 
     if(!obj->isUsed || ispreempt){
       pthread_spin_lock(&obj->lock);
@@ -49,9 +67,13 @@ bool watchpoint::setWatchpoint(void* addr, void* objectstart, size_t objectsize,
         unsigned long now = getCurrentTime();
         unsigned long difftime = now - obj->installtime;
         //fprintf(stderr, "%p, difftime %lu, current ratio %d, installed ratio %d, %f\n", objectstart, difftime, current->watchedRatio, installed->watchedRatio, (installed->watchedRatio * xdefines::WP_PREEMPT_WEIGHT * (1 - difftime * 1.0 / xdefines::WP_PREEMPT_TIME_REDUCTION_BASE)));
-        if(difftime >= xdefines::WP_INSTALL_MIN_TIME
-            && current->watchedRatio > 
-            (installed->watchedRatio * xdefines::WP_PREEMPT_WEIGHT * (1 - difftime * 1.0 / xdefines::WP_PREEMPT_TIME_REDUCTION_BASE))){
+#ifdef OVERHEAD_GOVERNOR
+        // over the overhead target, watchpoints are replaced less often
+        unsigned long mintime = governor::getInstance().scaleInstallTime(tuning.wpInstallMinTime);
+#else
+        unsigned long mintime = tuning.wpInstallMinTime;
+#endif
+        if(policy::canPreempt(current->watchedRatio, installed->watchedRatio, difftime, mintime)){
           //(installed->watchedRatio * xdefines::WP_PREEMPT_WEIGHT > difftime / xdefines::WP_PREEMPT_TIME_REDUCTION_BASE ? 
           // installed->watchedRatio * xdefines::WP_PREEMPT_WEIGHT - difftime / xdefines::WP_PREEMPT_TIME_REDUCTION_BASE : 0))
           isavalid = true;
@@ -67,11 +89,13 @@ bool watchpoint::setWatchpoint(void* addr, void* objectstart, size_t objectsize,
         list_t* aliveThreadsList = xthread::getInstance().getAliveThreadsList();
 
         thread_t* iterthread = NULL;
+#ifdef LIVE_STATS
+        bool preempted = obj->isUsed;
+#endif
         if(obj->isUsed){
           // disable current watchpoint
           FOR_EACH_THREAD_START(iterthread, aliveThreadsList) {
-            disable_watchpoint(obj->fd[iterthread->index]);
-            obj->fd[iterthread->index] = -1;
+            closeWatchpoint(obj, iterthread->index);
             FOR_EACH_THREAD_NEXT(iterthread, aliveThreadsList)
           }
         }
@@ -84,12 +108,15 @@ bool watchpoint::setWatchpoint(void* addr, void* objectstart, size_t objectsize,
         obj->callstack = cs;
 
         //install wachpoint
-        ret = setWatchpoint(addr, obj->fd);
+        ret = setWatchpoint(addr, obj);
         if(ret){
           // installed time 
           //obj->installtime = rdtscp();
           obj->installtime = getCurrentTime();
           __atomic_store(&curIndex, &sidx, __ATOMIC_RELAXED);
+#ifdef LIVE_STATS
+          livestats::getInstance().setSlot(obj - _wp, addr, objectstart, objectsize, (callstack*)cs, obj->installtime, preempted);
+#endif
         }else{
           obj->isUsed = false;
         }
@@ -115,6 +142,9 @@ bool watchpoint::setWatchpointByThread(thread_t* thread){
       obj->fd[thread->index] = install_watchpoint((uintptr_t)(obj->addr), thread->tid, -1, WP_SIGNAL, -1); 
 
       if(obj->fd[thread->index] == -1
+#ifdef SAMPLE_RING_BUFFER
+          || (obj->ring[thread->index] = map_ringbuffer(obj->fd[thread->index])) == NULL
+#endif
           || enable_watchpoint(obj->fd[thread->index]) == -1){
         ret = false;
         break;
@@ -124,7 +154,7 @@ bool watchpoint::setWatchpointByThread(thread_t* thread){
   return ret;
 }
 
-bool watchpoint::setWatchpoint(void* addr, int* fd) {
+bool watchpoint::setWatchpoint(void* addr, watchpointObject* obj) {
   // FIXME test
   //__atomic_add_fetch(&_numWatchpoints, 1, __ATOMIC_RELAXED);
   //return true;
@@ -135,12 +165,16 @@ bool watchpoint::setWatchpoint(void* addr, int* fd) {
   thread_t* iterthread = NULL;
   list_t* aliveThreadsList = xthread::getInstance().getAliveThreadsList();
 
+  int* fd = obj->fd;
   FOR_EACH_THREAD_START(iterthread, aliveThreadsList) {
     // install this watch point.
     fd[iterthread->index] = install_watchpoint((uintptr_t)addr, iterthread->tid, -1, WP_SIGNAL, -1); 
 
     //Now we can start those watchpoints.
     if(fd[iterthread->index] == -1
+#ifdef SAMPLE_RING_BUFFER
+        || (obj->ring[iterthread->index] = map_ringbuffer(fd[iterthread->index])) == NULL
+#endif
         || enable_watchpoint(fd[iterthread->index]) == -1){
       ret = false;
       break;
@@ -157,8 +191,7 @@ bool watchpoint::setWatchpoint(void* addr, int* fd) {
     // rollback enabled watchpoint
     FOR_EACH_THREAD_START(iterthread, aliveThreadsList) {
       if(fd[iterthread->index] != -1){
-        disable_watchpoint(fd[iterthread->index]);
-        fd[iterthread->index] = -1;
+        closeWatchpoint(obj, iterthread->index);
       }
       if(--installednum < 0){
         break;
@@ -170,6 +203,26 @@ bool watchpoint::setWatchpoint(void* addr, int* fd) {
   return ret;
 }
 
+bool watchpoint::isHardwareAvailable() {
+  static char probe;
+  struct perf_event_attr pe;
+
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_BREAKPOINT;
+  pe.size = sizeof(pe);
+  pe.bp_type = HW_BREAKPOINT_RW;
+  pe.bp_len = HW_BREAKPOINT_LEN_1;
+  pe.bp_addr = (uintptr_t)&probe;
+  pe.disabled = 1;
+
+  int fd = perf_event_open(&pe, 0, -1, -1, 0);
+  if(fd == -1) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
 int watchpoint::install_watchpoint(uintptr_t address, pid_t pid, int cpuid, int sig, int group) {
   // Perf event settings
   struct perf_event_attr pe;
@@ -182,8 +235,15 @@ int watchpoint::install_watchpoint(uintptr_t address, pid_t pid, int cpuid, int
   pe.bp_addr = (uintptr_t)address;
   pe.disabled = 1;
   pe.sample_period = 1;
-  //pe.sample_type = sample_type;
+#ifdef SAMPLE_RING_BUFFER
+  // let the kernel record the access into the ring buffer instead of signaling
+  pe.sample_type = sample_type;
+  pe.exclude_callchain_kernel = 1;
+#endif
 
+#ifdef LIVE_STATS
+  syscallTimer timer;
+#endif
   int perf_fd = -1;
   // Create the perf_event for this thread on all CPUs with no event group, use pid instead of 0. 
   perf_fd = perf_event_open(&pe, pid, cpuid, group, 0);
@@ -192,6 +252,10 @@ int watchpoint::install_watchpoint(uintptr_t address, pid_t pid, int cpuid, int
     return -1;
   }
 
+#ifdef SAMPLE_RING_BUFFER
+  return perf_fd;
+#endif
+
   // Set the perf_event file to async mode
   if(fcntl(perf_fd, F_SETFL, fcntl(perf_fd, F_GETFL, 0) | O_ASYNC) == -1) {
     fprintf(stderr, "Failed to set perf event file to ASYNC mode: %s\n", strerror(errno));
@@ -213,8 +277,22 @@ int watchpoint::install_watchpoint(uintptr_t address, pid_t pid, int cpuid, int
   return perf_fd;
 }
 
+#ifdef SAMPLE_RING_BUFFER
+void* watchpoint::map_ringbuffer(int fd) {
+  void* ring = mmap(NULL, MmapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(ring == MAP_FAILED) {
+    fprintf(stderr, "Failed to map perf ring buffer: %s\n", strerror(errno));
+    return NULL;
+  }
+  return ring;
+}
+#endif
+
 int watchpoint::enable_watchpoint(int fd) {
   //return 0;
+#ifdef LIVE_STATS
+  syscallTimer timer;
+#endif
   int ret;
   // Start the event
   if((ret = ioctl(fd, PERF_EVENT_IOC_ENABLE, 0)) == -1) {
@@ -230,6 +308,9 @@ int watchpoint::disable_watchpoint(int fd) {
   if(fd < 3){
     return -1;
   }
+#ifdef LIVE_STATS
+  syscallTimer timer;
+#endif
 
   // we should close fd, otherwise it is still occupied
   ret -= ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
@@ -242,6 +323,26 @@ int watchpoint::disable_watchpoint(int fd) {
   return ret;
 }
 
+// Close the watchpoint of one thread
+int watchpoint::closeWatchpoint(watchpointObject* object, int index){
+#ifdef SAMPLE_RING_BUFFER
+  // stop sampling, and report what is still in the ring before it goes
+  if(object->ring[index] != NULL){
+    ioctl(object->fd[index], PERF_EVENT_IOC_DISABLE, 0);
+    flushRing(object, index);
+  }
+#endif
+  int ret = disable_watchpoint(object->fd[index]);
+  object->fd[index] = -1;
+#ifdef SAMPLE_RING_BUFFER
+  if(object->ring[index] != NULL){
+    munmap(object->ring[index], MmapSize);
+    object->ring[index] = NULL;
+  }
+#endif
+  return ret;
+}
+
 // this function should be protected by globallock and per-watchpoint spinlock
 bool watchpoint::disableWatchpoint(watchpointObject* object){ 
 
@@ -251,14 +352,16 @@ bool watchpoint::disableWatchpoint(watchpointObject* object){
     list_t* aliveThreadsList = xthread::getInstance().getAliveThreadsList();
     thread_t* iterthread = NULL;
     FOR_EACH_THREAD_START(iterthread, aliveThreadsList) {
-      ret &= !(disable_watchpoint(object->fd[iterthread->index]) < 0); 
-      object->fd[iterthread->index] = -1;
+      ret &= !(closeWatchpoint(object, iterthread->index) < 0); 
       FOR_EACH_THREAD_NEXT(iterthread, aliveThreadsList)
     }
 
     if(ret) {
       __atomic_sub_fetch(&_numWatchpoints, 1, __ATOMIC_RELAXED);
       object->isUsed = false;
+#ifdef LIVE_STATS
+      livestats::getInstance().clearSlot(object - _wp);
+#endif
     }
   }
 
@@ -274,9 +377,15 @@ bool watchpoint::disableWatchpointByAddr(void* addr){
   if(object != NULL){
     pthread_spin_lock(&object->lock);
     if (object->isUsed && addr == object->objectstart){
+#ifdef OVERHEAD_GOVERNOR
+      unsigned long start = governor::begin();
+#endif
       acquireGlobalRLock();
       disableWatchpoint(object);
       releaseGlobalLock();
+#ifdef OVERHEAD_GOVERNOR
+      governor::getInstance().end(start);
+#endif
     }
     pthread_spin_unlock(&object->lock);
   }
@@ -284,6 +393,18 @@ bool watchpoint::disableWatchpointByAddr(void* addr){
   return ret;
 }
 
+// Free a slot whose overflow has been reported again and again, so that
+// it can move on to another candidate. Called with the global lock held.
+void watchpoint::retireWatchpoint(watchpointObject* object){
+  // the trapped thread may hold this lock already
+  if(pthread_spin_trylock(&object->lock) == 0){
+    if(object->isUsed){
+      disableWatchpoint(object);
+    }
+    pthread_spin_unlock(&object->lock);
+  }
+}
+
 watchpointObject* watchpoint::getWatchpointObjectByFd(int fd) {
   watchpointObject* obj = NULL;
   thread_t* iterthread = NULL;
@@ -339,7 +460,7 @@ std::string exec(const char* cmd) {
 std::string fetch_line(std::string libname, void *ptr){
   std::string source_line = "";
   char buf[4096];
-  sprintf(buf, "addr2line -e %s -a %p | tail -n +2", libname.c_str(), ptr);
+  snprintf(buf, sizeof(buf), "addr2line -e %s -a %p | tail -n +2", libname.c_str(), ptr);
   source_line = exec(buf);
   return source_line;
 }
@@ -347,90 +468,87 @@ std::string fetch_line(std::string libname, void *ptr){
 
 void printLineOfCode(void *ptr) {
 #ifndef CUSTOMIZED_REPORT
-  char buf[256];
+  char buf[PATH_MAX + 64];
 #endif
   if(selfmap::getInstance().isApplication(ptr)){
     void* addr = (void*)((uintptr_t)ptr - PREV_INSTRUCTION_OFFSET);
 #ifdef CUSTOMIZED_REPORT
     fprintf(stderr, "%s\n", fetch_line(selfmap::getInstance().getMainNameString(), addr).c_str());
 #else
-    sprintf(buf, "addr2line -a -i -e %s %p", selfmap::getInstance().getMainName(), addr);
+    snprintf(buf, sizeof(buf), "addr2line -a -i -e %s %p", selfmap::getInstance().getMainName(), addr);
     //sprintf(buf, "addr2line -e %s -a %p | tail -1", selfmap::getInstance().getMainName(), addr);
     system(buf);
 #endif
   } else {
-    mapping m = selfmap::getInstance().getMappingByAddress(ptr);
-    if(m.valid()){
-      void* addr = (void*)((uintptr_t)ptr - m.getBase() - PREV_INSTRUCTION_OFFSET);
+    textmodule module;
+    const textmodule* m = selfmap::getInstance().findModule(ptr, &module) ? &module : NULL;
+    if(m != NULL){
+      void* addr = (void*)((uintptr_t)ptr - m->load - PREV_INSTRUCTION_OFFSET);
 #ifdef CUSTOMIZED_REPORT
-      fprintf(stderr, "%s\n", fetch_line(m.getFile(), addr).c_str());
+      fprintf(stderr, "%s\n", fetch_line(m->name, addr).c_str());
 #else
-      sprintf(buf, "addr2line -a -i -e %s %p", m.getFile().c_str(), addr);
-      //sprintf(buf, "addr2line -e %s -a %p | tail -1", m.getFile().c_str(), addr);
+      snprintf(buf, sizeof(buf), "addr2line -a -i -e %s %p", m->name, addr);
+      //sprintf(buf, "addr2line -e %s -a %p | tail -1", m->name, addr);
       system(buf);
 #endif
     }
   }
 }
 
-bool checkGlibcWL(void* itptr, unsigned long offset, Dl_info &info){
-  bool benignBF = false;
-  std::string fname(info.dli_fname);
-  if(
-      // strcmp
-      (offset>=0x13f5c9 && offset<=0x141434) ||
-      (offset>=0x89cce && offset<=0x8bb70) ||
-      (offset>=0x86e07 && offset<=0x87f38) ||
-      // strlen
-      (offset>=0x88a7f && offset<=0x88dfc) ||
-      // strcmp-sse2 
-      (offset>=0x9fcbe && offset<=0x9fcf5) ||
-      // strcmp-sse2-unaligned
-      (offset>=0x9fcfa && offset<=0x9feac) ||
-      // strcmp-sse42
-      (offset>=0x145310 && offset<=0x14a467) ||
-      // strchr 
-      (offset>=0x89a77 && offset<=0x93c24) ||
-      // strstr-sse2-unaligned
-      (offset>=0xa1211 && offset<=0xa149f) ||
-      // strstr-sse2
-      (offset>=0xa9201 && offset<=0xa922c) ||
-      // strcat
-      (offset == 0xa7948) ||
-      // strcat-sse2-unaligned
-      (offset>=0xa79cd && offset<=0xa79f3) ||
-      // strcpy
-      (offset>=0xa67a0 && offset<=0xa69a0) ||
-      // _IO_vfprintf
-      (offset == 0x4e4b4) ||
-      // __lxstat
-      (offset == 0xf6eb5)
-      ){
-        //fprintf(stderr, "***inside the trap handler, it is in white-list, %p, base %p, offset %ld\n", itptr, info.dli_fbase, offset);
-        benignBF = true;
-        goto gotoEnd;
-      } 
-  else if(info.dli_sname != NULL){
-    std::string sname(info.dli_sname);
-    if(//sname.find("strlen") != std::string::npos || 
-        sname.find("strrchr") != std::string::npos
-        || sname.find("memchr") != std::string::npos
-        || sname.find("xstat64") != std::string::npos
-        ) {
-      //fprintf(stderr, "***inside the trap handler, triggered by strlen, strrchr, memchr or xstat64, %p, base %p, offset %ld\n", itptr, info.dli_fbase, offset);
-      benignBF = true;
-      goto gotoEnd;
+// Print where the overflow happens and where the object is allocated.
+void reportOverflow(bool isread, callstack* cs, void** array, int it, int frames) {
+#ifdef ENABLE_DLADDR_INFO
+  Dl_info info;
+#endif
+
+  if(isread){
+    fprintf(stderr, "A buffer over-read problem is detected at:\n");
+  }else{
+    fprintf(stderr, "A buffer over-write problem is detected at:\n");
+  }
+
+  for(; it < frames; it++) {
+
+    if(!selfmap::getInstance().isCauserLibrary(array[it])){
+
+#ifdef ENABLE_DLADDR_INFO
+      dladdr(array[it], &info);
+      fprintf(stderr, "ip %p, dli_fname %s, dli_fbase %p, dli_sname %s\n", array[it], info.dli_fname, info.dli_fbase, info.dli_sname);
+#endif
+      printLineOfCode(array[it]);
     }
   }
-  else if(fname.find("ld-linux-") != std::string::npos) {
-    //fprintf(stderr, "***inside the trap handler, triggered by libld, %p, base %p, offset %ld\n", itptr, info.dli_fbase, offset);
-    benignBF = true;
-    goto gotoEnd;
-  } 
 
+  if(cs == NULL){
+    return;
+  }
+
+  fprintf(stderr, "This object is allocated at:\n");
+  void** callsite = cs->stack;
+  for(int i=0; i<cs->depth; i++){
 
-gotoEnd:
-  return benignBF;
+#ifdef ENABLE_DLADDR_INFO
+    dladdr(callsite[i], &info);
+    fprintf(stderr, "ip %p, dli_fname %s, dli_fbase %p, dli_sname %s\n", callsite[i], info.dli_fname, info.dli_fbase, info.dli_sname);
+#endif
+    printLineOfCode(callsite[i]);
+  }
+}
+
+// Whether the sentinel watched through fd is still intact, so that the
+// access that trapped was a read.
+static bool isSentinelIntact(int fd) {
+  bool intact = false;
+  acquireGlobalRLock();
+  watchpointObject* wpObj = watchpoint::getInstance().getWatchpointObjectByFd(fd);
+  if(wpObj != NULL){
+    // reading it would trap again
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    intact = (*(size_t*)wpObj->addr == xdefines::SENTINEL_TAIL_WORD);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  releaseGlobalLock();
+  return intact;
 }
 
 // Handle those traps on watchpoints now.
@@ -443,6 +561,9 @@ void watchpoint::trapHandler(int /* sig */, siginfo_t* siginfo, void* context) {
 
   // disable watcher
   COND_DISABLE;
+#ifdef OVERHEAD_GOVERNOR
+  unsigned long start = governor::begin();
+#endif
 
   bool benignBF = false;
 
@@ -453,45 +574,36 @@ void watchpoint::trapHandler(int /* sig */, siginfo_t* siginfo, void* context) {
   ucontext_t* trapcontext = (ucontext_t*)context;
   size_t* insaddr = (size_t*)trapcontext->uc_mcontext.gregs[REG_RIP]; // address of access
 
-  Dl_info info;
-  if(selfmap::getInstance().isLibcLibrary(insaddr)) {
-    unsigned long offset = 0;
-    dladdr(insaddr, &info);
-    offset = (intptr_t)insaddr-(intptr_t)info.dli_fbase;
-    if(offset!=0x352f0){
-      benignBF = checkGlibcWL(insaddr, offset, info);
-    }
+  // accesses from vectorized libc routines and the dynamic linker are benign,
+  // and reads from those that also write
+  int kind = whitelist::getInstance().getKind(insaddr);
+  benignBF = (kind == WHITELIST_ANY) || (kind == WHITELIST_READS && isSentinelIntact(fd));
+
+  bool isstring = false;
+#ifdef VECTOR_STRINGS
+  // our own string routines replay the scan to tell whether the byte was read
+  isstring = isStringRoutine(insaddr);
+  if(isstring){
+    acquireGlobalRLock();
+    watchpointObject* wpObj = watchpoint::getInstance().getWatchpointObjectByFd(fd);
+    benignBF = (wpObj == NULL) || !isStringOverread(wpObj->addr);
+    releaseGlobalLock();
   }
+#endif
 
   if(!benignBF){
     /* check whether overflow is benigned  */
     frames = backtrace(array, 256);
     while(selfmap::getInstance().isCauserLibrary(itptr = array[it++])){ }
 
-    if(selfmap::getInstance().isPthreadLibrary(itptr)) {
+    // skip the signal frame
+    while(selfmap::getInstance().isPthreadLibrary(itptr)
+        || whitelist::getInstance().isSignalTrampoline(itptr)) {
       itptr = array[it++];
-      //benignBF = true;
     }
-    /*
-    */
-    //Dl_info info;
-    if(selfmap::getInstance().isLibcLibrary(itptr)) {
-      unsigned long offset = 0;
-GetPtr:
-      dladdr(itptr, &info);
-      offset = (intptr_t)itptr-(intptr_t)info.dli_fbase;
-      if(offset==0x352f0){
-        itptr = array[it++];
-        goto GetPtr;
-      }
-      benignBF = checkGlibcWL(itptr, offset, info);
-    } else {
-      dladdr(itptr, &info);
-      std::string fname(info.dli_fname);
-      if(fname.find("ld-linux-") != std::string::npos) {
-        //fprintf(stderr, "***inside the trap handler, triggered by libld, %p, base %p\n", itptr, info.dli_fbase);
-        benignBF = true;
-      }
+
+    if(!isstring){
+      benignBF = whitelist::getInstance().isBenign(itptr);
     }
   }
 
@@ -499,65 +611,295 @@ GetPtr:
   if(!benignBF){
 
     acquireGlobalRLock();
-    fprintf(stderr, "***inside the trap handler, fd %d\n", fd);
     watchpointObject* wpObj = (watchpointObject*)watchpoint::getInstance().getWatchpointObjectByFd(fd);
 
     if (wpObj != NULL){
-#ifdef ENABLE_DLADDR_INFO
-      Dl_info info;
+#ifdef LIVE_STATS
+      livestats::getInstance().addSlotHit(wpObj - watchpoint::getInstance().getAllWatchpointObjects());
 #endif
-      bool isread = false;
+      // an overflow in a loop traps on every iteration, only report it once
+      unsigned long hits = trapreport::getInstance().recordHit(insaddr, wpObj->callstack);
+      if(hits == 1){
+        fprintf(stderr, "***inside the trap handler, fd %d\n", fd);
+
+        bool isread = false;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        size_t* installedaddr = (size_t*)wpObj->addr;
+        if(*installedaddr == xdefines::SENTINEL_TAIL_WORD){
+          isread = true;
+        }
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
 
-      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
-      size_t* installedaddr = (size_t*)wpObj->addr;
-      if(*installedaddr == xdefines::SENTINEL_TAIL_WORD){
-        isread = true;
+        reportOverflow(isread, (callstack*)wpObj->callstack, array, it - 1, frames);
+#ifdef OVERHEAD_GOVERNOR
+        // a report is made once, it is not part of the running cost
+        start = governor::begin();
+#endif
       }
-      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
-
-      if(isread){
-        fprintf(stderr, "A buffer over-read problem is detected at:\n");
-      }else{
-        fprintf(stderr, "A buffer over-write problem is detected at:\n");
+      if(hits >= tuning.maxTrapRepeat){
+        watchpoint::getInstance().retireWatchpoint(wpObj);
       }
+    }
 
-      //void* array[256];
-      //int frames = backtrace(array, 256);
-      for(it--; it < frames; it++) {
+    releaseGlobalLock();
 
-        if(!selfmap::getInstance().isCauserLibrary(array[it])){
+  }
 
-#ifdef ENABLE_DLADDR_INFO
-          dladdr(array[it], &info);
-          fprintf(stderr, "ip %p, dli_fname %s, dli_fbase %p, dli_sname %s\n", array[it], info.dli_fname, info.dli_fbase, info.dli_sname);
+  //exit(0);
+#ifdef LIVE_STATS
+  livestats::getInstance().countTrap(benignBF);
+#endif
+#ifdef OVERHEAD_GOVERNOR
+  governor::getInstance().end(start);
 #endif
-          printLineOfCode(array[it]);
+  COND_ENABLE;
+}
+
+/* **************************** perf signal handler end ******************************* */
+
+/* **************************** perf ring buffer consumer ******************************* */
+#ifdef SAMPLE_RING_BUFFER
+// Layout of PERF_RECORD_SAMPLE for our sample_type
+struct sampleRecord {
+  struct perf_event_header header;
+  uint64_t ip;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t nr;
+  uint64_t ips[];
+};
+
+struct watchpoint::ringReport {
+  bool isread;
+  callstack* cs;
+  int frames;
+  void* array[xdefines::MAX_CALLSTACK_DEPTH];
+};
+
+watchpoint::ringReport watchpoint::_ringPending[xdefines::MAX_RING_REPORTS];
+
+// Copy one record out of the ring, it may wrap around the end of the data area.
+static void copyRecord(char* data, uint64_t offset, void* dest, size_t size) {
+  size_t pos = offset & (DataSize - 1);
+  size_t first = DataSize - pos < size ? DataSize - pos : size;
+  memcpy(dest, data + pos, first);
+  memcpy((char*)dest + first, data, size - first);
+}
+
+// Consume the samples in the ring of one thread, it should be protected by the
+// global lock and the per-watchpoint spinlock, so that the ring is not unmapped
+// underneath. Return how many reports are added; retire is set once a sample
+// has been reported too often.
+int watchpoint::drainRing(watchpointObject* obj, int index, ringReport* pending, int maxreports, bool* retire) {
+  int npending = 0;
+  char buf[PageSize];
+
+  struct perf_event_mmap_page* meta = (struct perf_event_mmap_page*)obj->ring[index];
+  if(meta == NULL) {
+    return 0;
+  }
+
+  char* data = (char*)meta + PageSize;
+  uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = meta->data_tail;
+
+  while(tail < head) {
+    struct perf_event_header header;
+    copyRecord(data, tail, &header, sizeof(header));
+    if(header.size == 0 || header.size > sizeof(buf)) {
+      tail = head;
+      break;
+    }
+
+    if(header.type == PERF_RECORD_SAMPLE) {
+      copyRecord(data, tail, buf, header.size);
+      sampleRecord* sample = (sampleRecord*)buf;
+      __atomic_add_fetch(&_ringSamples, 1, __ATOMIC_RELAXED);
+
+      void* ip = (void*)sample->ip;
+      void* frames[xdefines::MAX_CALLSTACK_DEPTH];
+      int nframes = 0;
+      // skip the context markers of the callchain
+      for(uint64_t i = 0; i < sample->nr && nframes < xdefines::MAX_CALLSTACK_DEPTH; i++) {
+        if(sample->ips[i] < PERF_CONTEXT_MAX) {
+          frames[nframes++] = (void*)sample->ips[i];
         }
       }
 
-      fprintf(stderr, "This object is allocated at:\n");
-      callstack* cs = (callstack*)wpObj->callstack;
-      void** callsite = cs->stack;
-      for(int i=0; i<cs->depth; i++){
+      // the kernel reads buffers on behalf of a system call, which is made
+      // by the first user frame
+      if(nframes > 0) {
+        ip = frames[0];
+      }
 
-#ifdef ENABLE_DLADDR_INFO
-        dladdr(callsite[i], &info);
-        fprintf(stderr, "ip %p, dli_fname %s, dli_fbase %p, dli_sname %s\n", callsite[i], info.dli_fname, info.dli_fbase, info.dli_sname);
+      // accesses from vectorized libc routines and the dynamic linker are benign,
+      // and reads from those that also write
+      int kind = whitelist::getInstance().getKind(ip);
+      bool benign = (kind == WHITELIST_ANY)
+        || (kind == WHITELIST_READS && *(size_t*)obj->addr == xdefines::SENTINEL_TAIL_WORD);
+      bool isstring = false;
+#ifdef VECTOR_STRINGS
+      // our own string routines replay the last scan of the sampled thread
+      isstring = isStringRoutine(ip);
+      if(isstring) {
+        benign = !isStringOverread(xthread::getInstance().getThread(index)->scan, obj->objectstart, obj->addr);
+      }
 #endif
-        printLineOfCode(callsite[i]);
+      // anything else of ours reads the sentinels on purpose
+      if(!isstring && selfmap::getInstance().isCauserLibrary(ip)) {
+        benign = true;
+      }
+
+      int it = 0;
+      if(!benign) {
+        // skip our own frames, as the trap handler does
+        while(it < nframes && selfmap::getInstance().isCauserLibrary(frames[it])) {
+          it++;
+        }
+        if(!isstring && it < nframes) {
+          benign = whitelist::getInstance().isBenign(frames[it]);
+        }
       }
 
+      if(benign) {
+        __atomic_add_fetch(&_ringBenign, 1, __ATOMIC_RELAXED);
+      } else {
+        unsigned long hits = trapreport::getInstance().recordHit(ip, obj->callstack);
+        if(hits == 1 && npending < maxreports) {
+          ringReport* r = &pending[npending++];
+          r->isread = (*(size_t*)obj->addr == xdefines::SENTINEL_TAIL_WORD);
+          r->cs = (callstack*)obj->callstack;
+          r->frames = nframes - it;
+          memcpy(r->array, &frames[it], r->frames * sizeof(void*));
+        }
+        if(hits >= tuning.maxTrapRepeat) {
+          *retire = true;
+        }
+      }
+    } else if(header.type == PERF_RECORD_LOST) {
+      __atomic_add_fetch(&_ringLost, 1, __ATOMIC_RELAXED);
     }
 
-    releaseGlobalLock();
+    tail += header.size;
+  }
+
+  __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+  return npending;
+}
+
+// Consume all samples of one watchpoint, with the same locks as drainRing.
+// Return how many reports are added.
+int watchpoint::drainRingBuffers(watchpointObject* obj, ringReport* pending, int maxreports) {
+  int npending = 0;
+  bool retire = false;
+
+  list_t* aliveThreadsList = xthread::getInstance().getAliveThreadsList();
+  thread_t* iterthread = NULL;
+  FOR_EACH_THREAD_START(iterthread, aliveThreadsList) {
+    npending += drainRing(obj, iterthread->index, pending + npending, maxreports - npending, &retire);
+    FOR_EACH_THREAD_NEXT(iterthread, aliveThreadsList)
+  }
 
+  if(retire) {
+    disableWatchpoint(obj);
   }
 
-  //exit(0);
+  return npending;
+}
+
+// Queue the samples left in the ring of a watchpoint that is being closed.
+// The callers hold the locks already, even on the malloc path, so reporting,
+// which runs addr2line, is left to the consumer. The slot goes away anyway,
+// so there is nothing to retire.
+void watchpoint::flushRing(watchpointObject* obj, int index) {
+  bool retire = false;
+
+  COND_DISABLE;
+  pthread_spin_lock(&_ringPendingLock);
+  _ringPendingCount += drainRing(obj, index, _ringPending + _ringPendingCount,
+      xdefines::MAX_RING_REPORTS - _ringPendingCount, &retire);
+  pthread_spin_unlock(&_ringPendingLock);
   COND_ENABLE;
 }
 
-/* **************************** perf signal handler end ******************************* */
+// Report what flushRing has queued, without holding any lock.
+void watchpoint::reportPending() {
+  ringReport reports[xdefines::MAX_RING_REPORTS];
+
+  pthread_spin_lock(&_ringPendingLock);
+  int nreports = _ringPendingCount;
+  memcpy(reports, _ringPending, nreports * sizeof(ringReport));
+  _ringPendingCount = 0;
+  pthread_spin_unlock(&_ringPendingLock);
+
+  for(int j = 0; j < nreports; j++) {
+    fprintf(stderr, "***sampled by the ring buffer\n");
+    reportOverflow(reports[j].isread, reports[j].cs, reports[j].array, 0, reports[j].frames);
+  }
+}
+
+void watchpoint::consumeRingBuffers() {
+  ringReport reports[xdefines::MAX_RING_REPORTS];
+
+  reportPending();
+
+  for(int i = 0; i < xdefines::MAX_WATCHPOINTS; i++) {
+    watchpointObject* obj = &_wp[i];
+    if(!obj->isUsed) {
+      continue;
+    }
+
+    int nreports = 0;
+    pthread_spin_lock(&obj->lock);
+    acquireGlobalRLock();
+    if(obj->isUsed) {
+      nreports = drainRingBuffers(obj, reports, xdefines::MAX_RING_REPORTS);
+    }
+    releaseGlobalLock();
+    pthread_spin_unlock(&obj->lock);
+
+    // symbolize without holding any lock
+    for(int j = 0; j < nreports; j++) {
+      fprintf(stderr, "***sampled by the ring buffer\n");
+      reportOverflow(reports[j].isread, reports[j].cs, reports[j].array, 0, reports[j].frames);
+    }
+  }
+}
+
+void* watchpoint::ringConsumer(void*) {
+  watchpoint& wp = watchpoint::getInstance();
+  while(!wp._ringStopped) {
+    usleep(xdefines::RING_POLL_INTERVAL * 1000);
+    if(!wp._ringStopped) {
+      wp.consumeRingBuffers();
+    }
+  }
+  return NULL;
+}
+
+void watchpoint::startRingConsumer() {
+  pthread_t tid;
+  // the consumer is not registered in xthread, so it is never watched itself
+  if(Real::pthread_create(&tid, NULL, watchpoint::ringConsumer, NULL) != 0) {
+    fprintf(stderr, "Failed to create the ring buffer consumer\n");
+    abort();
+  }
+}
+
+// Drain what is left and stop consuming, the library itself reads the
+// sentinels when checking memory at exit.
+void watchpoint::stopRingConsumer() {
+  consumeRingBuffers();
+  _ringStopped = true;
+}
+
+void watchpoint::printRingStatistics() {
+  // watchpoints closed after the consumer has stopped
+  reportPending();
+  fprintf(stderr, "ring buffer samples %lu, benign %lu, lost %lu\n", _ringSamples, _ringBenign, _ringLost);
+}
+#endif
+/* **************************** perf ring buffer consumer end ******************************* */
 
 /* **************************** SEGV signal handler ******************************* */
 #ifdef CATCH_SEGV
@@ -570,13 +912,13 @@ void watchpoint::segvHandler(int sig, siginfo_t* siginfo, void* context) {
 
   fprintf(stderr, "***Crash site: ip %p tries to access  memory address %p\n", ip, memaddr);
 
-  char buf[256];
+  char buf[PATH_MAX + 64];
   void* array[256];
   int frames = backtrace(array, 256);
   for(int i = 0; i < frames; i++) {
     if(selfmap::getInstance().isApplication(array[i])){
       void* addr = (void*)((unsigned long)array[i] - PREV_INSTRUCTION_OFFSET);
-      sprintf(buf, "addr2line -a -i -e %s %p", selfmap::getInstance().getMainName(), addr);
+      snprintf(buf, sizeof(buf), "addr2line -a -i -e %s %p", selfmap::getInstance().getMainName(), addr);
       system(buf);
     }
   }
@@ -28,6 +28,9 @@
 #include "threadstruct.hh"
 #include "selfmap.hh"
 
+// Print where an overflow happens, from frame it on, and where its object is allocated.
+void reportOverflow(bool isread, callstack* cs, void** array, int it, int frames);
+
 class watchpoint {
 
   public:
@@ -50,12 +53,17 @@ class watchpoint {
     // Enable a setof watch points now
     int enable_watchpoint(int fd);
     int disable_watchpoint(int fd);
+    int closeWatchpoint(watchpointObject* object, int index);
     bool disableWatchpoint(watchpointObject* object);
     bool disableWatchpointByAddr(void* addr);
+    void retireWatchpoint(watchpointObject* object);
 
     // How many watchpoints that we should care about.
     int getWatchpointsNumber() { return _numWatchpoints; }
 
+    // Whether this process may use hardware breakpoints at all.
+    bool isHardwareAvailable();
+
     // Handle those traps on watchpoints now.
     static void trapHandler(int sig, siginfo_t* siginfo, void* context);
 
@@ -63,8 +71,23 @@ class watchpoint {
     static void segvHandler(int sig, siginfo_t* siginfo, void* context);
 #endif
 
+#ifdef SAMPLE_RING_BUFFER
+    // Consume the samples that the kernel writes into the perf ring buffers.
+    void startRingConsumer();
+    void stopRingConsumer();
+    void printRingStatistics();
+#endif
+
   private:
     watchpoint() : _numWatchpoints(0) {
+#ifdef SAMPLE_RING_BUFFER
+      _ringStopped = false;
+      _ringSamples = 0;
+      _ringBenign = 0;
+      _ringLost = 0;
+      _ringPendingCount = 0;
+      pthread_spin_init(&_ringPendingLock, PTHREAD_PROCESS_PRIVATE);
+#endif
       // init watchpoint info
       for(int i=0; i<xdefines::MAX_WATCHPOINTS; i++){
         // set all watchpoint can be used 
@@ -95,10 +118,32 @@ class watchpoint {
     }
     ~watchpoint() {}
 
-    bool setWatchpoint(void* addr, int* fd);
+    bool setWatchpoint(void* addr, watchpointObject* obj);
     // Use perf_event_open to install a particular watch points.
     int install_watchpoint(uintptr_t address, pid_t pid, int cpuid, int sig, int group);
 
+#ifdef SAMPLE_RING_BUFFER
+    struct ringReport;
+    void* map_ringbuffer(int fd);
+    int drainRing(watchpointObject* obj, int index, ringReport* reports, int maxreports, bool* retire);
+    int drainRingBuffers(watchpointObject* obj, ringReport* reports, int maxreports);
+    void flushRing(watchpointObject* obj, int index);
+    void reportPending();
+    void consumeRingBuffers();
+    static void* ringConsumer(void* arg);
+
+    volatile bool _ringStopped;
+    unsigned long _ringSamples;
+    unsigned long _ringBenign;
+    unsigned long _ringLost;
+
+    // reports of closed watchpoints, made by the consumer without the locks
+    // of the closing thread
+    static ringReport _ringPending[];
+    int _ringPendingCount;
+    pthread_spinlock_t _ringPendingLock;
+#endif
+
     int _numWatchpoints;
     int curIndex;
     // Watchpoint array, we can only support 4 watchpoints totally.
@@ -0,0 +1,307 @@
+/*
+ * @file   whitelist.cpp
+ * @brief  Resolve benign code ranges from the mapped libc.
+ */
+
+#include "whitelist.hh"
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Routines that only read, and are allowed to read past the end of a string.
+// Variants such as __strlen_avx2 or __strcmp_sse42 are matched by prefix
+// after the leading underscores are stripped, so every name here and every
+// name it is a prefix of must be a routine that does not write.
+static const char* benignRoutines[] = {
+  "strlen", "strnlen", "strcmp", "strncmp", "strcasecmp", "strncasecmp",
+  "strchr", "strrchr", "memchr", "memrchr", "rawmemchr",
+  "strstr", "strcasestr", "strspn", "strcspn", "strpbrk",
+  "wcslen", "wcsnlen", "wcscmp", "wcschr",
+  NULL
+};
+
+// Routines that read past the end of a string, but also write: the copies,
+// with their __*_chk variants, vfprintf into its stream buffer and the
+// *stat family, which newer glibc implements with fstatat, into the
+// caller's struct stat.
+static const char* writingRoutines[] = {
+  "strcat", "strncat", "strcpy", "stpcpy", "strncpy", "stpncpy",
+  "vfprintf", "IO_vfprintf", "lxstat", "xstat", "fxstat", "fstatat",
+  NULL
+};
+
+// Exported entry points, used when libc has no .symtab.
+static const char* benignSymbols[] = {
+  "strlen", "strnlen", "strcmp", "strncmp", "strcasecmp", "strncasecmp",
+  "strchr", "strchrnul", "strrchr", "memchr", "memrchr", "rawmemchr",
+  "strstr", "strcasestr", "strspn", "strcspn", "strpbrk",
+  "wcslen", "wcsnlen", "wcscmp", "wcschr",
+  NULL
+};
+
+static const char* writingSymbols[] = {
+  "strcat", "strncat", "strcpy", "stpcpy", "strncpy", "stpncpy",
+  "__strcat_chk", "__strncat_chk", "__strcpy_chk", "__stpcpy_chk",
+  "__strncpy_chk", "__stpncpy_chk",
+  "vfprintf", "_IO_vfprintf", "__lxstat", "__lxstat64", "__xstat", "__xstat64",
+  "__fxstat", "__fxstat64", "__fxstatat", "__fxstatat64", "fstatat", "fstatat64",
+  NULL
+};
+
+static bool matchesPrefix(const char* name, const char** routines) {
+  for(int i = 0; routines[i] != NULL; i++) {
+    size_t len = strlen(routines[i]);
+    if(strncmp(name, routines[i], len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int getRoutineKind(const char* name) {
+  while(*name == '_') name++;
+  if(matchesPrefix(name, benignRoutines)) {
+    return WHITELIST_ANY;
+  } else if(matchesPrefix(name, writingRoutines)) {
+    return WHITELIST_READS;
+  }
+  return WHITELIST_NONE;
+}
+
+struct moduleinfo {
+  const char* name;
+  uintptr_t base;
+  uintptr_t textstart;
+  uintptr_t textend;
+  uintptr_t ehframehdr;
+};
+
+struct libraryinfo {
+  moduleinfo libc;
+  moduleinfo ld;
+};
+
+static void fillModuleInfo(struct dl_phdr_info* info, moduleinfo* m) {
+  m->name = info->dlpi_name;
+  m->base = info->dlpi_addr;
+  for(int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if(phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+      m->textstart = info->dlpi_addr + phdr->p_vaddr;
+      m->textend = m->textstart + phdr->p_memsz - 1;
+    } else if(phdr->p_type == PT_GNU_EH_FRAME) {
+      m->ehframehdr = info->dlpi_addr + phdr->p_vaddr;
+    }
+  }
+}
+
+static int findLibraries(struct dl_phdr_info* info, size_t, void* data) {
+  libraryinfo* libs = (libraryinfo*)data;
+  const char* name = info->dlpi_name;
+  if(name == NULL || name[0] == '\0') {
+    return 0;
+  }
+  if(strstr(name, "/libc.so") != NULL || strstr(name, "/libc-") != NULL) {
+    fillModuleInfo(info, &libs->libc);
+  } else if(strstr(name, "/ld-linux") != NULL) {
+    fillModuleInfo(info, &libs->ld);
+  }
+  return 0;
+}
+
+// Find the function containing pc from the binary search table of .eh_frame_hdr.
+// Only the encoding emitted by gcc and clang on x86_64 is supported.
+static bool lookupFunctionRange(uintptr_t ehframehdr, uintptr_t pc, uintptr_t* start, uintptr_t* end) {
+  const uint8_t* hdr = (const uint8_t*)ehframehdr;
+  if(hdr == NULL || hdr[0] != 1 || hdr[1] != 0x1b || hdr[2] != 0x03 || hdr[3] != 0x3b) {
+    return false;
+  }
+  uint32_t count = *(const uint32_t*)(hdr + 8);
+  const int32_t* table = (const int32_t*)(hdr + 12);
+
+  uint32_t low = 0, high = count;
+  while(low < high) {
+    uint32_t mid = (low + high) >> 1;
+    if(ehframehdr + table[mid * 2] <= pc) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if(low == 0) {
+    return false;
+  }
+
+  uintptr_t fstart = ehframehdr + table[(low - 1) * 2];
+  const uint8_t* fde = (const uint8_t*)(ehframehdr + table[(low - 1) * 2 + 1]);
+  // FDE: length, CIE pointer, pc_begin (pcrel sdata4), pc_range (sdata4)
+  uintptr_t pcbegin = (uintptr_t)(fde + 8) + *(const int32_t*)(fde + 8);
+  if(pcbegin != fstart) {
+    return false;
+  }
+  uintptr_t fend = fstart + *(const uint32_t*)(fde + 12);
+  if(pc >= fend) {
+    return false;
+  }
+  *start = fstart;
+  *end = fend - 1;
+  return true;
+}
+
+void whitelist::addRange(uintptr_t start, uintptr_t end, int kind) {
+  if(_numRanges >= xdefines::MAX_WHITELIST_RANGES) {
+    fprintf(stderr, "Too many benign ranges, ignore %lx-%lx\n", start, end);
+    return;
+  }
+  _ranges[_numRanges].start = start;
+  _ranges[_numRanges].end = end;
+  _ranges[_numRanges].kind = kind;
+  _numRanges++;
+}
+
+// Use the full symbol table when libc is not stripped, which covers every
+// ifunc variant (sse2, avx2, evex...) instead of only the selected one.
+bool whitelist::addSymbolTable(const char* file, uintptr_t base) {
+  int fd = open(file, O_RDONLY);
+  if(fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1) {
+    close(fd);
+    return false;
+  }
+  void* image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(image == MAP_FAILED) {
+    return false;
+  }
+
+  bool found = false;
+  const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)image;
+  if(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0 && ehdr->e_shoff != 0) {
+    const ElfW(Shdr)* shdrs = (const ElfW(Shdr)*)((char*)image + ehdr->e_shoff);
+    for(int i = 0; i < ehdr->e_shnum; i++) {
+      if(shdrs[i].sh_type != SHT_SYMTAB) {
+        continue;
+      }
+      found = true;
+      const ElfW(Shdr)* strtab = &shdrs[shdrs[i].sh_link];
+      const char* strings = (const char*)image + strtab->sh_offset;
+      const ElfW(Sym)* syms = (const ElfW(Sym)*)((char*)image + shdrs[i].sh_offset);
+      size_t nsyms = shdrs[i].sh_size / sizeof(ElfW(Sym));
+      for(size_t j = 0; j < nsyms; j++) {
+        if(ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC || syms[j].st_size == 0) {
+          continue;
+        }
+        int kind = getRoutineKind(strings + syms[j].st_name);
+        if(kind != WHITELIST_NONE) {
+          addRange(base + syms[j].st_value, base + syms[j].st_value + syms[j].st_size - 1, kind);
+        }
+      }
+    }
+  }
+
+  munmap(image, st.st_size);
+  return found;
+}
+
+// Stripped libc: let the dynamic linker resolve every ifunc to the variant
+// selected for this cpu and take its extent from the unwind table.
+void whitelist::addResolvedSymbols(const char* file, uintptr_t ehframehdr) {
+  void* handle = dlopen(file, RTLD_LAZY | RTLD_NOLOAD);
+  if(handle == NULL) {
+    return;
+  }
+  addResolvedRanges(handle, ehframehdr, benignSymbols, WHITELIST_ANY);
+  addResolvedRanges(handle, ehframehdr, writingSymbols, WHITELIST_READS);
+  dlclose(handle);
+}
+
+void whitelist::addResolvedRanges(void* handle, uintptr_t ehframehdr, const char** symbols, int kind) {
+  for(int i = 0; symbols[i] != NULL; i++) {
+    void* addr = dlsym(handle, symbols[i]);
+    if(addr == NULL) {
+      continue;
+    }
+
+    uintptr_t start, end;
+    Dl_info info;
+    const ElfW(Sym)* sym = NULL;
+    if(lookupFunctionRange(ehframehdr, (uintptr_t)addr, &start, &end)) {
+      addRange(start, end, kind);
+    } else if(dladdr1(addr, &info, (void**)&sym, RTLD_DL_SYMENT) && sym != NULL
+        && info.dli_saddr == addr && sym->st_size != 0) {
+      addRange((uintptr_t)addr, (uintptr_t)addr + sym->st_size - 1, kind);
+    }
+  }
+}
+
+void whitelist::sortRanges() {
+  // insertion sort, the table is small and qsort may allocate
+  for(int i = 1; i < _numRanges; i++) {
+    coderange r = _ranges[i];
+    int j = i - 1;
+    while(j >= 0 && _ranges[j].start > r.start) {
+      _ranges[j + 1] = _ranges[j];
+      j--;
+    }
+    _ranges[j + 1] = r;
+  }
+
+  // merge overlapped ranges so that the binary search is exact, code shared
+  // with a routine that writes only has its reads benign
+  int n = 0;
+  for(int i = 0; i < _numRanges; i++) {
+    coderange* last = n > 0 ? &_ranges[n - 1] : NULL;
+    if(last != NULL && (_ranges[i].start <= last->end
+          || (_ranges[i].start == last->end + 1 && _ranges[i].kind == last->kind))) {
+      if(_ranges[i].end > last->end) {
+        last->end = _ranges[i].end;
+      }
+      if(_ranges[i].kind == WHITELIST_READS) {
+        last->kind = WHITELIST_READS;
+      }
+    } else {
+      _ranges[n++] = _ranges[i];
+    }
+  }
+  _numRanges = n;
+}
+
+void whitelist::initialize() {
+  _numRanges = 0;
+
+  libraryinfo libs;
+  memset(&libs, 0, sizeof(libs));
+  dl_iterate_phdr(findLibraries, &libs);
+
+  // the dynamic linker is benign as a whole
+  if(libs.ld.textstart != 0) {
+    addRange(libs.ld.textstart, libs.ld.textend, WHITELIST_ANY);
+  }
+
+  if(libs.libc.name != NULL) {
+    if(!addSymbolTable(libs.libc.name, libs.libc.base)) {
+      addResolvedSymbols(libs.libc.name, libs.libc.ehframehdr);
+    }
+  } else {
+    fprintf(stderr, "Couldn't find libc, no benign ranges for string routines\n");
+  }
+
+  sortRanges();
+
+  // signal frames have the libc restorer as return address
+  struct sigaction act;
+  if(sigaction(WP_SIGNAL, NULL, &act) == 0) {
+    _restorer = (uintptr_t)act.sa_restorer;
+  }
+}
@@ -0,0 +1,98 @@
+#if !defined(_WHITELIST_H)
+#define _WHITELIST_H
+
+/*
+ * @file   whitelist.hh
+ * @brief  Code ranges whose accesses on a watched sentinel are benign.
+ *
+ * Vectorized libc string routines read whole words past the terminator,
+ * which touches our tail sentinel without being a real overflow. Instead
+ * of hardcoding offsets of one particular libc build, the ranges are
+ * resolved from the symbol tables of the libc that is actually mapped
+ * and kept in a sorted array, so that the trap handler can query them
+ * with a binary search that never allocates. Routines that copy strings,
+ * format into a stream or fill a struct stat write too, only their reads
+ * are benign.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <new>
+
+#include "xdefines.hh"
+
+// Which accesses from a code range are benign.
+enum {
+  WHITELIST_NONE = 0,
+  WHITELIST_ANY,
+  WHITELIST_READS
+};
+
+class whitelist {
+
+  public:
+    static whitelist& getInstance() {
+      static char buf[sizeof(whitelist)];
+      static whitelist* theOneTrueObject = new (buf) whitelist();
+      return *theOneTrueObject;
+    }
+
+    // Resolve all ranges, should be called before watching begins.
+    void initialize();
+
+    // Whether any access from pcaddr on a watched address is benign.
+    bool isBenign(void* pcaddr) {
+      return getKind(pcaddr) == WHITELIST_ANY;
+    }
+
+    // WHITELIST_READS if only a read from pcaddr is benign.
+    int getKind(void* pcaddr) {
+      uintptr_t pc = (uintptr_t)pcaddr;
+      int low = 0;
+      int high = _numRanges;
+      // find the last range whose start is not larger than pc
+      while(low < high) {
+        int mid = (low + high) >> 1;
+        if(_ranges[mid].start <= pc) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      if(low > 0 && pc <= _ranges[low - 1].end) {
+        return _ranges[low - 1].kind;
+      }
+      return WHITELIST_NONE;
+    }
+
+    // Whether pcaddr is the signal return trampoline installed by libc.
+    bool isSignalTrampoline(void* pcaddr) {
+      return (uintptr_t)pcaddr - (_restorer - 1) <= 16;
+    }
+
+    int getRangesNumber() { return _numRanges; }
+
+  private:
+    whitelist() : _numRanges(0), _restorer(0) {}
+    ~whitelist() {}
+
+    struct coderange {
+      uintptr_t start;
+      uintptr_t end; // inclusive
+      int kind;
+    };
+
+    void addRange(uintptr_t start, uintptr_t end, int kind);
+    bool addSymbolTable(const char* file, uintptr_t base);
+    void addResolvedSymbols(const char* file, uintptr_t ehframehdr);
+    void addResolvedRanges(void* handle, uintptr_t ehframehdr, const char** symbols, int kind);
+    void sortRanges();
+
+    int _numRanges;
+    uintptr_t _restorer;
+    coderange _ranges[xdefines::MAX_WHITELIST_RANGES];
+};
+
+#endif
@@ -56,6 +56,12 @@ inline void releaseGlobalLock() {
   pthread_rwlock_unlock(&rwlock); 
 }
 
+inline unsigned long rdtsc() {
+  unsigned int lo, hi;
+  asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((unsigned long)lo) | (((unsigned long)hi) << 32);
+}
+
 inline unsigned long rdtscp() {
   unsigned int lo, hi;
   asm volatile (
@@ -75,7 +81,6 @@ class xdefines {
 
     enum { MAX_WATCHPOINTS = 4 };
     enum { MAX_CPU_NUM = 32 };
-    enum { WP_SEARCH_INDEX_MASK = MAX_WATCHPOINTS - 1 };
 
     enum { CALLSTACK_MAP_SIZE = 0x80000 };
     enum { MAX_CALLSTACK_SKIP_TOP = 4 };
@@ -83,6 +88,7 @@ class xdefines {
     //enum { MAX_CALLSTACK_DEPTH = MAX_CALLSTACK_SKIP_TOP + MAX_CALLSTACK_SKIP_BOTTOM + 1 };
     enum { MAX_CALLSTACK_DEPTH = MAX_CALLSTACK_SKIP_TOP + MAX_CALLSTACK_SKIP_BOTTOM + 10 };
 
+    // defaults of the values in tunables, see config.hh
     enum { MAX_WATCH_RATIO_UPPERBOUND = 10000 };
     enum { MAX_WATCH_RATIO_SECOND_UPPERBOUND = 100000 };
     enum { MAX_WATCH_THRESHOLD = 5000 };
@@ -100,6 +106,7 @@ class xdefines {
     enum { WP_INSTALL_MIN_TIME = 1 }; // ms
     enum { WP_PREEMPT_WEIGHT = 2 };
     enum { WP_PREEMPT_TIME_REDUCTION_BASE = 10000 }; // ms
+    enum { HISTORY_BOOST = 100 }; // percent
    
     enum { SENTINEL_SIZE = sizeof(size_t) }; 
     enum { SENTINEL_HEAD_WORD = 0xCAFEBABECAFEBABE };
@@ -107,6 +114,94 @@ class xdefines {
     enum { SENTINEL_MAGIC_WORD = 0xABEFACECABEFACEC };
 
     enum { ALLOCATION_MASK = 0xFFFFFFFFFFFFFFF8 };
+
+    // benign code ranges resolved from libc symbols
+    enum { MAX_WHITELIST_RANGES = 512 };
+
+    // unique (fault ip, callsite) pairs to remember, must be power of 2
+    enum { MAX_TRAP_RECORDS = 1024 };
+    // hits of the same pair before its watchpoint is retired
+    enum { MAX_TRAP_REPEAT = 100 };
+
+    // how often the consumer drains the perf ring buffers
+    enum { RING_POLL_INTERVAL = 10 }; // ms
+    enum { MAX_RING_REPORTS = 16 };
+
+    // default seconds between history checkpoints, 0 disables them
+    enum { CHECKPOINT_INTERVAL = 10 };
+
+    // slots of the shared callsite table, must be power of 2
+    enum { SHARED_TABLE_SLOTS = 0x10000 };
+    enum { SHARED_TABLE_PROBES = 64 };
+    // watches by other processes applied at once
+    enum { MAX_SHARED_REDUCTIONS = 16 };
+
+    // integrity check in the end, chunk size must be multiple of PAGE_SIZE
+    enum { SCAN_CHUNK_SIZE = 64UL * 1024 * 1024 };
+    enum { MAX_SCAN_THREADS = 16 };
+    enum { PAGEMAP_BATCH = 512 };
+
+    // address space reserved for the object registry, in pages
+    enum { REGISTRY_MAX_CHUNKS = 1024UL * 1024 };
+
+    // background verifier, default budget is VERIFY_BUDGET us of every VERIFY_PERIOD us
+    enum { VERIFY_PERIOD = 1000 };
+    enum { VERIFY_BUDGET = 50 };
+    enum { VERIFY_BATCH = 64 };         // objects checked between clock reads
+    enum { VERIFY_PASS_PAUSE = 100000 }; // us after a pass over all objects
+
+    // per-thread quarantine of freed objects, entries must be power of 2
+    enum { QUARANTINE_ENTRIES = 256 };
+    enum { QUARANTINE_BYTES = 256 * 1024 };
+    enum { QUARANTINE_BATCH = 32 };
+    enum { QUARANTINE_MAX_OBJECT = 16 * 1024 }; // larger objects are freed at once
+    enum { QUARANTINE_FILL_BYTE = 0xFD };
+
+    // live allocations by page, must be power of 2
+    enum { OBJECT_MAP_ENTRIES = 1024 * 1024 };
+    // bounds of the search for the object in front of a corrupted head
+    enum { OBJECT_MAP_PAGES = 16 };
+    enum { MAX_CHUNK_WALK = 1024 };
+    enum { MAX_GUARD_OFFSET = 4096 }; // bytes, for memalign
+
+    // page tables of the software bounds check, mapped per region of the
+    // 48-bit address space; guarded objects start 16-byte aligned
+    enum { BOUNDS_REGION_SHIFT = 30 };
+    enum { BOUNDS_REGIONS = 1UL << (48 - BOUNDS_REGION_SHIFT) };
+    enum { BOUNDS_REGION_PAGES = (1UL << BOUNDS_REGION_SHIFT) / PAGE_SIZE };
+    enum { BOUNDS_GRANULE = 16 };
+
+    // table of text ranges of loaded modules
+    enum { MAX_TEXT_RANGES = 1024 };
+    enum { MAX_TEXT_MODULES = 1024 };
+    enum { TEXT_NAMES_SIZE = 128 * 1024 };
+
+    // buffer of mapsreader, on the stack, must hold at least one line
+    enum { MAPS_BUFFER_SIZE = 16 * 1024 };
+
+    // the config file is read at once into a buffer on the stack
+    enum { CONFIG_FILE_SIZE = 8 * 1024 };
+
+    // overhead governor, sampling is scaled by a fraction of GOVERNOR_SCALE_ONE
+    enum { OVERHEAD_TARGET = 300 }; // basis points of the CPU time
+    enum { GOVERNOR_EPOCH = 100 };  // ms
+    enum { GOVERNOR_FLUSH_CYCLES = 1 << 18 };
+    enum { GOVERNOR_SAMPLE_PERIOD = 16 }; // must be power of 2
+    enum { GOVERNOR_SCALE_ONE = 1024 };
+    enum { GOVERNOR_MIN_SCALE = 1 };
+
+    // allocations counted per thread before they are added to the live stats
+    enum { STATS_FLUSH_ALLOCATIONS = 64 };
+
+    // phase durations recorded per thread before they are added to the total
+    enum { PHASE_FLUSH_SAMPLES = 4096 };
+
+    // events in each trace buffer, and buffers at most, written or not
+    enum { TRACE_BUFFER_EVENTS = 4096 };
+    enum { TRACE_MAX_BUFFERS = 1024 };
+    enum { TRACE_MAX_CALLSITES = 1 << 20 };
+    // how often the writer appends full buffers to the trace
+    enum { TRACE_WRITE_INTERVAL = 100 }; // ms
 };
 
 typedef enum {
@@ -131,6 +226,9 @@ typedef struct watchpointsInfo {
   pthread_spinlock_t lock;
 
   int fd[xdefines::MAX_ALIVE_THREADS];
+#ifdef SAMPLE_RING_BUFFER
+  void* ring[xdefines::MAX_ALIVE_THREADS];
+#endif
 }watchpointObject;
 
 struct callstack {
@@ -148,6 +246,22 @@ struct callstack {
   size_t hashcode;
   void* stack[xdefines::MAX_CALLSTACK_DEPTH];
 
+  // bumped on every update, compared with savedVersion by the checkpointer
+  unsigned long version;
+  unsigned long savedVersion;
+  long snapshot;
+
+#ifdef SHARED_CALLSITE_TABLE
+  // slot in the shared table, NULL if not looked up yet
+  struct sharedCallsite* shared;
+  // value of shared->watched already applied to watchedRatio
+  unsigned int sharedWatched;
+#endif
+#ifdef ALLOC_TRACE
+  // id in the allocation trace, 0 until the callsite is first traced
+  unsigned int traceId;
+#endif
+
   pthread_spinlock_t lock;
 
   /*  assign operator */
@@ -166,6 +280,16 @@ struct callstack {
       index = cs.index;
 #endif
       memcpy(&stack, &cs.stack, xdefines::MAX_CALLSTACK_DEPTH * sizeof(void*));
+      version = cs.version;
+      savedVersion = cs.savedVersion;
+      snapshot = cs.snapshot;
+#ifdef SHARED_CALLSITE_TABLE
+      shared = cs.shared;
+      sharedWatched = cs.sharedWatched;
+#endif
+#ifdef ALLOC_TRACE
+      traceId = cs.traceId;
+#endif
     }
     return *this;
   }
@@ -12,6 +12,17 @@
 #include "real.hh"
 #include "xdefines.hh"
 #include "watchpoint.hh"
+#ifdef ENABLE_OBJECT_REGISTRY
+#include "registry.hh"
+#endif
+#ifdef QUARANTINE
+#include "quarantine.hh"
+#endif
+#include "phases.hh"
+#include "tracer.hh"
+#ifdef VECTOR_STRINGS
+#include "vstring.hh"
+#endif
 
 class xthread {
 
@@ -59,6 +70,10 @@ class xthread {
         thread = &_threads[i];
         thread->available = true;
         thread->index = i;
+#ifdef ALLOC_TRACE
+        // the buffers hold events of the parent, which writes them
+        memset(&thread->trace, 0, sizeof(thread->trace));
+#endif
       }
 
       initializeInitialThread();
@@ -93,6 +108,9 @@ class xthread {
     void initializeCurrentThread(thread_t * thread) {
       thread->tid = syscall(__NR_gettid);
       thread->startFrame = (char *)__builtin_frame_address(0); 
+#ifdef VECTOR_STRINGS
+      thread->scan = &currentScan;
+#endif
     }
 
     /// @ internal function: allocation a thread index when spawning.
@@ -133,15 +151,27 @@ class xthread {
     inline thread_t* getThread(pthread_t thread);
 
     void threadExit(thread_t * thread) {
+#ifdef QUARANTINE
+      quarantine::getInstance().drain(thread);
+#endif
+#ifdef PHASE_ACCOUNTING
+      phases::getInstance().flush(&thread->phases);
+#endif
+#ifdef ALLOC_TRACE
+      tracer::getInstance().flushThread(&thread->trace);
+#endif
       acquireGlobalWLock();
 
       // remove watchpoint 
       watchpointObject* wp = watchpoint::getInstance().getAllWatchpointObjects();
       for(int i=0; i<xdefines::MAX_WATCHPOINTS; i++){
-        watchpoint::getInstance().disable_watchpoint(wp[i].fd[thread->index]);
+        watchpoint::getInstance().closeWatchpoint(&wp[i], thread->index);
       }
 
       thread->available = true;
+#ifdef ENABLE_OBJECT_REGISTRY
+      registry::getInstance().releaseThread();
+#endif
       // Remove the current thread from alive threads list so that I won't receive 
       // signal from now on since I have exited.
       listRemoveNode(&thread->listentry);
@@ -0,0 +1,197 @@
+/*
+ * @file   causerstat.cpp
+ * @brief  Print the live statistics of processes running with LIVE_STATS.
+ *
+ * The segment is mapped read-only, the process is neither stopped nor
+ * slowed down while it is read.
+ *
+ * Usage: causerstat                   list the processes that publish stats
+ *        causerstat -r                remove the segments of exited processes
+ *        causerstat <pid> [seconds]   print the stats of pid, again every seconds
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../source/statsformat.hh"
+
+static bool isAlive(long pid) {
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static unsigned long getCurrentTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Map the segment of pid, NULL if there is none of this version.
+static const statsSegment* mapSegment(long pid) {
+  char name[NAME_MAX];
+  snprintf(name, sizeof(name), "%s%ld", STATS_NAME_PREFIX, pid);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd == -1) {
+    fprintf(stderr, "No live stats for process %ld: %s\n", pid, strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(statsSegment)) {
+    fprintf(stderr, "Live stats of process %ld are incomplete\n", pid);
+    close(fd);
+    return NULL;
+  }
+  void* ptr = mmap(NULL, sizeof(statsSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(ptr == MAP_FAILED) {
+    fprintf(stderr, "Failed to map live stats of process %ld: %s\n", pid, strerror(errno));
+    return NULL;
+  }
+
+  const statsSegment* seg = (const statsSegment*)ptr;
+  if(__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != (uint64_t)STATS_MAGIC
+      || seg->version != STATS_VERSION || seg->size != sizeof(statsSegment)) {
+    fprintf(stderr, "Live stats of process %ld are not of version %d\n", pid, STATS_VERSION);
+    munmap(ptr, sizeof(statsSegment));
+    return NULL;
+  }
+  return seg;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0.0 : part * 100.0 / whole;
+}
+
+static void printSegment(const statsSegment* s) {
+  const statsCounters* c = &s->counters;
+  unsigned long now = getCurrentTime();
+
+  printf("process %ld, up %.1fs, last change %.1fs ago%s\n", (long)s->pid,
+      (now - s->startTime) / 1000.0, (now - s->updateTime) / 1000.0, isAlive(s->pid) ? "" : ", exited");
+  printf("  allocations %lu, sampled %lu (%.2f%%)\n",
+      (unsigned long)c->allocations, (unsigned long)c->sampled, percent(c->sampled, c->allocations));
+  printf("  installs %lu, preemptions %lu, removals %lu\n",
+      (unsigned long)c->installs, (unsigned long)c->preemptions, (unsigned long)c->removals);
+  printf("  traps %lu benign, %lu real\n", (unsigned long)c->benignTraps, (unsigned long)c->realTraps);
+  printf("  syscalls %lu, %.3fms, %.2fus each\n", (unsigned long)c->syscalls, c->syscallNs / 1e6,
+      c->syscalls == 0 ? 0.0 : c->syscallNs / 1e3 / c->syscalls);
+  if(c->governorScaleOne != 0) {
+    printf("  governor scale %u/%u, last epoch %lu.%02lu%%, %lu epochs\n", c->governorScale, c->governorScaleOne,
+        (unsigned long)c->governorOverhead / 100, (unsigned long)c->governorOverhead % 100, (unsigned long)c->governorEpochs);
+  }
+
+  printf("  slot  %-18s %-18s %10s %-18s %10s %10s\n", "address", "object", "size", "callsite", "age(ms)", "hits");
+  for(int i = 0; i < STATS_MAX_SLOTS; i++) {
+    const statsSlot* slot = &s->slots[i];
+    if(!slot->used) {
+      printf("  %4d  -\n", i);
+      continue;
+    }
+    printf("  %4d  0x%-16lx 0x%-16lx %10lu 0x%-16lx %10lu %10lu\n", i, (unsigned long)slot->addr,
+        (unsigned long)slot->objectStart, (unsigned long)slot->objectSize, (unsigned long)slot->callsite,
+        now - slot->installTime, (unsigned long)slot->hits);
+  }
+
+  printf("  %-18s %-32s %10s %10s %6s\n", "callsite", "module+offset", "called", "watched", "ratio");
+  for(unsigned int i = 0; i < s->ncallsites && i < STATS_TOP_CALLSITES; i++) {
+    const statsCallsite* cs = &s->callsites[i];
+    char where[STATS_MODULE_NAME + 24];
+    if(cs->module[0] != '\0') {
+      snprintf(where, sizeof(where), "%s+0x%lx", cs->module, (unsigned long)cs->moduleOffset);
+    } else {
+      snprintf(where, sizeof(where), "?");
+    }
+    printf("  0x%-16lx %-32s %10ld %10ld %6d%s\n", (unsigned long)cs->pc, where,
+        (long)cs->calledCounter, (long)cs->watchedCounter, cs->watchedRatio, cs->confirmed ? "  confirmed" : "");
+  }
+
+  // only with PHASE_ACCOUNTING, percentiles are bounds of power of 2 buckets
+  const phaseHistogram* h = &s->phases;
+  bool header = false;
+  for(int p = 0; p < PHASES; p++) {
+    uint64_t calls = phaseCalls(h, p);
+    if(calls == 0) {
+      continue;
+    }
+    if(!header) {
+      printf("  %-14s %12s %10s %10s %10s %10s  (cycles)\n", "phase", "calls", "mean", "p50<=", "p90<=", "p99<=");
+      header = true;
+    }
+    printf("  %-14s %12lu %10lu %10lu %10lu %10lu\n", phaseNames[p], (unsigned long)calls,
+        (unsigned long)(h->cycles[p] / calls), (unsigned long)phasePercentile(h, p, 0.5),
+        (unsigned long)phasePercentile(h, p, 0.9), (unsigned long)phasePercentile(h, p, 0.99));
+  }
+}
+
+// List the segments in /dev/shm, or remove those of processes that exited.
+static int listSegments(bool removeStale) {
+  DIR* dir = opendir("/dev/shm");
+  if(dir == NULL) {
+    fprintf(stderr, "Failed to open /dev/shm: %s\n", strerror(errno));
+    return 1;
+  }
+  const char* prefix = STATS_NAME_PREFIX + 1;
+  size_t len = strlen(prefix);
+  struct dirent* entry;
+  while((entry = readdir(dir)) != NULL) {
+    if(strncmp(entry->d_name, prefix, len) != 0) {
+      continue;
+    }
+    long pid = strtol(entry->d_name + len, NULL, 10);
+    bool alive = pid > 0 && isAlive(pid);
+    if(removeStale) {
+      if(!alive) {
+        char name[NAME_MAX + 2];
+        snprintf(name, sizeof(name), "/%s", entry->d_name);
+        if(shm_unlink(name) == 0) {
+          printf("removed %s\n", entry->d_name);
+        } else {
+          fprintf(stderr, "Failed to remove %s: %s\n", entry->d_name, strerror(errno));
+        }
+      }
+    } else {
+      printf("%ld%s\n", pid, alive ? "" : " (exited)");
+    }
+  }
+  closedir(dir);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc == 1 || (argc == 2 && strcmp(argv[1], "-r") == 0)) {
+    return listSegments(argc == 2);
+  }
+  if(argc > 3 || argv[1][0] == '-') {
+    fprintf(stderr, "Usage: %s [-r | <pid> [seconds]]\n", argv[0]);
+    return 1;
+  }
+
+  long pid = strtol(argv[1], NULL, 10);
+  double interval = argc == 3 ? atof(argv[2]) : 0;
+  const statsSegment* seg = mapSegment(pid);
+  if(seg == NULL) {
+    return 1;
+  }
+
+  statsSegment snapshot;
+  while(true) {
+    statsSnapshot(seg, &snapshot);
+    printSegment(&snapshot);
+    if(interval <= 0 || !isAlive(pid)) {
+      break;
+    }
+    fflush(stdout);
+    usleep((useconds_t)(interval * 1000000));
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * @file   mergehistory.cpp
+ * @brief  Combine callsite history files offline, e.g. those saved by
+ *         parallel test shards, with the same policy as MERGE_HISTORY.
+ *
+ * Usage: mergehistory <output> <input>...
+ */
+
+#include <stdio.h>
+
+#include "../source/history.hh"
+
+int main(int argc, char** argv) {
+  if(argc < 3) {
+    fprintf(stderr, "Usage: %s <output> <input>...\n", argv[0]);
+    return 1;
+  }
+
+  historywriter writer;
+  for(int i = 2; i < argc; i++) {
+    historyfile history;
+    if(!history.map(argv[i])) {
+      fprintf(stderr, "%s is not a binary history file of version %d, skip it\n", argv[i], HISTORY_VERSION);
+      continue;
+    }
+    if(!writer.merge(history)) {
+      fprintf(stderr, "Out of memory when merging %s\n", argv[i]);
+      return 1;
+    }
+    fprintf(stderr, "merged %s, %u records\n", argv[i], history.getRecordsNumber());
+  }
+
+  int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || !writer.write(fd)) {
+    fprintf(stderr, "Failed to write %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  close(fd);
+  fprintf(stderr, "wrote %s, %zu callsites\n", argv[1], writer.getRecordsNumber());
+  return 0;
+}
@@ -0,0 +1,438 @@
+/*
+ * @file   policysim.cpp
+ * @brief  Replay an allocation trace against the watchpoint policy, without watchpoints.
+ *
+ * The trace is recorded by a library built with ALLOC_TRACE. Its events are
+ * merged by time and every allocation goes through the same decisions as in
+ * causer::startWatch and watchpoint::setWatchpoint, made by policy.hh, with
+ * slots that are only bookkeeping. The draws come from a seeded generator,
+ * so a seed and a trace always give the same result. Tuning is read from
+ * CAUSER_CONFIG and CAUSER_* as in the library; OVERHEAD_GOVERNOR is not
+ * simulated.
+ *
+ * The estimated overhead adds a cost for every allocation that is sampled
+ * and for installing or removing a watchpoint in every thread seen so far.
+ * The defaults are rough; causerstat shows the syscall time per install of
+ * a real run, and benchmarks/allocpaths the cost of sampling.
+ *
+ * usage: policysim [-s seed] [-n callsites] [-P] [-i install ns] [-r remove ns]
+ *                  [-a sample ns] <trace>
+ *        -P   without PREEMPT_REPLACEMENT, only free slots are taken
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../source/traceformat.hh"
+#include "../source/policy.hh"
+
+#define DEFAULT_INSTALL_NS 5000   // perf_event_open, fcntl and ioctl, per thread
+#define DEFAULT_REMOVE_NS 2000    // ioctl and close, per thread
+#define DEFAULT_SAMPLE_NS 60      // callsite key, lookup and update
+
+struct simEvent {
+  uint64_t tsc;
+  uint64_t addr;
+  uint32_t size;
+  uint32_t callsite;
+  uint16_t thread;
+  uint8_t op;
+};
+
+// The fields policy.hh uses have the names they have in callstack.
+struct simCallsite {
+  int watchedRatio;
+  unsigned long calledCounter;
+  unsigned long watchedCounter;
+  unsigned long periodcalled;
+  unsigned long period;
+
+  uint32_t id;
+  uint32_t module;
+  uint64_t pc;
+  unsigned long slotNs;   // time it held a slot
+};
+
+struct simSlot {
+  bool used;
+  uint64_t objectStart;
+  simCallsite* cs;
+  unsigned long installTime;  // ms, as getCurrentTime in the library
+  uint64_t installNs;
+  unsigned long installs;
+  unsigned long preemptions;
+  uint64_t usedNs;
+};
+
+struct simTrace {
+  std::vector<simEvent> events;
+  std::map<uint32_t, std::string> modules;
+  std::map<uint32_t, simCallsite> callsites;
+  traceHeader header;
+  traceEnd end;
+  bool hasEnd;
+};
+
+static uint64_t rngState;
+
+static uint64_t rng() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 7;
+  rngState ^= rngState << 17;
+  return rngState;
+}
+
+static bool readAll(FILE* f, void* buf, size_t size) {
+  return fread(buf, 1, size, f) == size;
+}
+
+static bool readTrace(const char* path, simTrace* t) {
+  FILE* f = fopen(path, "rb");
+  if(f == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  if(!readAll(f, &t->header, sizeof(traceHeader)) || t->header.magic != TRACE_MAGIC
+      || t->header.version != TRACE_VERSION) {
+    fprintf(stderr, "%s is not a trace of version %d\n", path, TRACE_VERSION);
+    fclose(f);
+    return false;
+  }
+
+  t->hasEnd = false;
+  traceBlock block;
+  std::vector<traceEvent> events;
+  while(readAll(f, &block, sizeof(block))) {
+    bool ok = true;
+    if(block.type == TRACE_BLOCK_EVENTS) {
+      events.resize(block.count);
+      ok = readAll(f, events.data(), block.count * sizeof(traceEvent));
+      uint64_t tsc = block.baseTsc;
+      for(uint32_t i = 0; ok && i < block.count; i++) {
+        const traceEvent* e = &events[i];
+        tsc += e->delta;
+        simEvent s = { tsc, e->addr, e->size, e->callsite, e->thread, e->op };
+        t->events.push_back(s);
+      }
+    } else if(block.type == TRACE_BLOCK_MODULES) {
+      for(uint32_t i = 0; ok && i < block.count; i++) {
+        traceModule m;
+        ok = readAll(f, &m, sizeof(m));
+        m.name[TRACE_MODULE_NAME - 1] = '\0';
+        t->modules[m.id] = m.name;
+      }
+    } else if(block.type == TRACE_BLOCK_CALLSITES) {
+      for(uint32_t i = 0; ok && i < block.count; i++) {
+        traceCallsite c;
+        ok = readAll(f, &c, sizeof(c));
+        simCallsite* cs = &t->callsites[c.id];
+        memset(cs, 0, sizeof(simCallsite));
+        cs->watchedRatio = tuning.initWatchRatio;
+        cs->id = c.id;
+        cs->module = c.module;
+        cs->pc = c.pc;
+      }
+    } else if(block.type == TRACE_BLOCK_END && block.count == 1) {
+      ok = readAll(f, &t->end, sizeof(traceEnd));
+      t->hasEnd = ok;
+    } else {
+      fprintf(stderr, "Unknown block type %u in %s\n", block.type, path);
+      ok = false;
+    }
+    if(!ok) {
+      fprintf(stderr, "%s is cut short, replaying what was read\n", path);
+      break;
+    }
+  }
+  fclose(f);
+
+  // blocks of a thread are in order, the threads are merged here
+  std::stable_sort(t->events.begin(), t->events.end(),
+      [](const simEvent& a, const simEvent& b) { return a.tsc < b.tsc; });
+  return true;
+}
+
+// TSC ticks per ns, from the trace, or measured here when it has no end.
+static double tscPerNs(const simTrace* t) {
+  if(t->hasEnd && t->end.endNs > t->header.startNs) {
+    return (double)(t->end.endTsc - t->header.startTsc) / (t->end.endNs - t->header.startNs);
+  }
+  fprintf(stderr, "The trace has no end, assuming the TSC of this machine\n");
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t tsc = rdtsc();
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while((now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec) < 1e8);
+  return (rdtsc() - tsc) / ((now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec));
+}
+
+class simulator {
+
+  public:
+    simulator(int slots, bool preempt, unsigned long installNs, unsigned long removeNs)
+      : _slots(slots), _preempt(preempt), _installNs(installNs), _removeNs(removeNs), _curIndex(0), _threads(0),
+      _sampled(0), _unknown(0), _installs(0), _removals(0), _installCost(0), _removeCost(0) {
+      memset(_wp, 0, sizeof(_wp));
+      memset(_seen, 0, sizeof(_seen));
+    }
+
+    void allocate(simCallsite* cs, uint64_t addr, unsigned long now, uint64_t ns) {
+      _sampled++;
+      bool watched = false;
+      if(_preempt) {
+        // as causer::startWatch with PREEMPT_REPLACEMENT
+        bool firstAllocations = policy::inFirstAllocations(cs);
+        if(firstAllocations && usedSlots() < _slots) {
+          watched = setWatchpoint(cs, addr, now, ns, false);
+        }
+        if(!watched) {
+          int rnd = rng() % policy::drawBound(firstAllocations);
+          if(policy::drawWins(cs, rnd)) {
+            watched = setWatchpoint(cs, addr, now, ns, true);
+          }
+        }
+      } else if(usedSlots() < _slots) {
+        watched = setWatchpoint(cs, addr, now, ns, false);
+      }
+      policy::countAllocation(cs, watched);
+      policy::clampRatio(cs);
+      policy::updatePeriod(cs, now);
+    }
+
+    void release(uint64_t addr, uint64_t ns) {
+      for(int i = 0; i < _slots; i++) {
+        if(_wp[i].used && _wp[i].objectStart == addr) {
+          removeWatchpoint(&_wp[i], ns);
+        }
+      }
+    }
+
+    void unknown() {
+      _unknown++;
+    }
+
+    void noteThread(uint16_t thread) {
+      if(thread < xdefines::MAX_ALIVE_THREADS && !_seen[thread]) {
+        _seen[thread] = true;
+        _threads++;
+      }
+    }
+
+    void finish(uint64_t ns) {
+      for(int i = 0; i < _slots; i++) {
+        if(_wp[i].used) {
+          account(&_wp[i], ns);
+        }
+      }
+    }
+
+    void print(const simTrace* t, double seconds, int top, unsigned long sampleNs) {
+      printf("\n%-6s %10s %10s %12s\n", "slot", "occupied", "installs", "preemptions");
+      double occupied = 0;
+      for(int i = 0; i < _slots; i++) {
+        double share = _wp[i].usedNs / (seconds * 1e9);
+        occupied += share;
+        printf("%-6d %9.1f%% %10lu %12lu\n", i, 100 * share, _wp[i].installs, _wp[i].preemptions);
+      }
+      printf("mean occupancy %.1f%%\n", _slots > 0 ? 100 * occupied / _slots : 0);
+
+      double cost = _sampled * (double)sampleNs + _installCost + _removeCost;
+      printf("\nestimated overhead %.1f ms, %.2f%% of the trace: %lu sampled allocations, "
+          "%lu installs, %lu removals, %d threads\n",
+          cost / 1e6, 100 * cost / (seconds * 1e9), _sampled, _installs, _removals, _threads);
+      if(_unknown != 0) {
+        printf("%lu allocations without a callsite were not sampled\n", _unknown);
+      }
+
+      std::vector<const simCallsite*> sites;
+      unsigned long allocations = 0;
+      unsigned long covered = 0;
+      int watchedSites = 0;
+      for(std::map<uint32_t, simCallsite>::const_iterator i = t->callsites.begin(); i != t->callsites.end(); i++) {
+        const simCallsite* cs = &i->second;
+        if(cs->calledCounter == 0) {
+          continue;
+        }
+        sites.push_back(cs);
+        allocations += cs->calledCounter;
+        if(cs->watchedCounter != 0) {
+          watchedSites++;
+          covered += cs->calledCounter;
+        }
+      }
+      printf("\ncallsite coverage: %d of %zu callsites watched at least once, %.1f%% of the allocations\n",
+          watchedSites, sites.size(), allocations > 0 ? 100.0 * covered / allocations : 0);
+
+      std::sort(sites.begin(), sites.end(),
+          [](const simCallsite* a, const simCallsite* b) { return a->calledCounter > b->calledCounter; });
+      printf("%-8s %12s %10s %9s %10s  %s\n", "callsite", "allocations", "watched", "watched%", "slot time%", "pc");
+      for(int i = 0; i < top && i < (int)sites.size(); i++) {
+        const simCallsite* cs = sites[i];
+        std::map<uint32_t, std::string>::const_iterator m = t->modules.find(cs->module);
+        printf("%-8u %12lu %10lu %8.3f%% %9.1f%%  %s+0x%lx\n", cs->id, cs->calledCounter, cs->watchedCounter,
+            100.0 * cs->watchedCounter / cs->calledCounter, 100 * cs->slotNs / (seconds * 1e9),
+            m != t->modules.end() ? m->second.c_str() : "?", (unsigned long)cs->pc);
+      }
+    }
+
+  private:
+    int usedSlots() {
+      int n = 0;
+      for(int i = 0; i < _slots; i++) {
+        n += _wp[i].used;
+      }
+      return n;
+    }
+
+    // As watchpoint::setWatchpoint, an install never fails here.
+    bool setWatchpoint(simCallsite* cs, uint64_t addr, unsigned long now, uint64_t ns, bool ispreempt) {
+      int sidx = _curIndex;
+      for(int i = 0; i < _slots; i++) {
+        simSlot* obj = &_wp[sidx];
+        sidx = policy::nextSlot(sidx, _slots);
+
+        bool isavalid = !obj->used;
+        if(obj->used && ispreempt) {
+          isavalid = policy::canPreempt(cs->watchedRatio, obj->cs->watchedRatio,
+              now - obj->installTime, tuning.wpInstallMinTime);
+        }
+        if(!isavalid) {
+          continue;
+        }
+
+        if(obj->used) {
+          obj->preemptions++;
+          removeWatchpoint(obj, ns);
+        }
+        obj->used = true;
+        obj->objectStart = addr;
+        obj->cs = cs;
+        obj->installTime = now;
+        obj->installNs = ns;
+        obj->installs++;
+        _installs++;
+        _installCost += (double)_installNs * _threads;
+        _curIndex = sidx;
+        return true;
+      }
+      return false;
+    }
+
+    void removeWatchpoint(simSlot* obj, uint64_t ns) {
+      account(obj, ns);
+      obj->used = false;
+      _removals++;
+      _removeCost += (double)_removeNs * _threads;
+    }
+
+    void account(simSlot* obj, uint64_t ns) {
+      obj->usedNs += ns - obj->installNs;
+      obj->cs->slotNs += ns - obj->installNs;
+    }
+
+    int _slots;
+    bool _preempt;
+    unsigned long _installNs;
+    unsigned long _removeNs;
+    int _curIndex;
+    int _threads;
+    bool _seen[xdefines::MAX_ALIVE_THREADS];
+    simSlot _wp[xdefines::MAX_WATCHPOINTS];
+
+    unsigned long _sampled;
+    unsigned long _unknown;
+    unsigned long _installs;
+    unsigned long _removals;
+    double _installCost;
+    double _removeCost;
+};
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [-s seed] [-n callsites] [-P] [-i install ns] [-r remove ns] [-a sample ns] <trace>\n", name);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  unsigned long seed = 1;
+  int top = 20;
+  bool preempt = true;
+  unsigned long installNs = DEFAULT_INSTALL_NS;
+  unsigned long removeNs = DEFAULT_REMOVE_NS;
+  unsigned long sampleNs = DEFAULT_SAMPLE_NS;
+
+  int c;
+  while((c = getopt(argc, argv, "s:n:Pi:r:a:")) != -1) {
+    switch(c) {
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      case 'n': top = atoi(optarg); break;
+      case 'P': preempt = false; break;
+      case 'i': installNs = strtoul(optarg, NULL, 0); break;
+      case 'r': removeNs = strtoul(optarg, NULL, 0); break;
+      case 'a': sampleNs = strtoul(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+    }
+  }
+  if(optind != argc - 1) {
+    usage(argv[0]);
+  }
+
+  config::getInstance().load();
+  rngState = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+  simTrace trace;
+  if(!readTrace(argv[optind], &trace)) {
+    return 1;
+  }
+  if(trace.events.empty()) {
+    fprintf(stderr, "%s has no events\n", argv[optind]);
+    return 1;
+  }
+
+  double perNs = tscPerNs(&trace);
+  uint64_t firstTsc = trace.events.front().tsc;
+  double seconds = (trace.events.back().tsc - firstTsc) / perNs / 1e9;
+  if(seconds <= 0) {
+    seconds = 1e-9;
+  }
+
+  simulator sim(tuning.watchpoints, preempt, installNs, removeNs);
+  unsigned long allocations = 0;
+  for(size_t i = 0; i < trace.events.size(); i++) {
+    const simEvent* e = &trace.events[i];
+    uint64_t ns = (uint64_t)((e->tsc - firstTsc) / perNs);
+    sim.noteThread(e->thread);
+    if(e->op == TRACE_FREE) {
+      sim.release(e->addr, ns);
+      continue;
+    }
+    allocations++;
+    std::map<uint32_t, simCallsite>::iterator cs = trace.callsites.find(e->callsite);
+    if(cs == trace.callsites.end()) {
+      sim.unknown();
+      continue;
+    }
+    // in ms like the realtime clock of the library, which is far past the
+    // period 0 of a new callsite
+    sim.allocate(&cs->second, e->addr, ns / 1000000 + tuning.maxWatchPeriod + 1, ns);
+  }
+  sim.finish((uint64_t)((trace.events.back().tsc - firstTsc) / perNs));
+
+  printf("trace %s: pid %u, %zu events, %lu allocations, %zu callsites, %.3f s\n",
+      argv[optind], trace.header.pid, trace.events.size(), allocations, trace.callsites.size(), seconds);
+  if(trace.hasEnd && trace.end.lost != 0) {
+    printf("%lu events were lost while recording\n", (unsigned long)trace.end.lost);
+  }
+  printf("seed %lu, %d slots, preemption %s\n", seed, tuning.watchpoints, preempt ? "on" : "off");
+  sim.print(&trace, seconds, top, sampleNs);
+  return 0;
+}